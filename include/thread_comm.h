@@ -32,17 +32,38 @@ SOFTWARE.
 #define _GNU_SOURCE
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct circular_queue circular_queue;
 typedef struct dynamic_queue dynamic_queue;
 typedef struct channel channel;
+typedef struct conflating_queue conflating_queue;
+typedef struct priority_queue priority_queue;
+typedef struct delay_queue delay_queue;
+typedef struct journal_queue journal_queue;
+typedef struct msg_pool msg_pool;
+typedef struct ctcomm_buffer ctcomm_buffer;
+typedef struct rendezvous rendezvous;
+typedef struct call_slot call_slot;
+// Both are the reply slot of a call, seen from the caller's and from the
+// replier's side.
+typedef struct call_slot chan_future;
+typedef struct call_slot chan_request;
+typedef struct circq_producer circq_producer;
+typedef struct dynmq_producer dynmq_producer;
 
 typedef enum ctcomm_retval_t {
+  // A zero copy receive call came across a slice
+  ctcom_wrong_msg_kind = -8,
   // Unexpected failure
-  ctcom_unexpected_failure = -7,
+  ctcom_unexpected_failure,
   // No messages exist
   ctcom_container_empty,
   // No space for a new msg
@@ -59,8 +80,154 @@ typedef enum ctcomm_retval_t {
   ctcom_success_threshold
 } ctcomm_retval_t;
 
+// Waiters let callers which can not afford to park a thread per
+// consumer (coroutine schedulers, event loops) wait on a queue.
+// A waiter is armed by one of the '*_or_wait' functions and it is
+// notified exactly once, either with a message handed directly to it
+// (receive side) or once its own message made it into the queue
+// (send side). 'result' holds what the blocking call would have
+// returned. Please notice that 'notify' is invoked with the queue's
+// lock held, so it must not call back into the queue, it should only
+// hand the waiter over to a scheduler.
+typedef struct ctcomm_waiter {
+  void (*notify)(struct ctcomm_waiter* w);
+  void* ctx;
+
+  void* msg;
+  uint32_t msg_size;
+  int result;
+  // A receive waiter on a circular queue (or a channel) is handed slices
+  // and requests as well, with a result of ctcom_wrong_msg_kind. 'msg'
+  // and 'msg_size' are then the slice's data along with its 'buffer', or
+  // the request's message along with its 'req'; the other one is NULL.
+  ctcomm_buffer* buffer;
+  chan_request* req;
+
+  // Owned by the queue while the waiter is armed.
+  struct ctcomm_waiter* next;
+} ctcomm_waiter;
+
+// The allocator used for the internals of the queues, i.e. the queue
+// objects, the message slot arrays and the list nodes. The messages
+// themselves are still allocated by the callers. All three functions
+// are mandatory, 'ctx' is passed to them as is.
+typedef struct ctcomm_allocator {
+  void* (*alloc)(void* ctx, size_t size);
+  void* (*realloc)(void* ctx, void* ptr, size_t new_size);
+  void (*free)(void* ctx, void* ptr);
+  void* ctx;
+} ctcomm_allocator;
+
+// Sets the allocator used by the queues which are created without an
+// explicit one from now on, NULL restores malloc/realloc/free. Queues
+// keep the allocator they were created with. This is not synchronised
+// with the queue creation functions, please call it at start up.
+ctcomm_retval_t ctcomm_set_default_allocator(const ctcomm_allocator* alloc);
+
+// Refcounted buffers and slices
+// A slice is a piece of a refcounted buffer along with a reference to
+// it, so that a big input can be split into messages without copying
+// them out. Sending a slice through a circular queue (or a channel)
+// moves its reference, the buffer is freed once the last slice is
+// released. A slice without a buffer is an ordinary message, owned by
+// whoever holds it.
+typedef struct ctcomm_slice {
+  void* data;
+  uint32_t size;
+  ctcomm_buffer* buffer;
+} ctcomm_slice;
+
+// Both return a buffer with one reference held by the caller.
+// ctcomm_buffer_create() allocates 'size' bytes along with the buffer,
+// ctcomm_buffer_wrap() takes over 'data', which is given to 'free_fn'
+// (or free() if NULL) in the end.
+ctcomm_buffer* ctcomm_buffer_create(size_t size);
+ctcomm_buffer* ctcomm_buffer_wrap(void* data, size_t size,
+                                  void (*free_fn)(void* data, void* ctx),
+                                  void* ctx);
+void* ctcomm_buffer_data(ctcomm_buffer* b);
+size_t ctcomm_buffer_size(ctcomm_buffer* b);
+// Takes one more reference, returns 'b'.
+ctcomm_buffer* ctcomm_buffer_ref(ctcomm_buffer* b);
+void ctcomm_buffer_release(ctcomm_buffer* b);
+
+// Takes a reference for the new slice.
+ctcomm_retval_t ctcomm_slice_make(ctcomm_buffer* b, size_t offset,
+                                  uint32_t size, ctcomm_slice* slice);
+// Drops the slice's reference. A slice without a buffer is an ordinary
+// message, its data is given to free() like the queues' messages are; a
+// bufferless slice whose data came from anywhere else (a pool, a custom
+// allocator, chan_alloc_buf()) has to be freed by its holder instead.
+void ctcomm_slice_release(ctcomm_slice* slice);
+
 // Circular queue related functions
 circular_queue* circular_queue_create(uint32_t max_size, char** err_str);
+
+// Creation options, a zero initialised struct (or a NULL pointer) gives
+// the same queue circular_queue_create() does.
+typedef struct circq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+
+  // The following options make the msg_array an anonymous mapping of
+  // its own rather than an allocation, they are meant for rings with
+  // millions of slots.
+  // Explicit huge pages are tried first, transparent huge pages are
+  // requested if none are reserved.
+  bool use_hugepages;
+  // Binds the msg_array to 'numa_node', creation fails if that's not
+  // possible.
+  bool bind_to_numa_node;
+  int numa_node;
+  // Touches every page of the msg_array at creation time, so the first
+  // pass over the ring doesn't take page faults on the hot path.
+  bool prefault;
+
+  // Elastic queues start with a small slot array ('initial_size' slots
+  // rounded up to a power of two, 64 if zero) and double it whenever it
+  // fills up, until it reaches max_size. Sending still blocks/fails
+  // only once max_size messages are queued; a send which needs the
+  // array to grow can also fail with ctcom_not_enough_memory.
+  bool elastic;
+  uint32_t initial_size;
+  // If non-zero, an elastic array is halved after that many consecutive
+  // receives which left it at most a quarter full.
+  uint32_t shrink_after;
+
+  // Lossy queues never block or reject a sender because of the queue
+  // being full, the oldest message is evicted instead and handed over to
+  // 'drop_cb' (if any) so that it can be freed or accounted for. The
+  // callback is invoked after the queue's lock is released.
+  bool overwrite_oldest;
+  void (*drop_cb)(void* msg, uint32_t msg_size, void* drop_ctx);
+  void* drop_ctx;
+
+  // Puts the condition variables on CLOCK_MONOTONIC rather than
+  // CLOCK_REALTIME, so the timed calls aren't affected by the wall
+  // clock being stepped. The deadlines given to the '*_until_*'
+  // functions are on the same clock.
+  bool monotonic_clock;
+
+  // Stack mode: receivers get the most recently sent message, which is
+  // the one most likely to still be in the cache. A lossy queue still
+  // evicts the oldest message.
+  bool lifo;
+
+  // Copy mode: a non-zero value gives the queue an arena of that many
+  // bytes (rounded up to a multiple of 8) which the messages are copied
+  // into, see circq_send_copy(). Such a queue only takes the copy mode
+  // calls, and can't be lossy.
+  uint32_t copy_arena_size;
+
+  // Loaning: a non-zero value gives the queue max_size slots of that
+  // many bytes (rounded up to a multiple of 16), see circq_loan(). The
+  // same restrictions as the copy mode apply, the two are exclusive.
+  uint32_t loan_slot_size;
+} circq_opts;
+
+circular_queue* circular_queue_create_with_opts(uint32_t max_size,
+                                                const circq_opts* opts,
+                                                char** err_str);
 void __circular_queue_destroy(circular_queue* cq);
 
 #define circular_queue_destroy(cq) \
@@ -85,10 +252,118 @@ ctcomm_retval_t circq_try_recv_zc(circular_queue* cq, void** target_buf);
 ctcomm_retval_t circq_timed_recv_zc(circular_queue* cq, void** target_buf,
                                     struct timespec* timeout);
 
+// Deadline based counterparts of the timed functions, 'deadline' is an
+// absolute time on the queue's clock (see circq_opts.monotonic_clock).
+// A caller retrying against the same deadline doesn't have to read the
+// clock over and over again.
+ctcomm_retval_t circq_send_until_zc(circular_queue* cq, void** msg,
+                                    uint32_t msg_size,
+                                    const struct timespec* deadline);
+ctcomm_retval_t circq_recv_until_zc(circular_queue* cq, void** target_buf,
+                                    const struct timespec* deadline);
+
 ctcomm_retval_t circq_disable_sending(circular_queue* cq);
 ctcomm_retval_t circq_enable_sending(circular_queue* cq);
 
 int circq_msg_count(circular_queue* cq);
+// The number of messages evicted so far by a lossy queue.
+uint64_t circq_dropped_count(circular_queue* cq);
+
+// Blocks until there is at least one message, then lingers until either
+// 'min_count' messages have piled up or 'linger' has passed, whichever
+// comes first. Up to 'max_count' messages are then moved into 'bufs' and
+// their sizes into 'sizes' (which may be NULL). Producers only wake the
+// caller up when the threshold is reached, not on every message.
+// Returns the number of messages received.
+ctcomm_retval_t circq_recv_batch_min(circular_queue* cq, void** bufs,
+                                     uint32_t* sizes, uint32_t min_count,
+                                     uint32_t max_count,
+                                     struct timespec* linger);
+
+// Non-blocking counterparts of circq_recv_zc/circq_send_zc. They either
+// complete right away, or arm 'w' and return ctcom_container_empty/
+// ctcom_container_full. A send waiter takes over '*msg' while armed; if
+// sending gets disabled in the meantime it is notified with
+// ctcom_writing_disabled and the message is left in 'w->msg'.
+ctcomm_retval_t circq_recv_or_wait(circular_queue* cq, void** target_buf,
+                                   ctcomm_waiter* w);
+ctcomm_retval_t circq_send_or_wait(circular_queue* cq, void** msg,
+                                   uint32_t msg_size, ctcomm_waiter* w);
+// Returns true if 'w' was still armed. Otherwise, it has already been
+// notified.
+bool circq_cancel_wait(circular_queue* cq, ctcomm_waiter* w);
+
+// Copy mode functions, for queues created with a copy_arena_size.
+// A message takes 8 bytes plus its size rounded up to a multiple of 8
+// in the arena, senders block (or fail) until both a slot and that much
+// contiguous space are available. Nothing is allocated per message.
+ctcomm_retval_t circq_send_copy(circular_queue* cq, const void* buf,
+                                uint32_t len);
+ctcomm_retval_t circq_try_send_copy(circular_queue* cq, const void* buf,
+                                    uint32_t len);
+ctcomm_retval_t circq_timed_send_copy(circular_queue* cq, const void* buf,
+                                      uint32_t len,
+                                      struct timespec* timeout);
+
+// Copy the message out into 'buf'. A message which doesn't fit into
+// 'buf_size' bytes is left in the queue and ctcom_invalid_arguments is
+// returned.
+ctcomm_retval_t circq_recv_copy(circular_queue* cq, void* buf,
+                                uint32_t buf_size);
+ctcomm_retval_t circq_try_recv_copy(circular_queue* cq, void* buf,
+                                    uint32_t buf_size);
+ctcomm_retval_t circq_timed_recv_copy(circular_queue* cq, void* buf,
+                                      uint32_t buf_size,
+                                      struct timespec* timeout);
+
+// '*view' points at the message in the arena (or in its slot, for
+// loaning queues), which stays valid and keeps its space until it's
+// given to circq_release_view(). Views can be released in any order.
+// Releasing a view twice, or anything which isn't a view, returns
+// ctcom_invalid_arguments.
+ctcomm_retval_t circq_recv_view(circular_queue* cq, const void** view);
+ctcomm_retval_t circq_try_recv_view(circular_queue* cq, const void** view);
+ctcomm_retval_t circq_timed_recv_view(circular_queue* cq, const void** view,
+                                      struct timespec* timeout);
+ctcomm_retval_t circq_release_view(circular_queue* cq, const void* view);
+
+// Loaning functions, for queues created with a loan_slot_size.
+// A producer borrows a slot, builds the message in place and commits
+// it; the consumer receives it with circq_recv_view() and friends and
+// gives the slot back with circq_release_view(). Nothing is copied or
+// allocated. A loaned slot which won't be committed is given back with
+// circq_release_view() as well. Committing a slot which isn't loaned, or
+// releasing one which is neither loaned nor received, returns
+// ctcom_invalid_arguments.
+// Loaning blocks (or fails) while all the slots are in use, the slot
+// size is returned on success.
+ctcomm_retval_t circq_loan(circular_queue* cq, void** slot);
+ctcomm_retval_t circq_try_loan(circular_queue* cq, void** slot);
+ctcomm_retval_t circq_timed_loan(circular_queue* cq, void** slot,
+                                 struct timespec* timeout);
+// Queues the first 'len' bytes of the slot, never blocks. The slot stays
+// loaned if it can't be queued, an elastic ring may fail to grow.
+ctcomm_retval_t circq_commit_loan(circular_queue* cq, void* slot,
+                                  uint32_t len);
+
+// Slice functions, '*slice' is cleared once the queue has taken it
+// over. The zero copy receive calls leave a slice in the queue and
+// return ctcom_wrong_msg_kind, the slice ones receive any message (a
+// zero copy one comes without a buffer). Evicting a slice from a lossy
+// queue releases it rather than calling drop_cb.
+ctcomm_retval_t circq_send_slice(circular_queue* cq, ctcomm_slice* slice);
+ctcomm_retval_t circq_try_send_slice(circular_queue* cq,
+                                     ctcomm_slice* slice);
+ctcomm_retval_t circq_timed_send_slice(circular_queue* cq,
+                                       ctcomm_slice* slice,
+                                       struct timespec* timeout);
+
+ctcomm_retval_t circq_recv_slice(circular_queue* cq, ctcomm_slice* slice);
+ctcomm_retval_t circq_try_recv_slice(circular_queue* cq,
+                                     ctcomm_slice* slice);
+ctcomm_retval_t circq_timed_recv_slice(circular_queue* cq,
+                                       ctcomm_slice* slice,
+                                       struct timespec* timeout);
 
 // Dynamic queue related functions
 // Dynamic queues will try to accept messages as much as
@@ -98,6 +373,33 @@ int circq_msg_count(circular_queue* cq);
 // it should directly succeed or fail depending on the
 // availability of memory.
 dynamic_queue* dynamic_queue_create(char** err_str);
+
+typedef struct dynmq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // See circq_opts.monotonic_clock
+  bool monotonic_clock;
+  // Receivers take the most recently sent message, see circq_opts.lifo.
+  // Tagged receives still get the oldest message with the tag, and
+  // chains keep the order messages were sent in.
+  bool lifo;
+
+  // Spill mode, enabled by a non-NULL 'spill_dir'. Once the payloads
+  // held in memory add up to 'spill_budget' bytes, further messages are
+  // written to append only, memory mapped segment files of
+  // 'spill_segment_size' bytes (0 means 64MiB) in 'spill_dir', until the
+  // consumers catch up. They're paged back in order, and the segment
+  // files are deleted as soon as they're fully consumed. Payloads must
+  // be allocated with the queue's allocator: spilled ones are freed, and
+  // the ones paged back in are allocated with it. Spilling queues can't
+  // be LIFO, and don't support handles, tags or dynmq_send_chain.
+  const char* spill_dir;
+  size_t spill_budget;
+  size_t spill_segment_size;
+} dynmq_opts;
+
+dynamic_queue* dynamic_queue_create_with_opts(const dynmq_opts* opts,
+                                              char** err_str);
 void __dynamic_queue_destroy(dynamic_queue* dq);
 
 #define dynamic_queue_destroy(dq) \
@@ -112,14 +414,156 @@ ctcomm_retval_t dynmq_recv_zc(dynamic_queue* dq, void** target_buf);
 ctcomm_retval_t dynmq_try_recv_zc(dynamic_queue* dq, void** target_buf);
 ctcomm_retval_t dynmq_timed_recv_zc(dynamic_queue* dq, void** target_buf,
                                     struct timespec* timeout);
+ctcomm_retval_t dynmq_recv_until_zc(dynamic_queue* dq, void** target_buf,
+                                    const struct timespec* deadline);
 
 ctcomm_retval_t dynmq_disable_sending(dynamic_queue* dq);
 ctcomm_retval_t dynmq_enable_sending(dynamic_queue* dq);
 
 int dynmq_msg_count(dynamic_queue* dq);
+// The number of messages on disk, see dynmq_opts.spill_dir.
+int dynmq_spilled_count(dynamic_queue* dq);
+
+// See circq_recv_batch_min
+ctcomm_retval_t dynmq_recv_batch_min(dynamic_queue* dq, void** bufs,
+                                     uint32_t* sizes, uint32_t min_count,
+                                     uint32_t max_count,
+                                     struct timespec* linger);
+
+// Sending to a dynamic queue never blocks, hence only the receive side
+// has a waiter based variant.
+ctcomm_retval_t dynmq_recv_or_wait(dynamic_queue* dq, void** target_buf,
+                                   ctcomm_waiter* w);
+bool dynmq_cancel_wait(dynamic_queue* dq, ctcomm_waiter* w);
+
+// Selective receive: tagged messages are queued along with the untagged
+// ones, and are received in FIFO order by the plain receive functions
+// too. The tagged receive functions take the oldest message with the
+// given tag in O(1), leaving the rest of the queue as it is.
+ctcomm_retval_t dynmq_send_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                     void** msg, uint32_t msg_size);
+ctcomm_retval_t dynmq_recv_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                     void** target_buf);
+ctcomm_retval_t dynmq_try_recv_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                         void** target_buf);
+
+struct dllist_node;
+
+// Handles let the sender cancel or move a message while it is still
+// queued. Every handle has to be released with dynmq_handle_release
+// before the queue is destroyed, received messages included. Messages
+// detached by dynmq_recv_all can't be reached through their handles
+// anymore.
+typedef struct dllist_node dynmq_handle;
+
+ctcomm_retval_t dynmq_send_with_handle_zc(dynamic_queue* dq, void** msg,
+                                          uint32_t msg_size,
+                                          dynmq_handle** handle);
+// Takes the message out of the queue and gives it back. Returns
+// ctcom_container_empty if it has already left the queue.
+ctcomm_retval_t dynmq_cancel(dynamic_queue* dq, dynmq_handle* handle,
+                             void** target_buf);
+// Moves the message to where it's received next from, the head of the
+// queue (or the tail for LIFO queues).
+// Returns ctcom_container_empty if it has already left the queue.
+ctcomm_retval_t dynmq_requeue_front(dynamic_queue* dq, dynmq_handle* handle);
+void dynmq_handle_release(dynamic_queue* dq, dynmq_handle* handle);
+
+// A chain is a list of messages detached from, or about to be spliced
+// into, a dynamic queue. Chains aren't synchronised, they're meant to
+// be owned by a single thread while they're off the queue.
+typedef struct dynmq_chain {
+  struct dllist_node* head;
+  struct dllist_node* tail;
+  uint32_t count;
+  ctcomm_allocator allocator;
+} dynmq_chain;
+
+// Prepares an empty chain which can be sent to 'dq', or to any dynamic
+// queue using the same allocator.
+ctcomm_retval_t dynmq_chain_init(dynmq_chain* chain, dynamic_queue* dq);
+// Neither of them takes any locks.
+ctcomm_retval_t dynmq_chain_push(dynmq_chain* chain, void** msg,
+                                 uint32_t msg_size);
+// Returns ctcom_container_empty at the end of the chain.
+ctcomm_retval_t dynmq_chain_pop(dynmq_chain* chain, void** target_buf);
+
+// Moves every message in the queue into 'chain' in a single critical
+// section, 'chain' doesn't need to be initialised. Doesn't block, returns
+// the number of messages moved.
+ctcomm_retval_t dynmq_recv_all(dynamic_queue* dq, dynmq_chain* chain);
+// Appends the whole chain to the queue in a single critical section and
+// leaves it empty. Returns the number of messages sent.
+ctcomm_retval_t dynmq_send_chain(dynamic_queue* dq, dynmq_chain* chain);
+
+// Producer handles stage messages in a private buffer and publish them
+// to the queue in one go, taking the queue's lock once per batch rather
+// than once per message. A handle must only be used by one thread at a
+// time. Staged messages are published when 'capacity' of them have piled
+// up, on an explicit flush, or by the first send after the oldest one
+// has waited for 'max_latency' (NULL means no bound). Since there is no
+// timer involved, an idle producer should flush on its own.
+//
+// Send returns the message size once the message is staged. Publishing
+// failures (e.g. sending being disabled) are returned by the flush
+// functions, and by the next send if the buffer is still full; the
+// messages which couldn't be published stay staged. Destroying a
+// producer flushes it and passes whatever couldn't be published to
+// 'release_cb'.
+typedef struct prod_opts {
+  // NULL means no bound.
+  const struct timespec* max_latency;
+  // NULL means free(), which doesn't suit messages from a custom
+  // allocator, a message pool or chan_alloc_buf().
+  void (*release_cb)(void* msg, uint32_t msg_size, void* release_ctx);
+  void* release_ctx;
+} prod_opts;
+
+circq_producer* circq_producer_create(circular_queue* cq, uint32_t capacity,
+                                      const struct timespec* max_latency,
+                                      char** err_str);
+circq_producer* circq_producer_create_with_opts(circular_queue* cq,
+                                                uint32_t capacity,
+                                                const prod_opts* opts,
+                                                char** err_str);
+void __circq_producer_destroy(circq_producer* prod);
+
+#define circq_producer_destroy(prod) \
+  do {                               \
+    __circq_producer_destroy(prod);  \
+    prod = NULL;                     \
+  } while (0)
+
+// Blocks like circq_send_zc when it has to flush into a full queue.
+ctcomm_retval_t circq_prod_send_zc(circq_producer* prod, void** msg,
+                                   uint32_t msg_size);
+// Returns the number of messages published.
+ctcomm_retval_t circq_prod_flush(circq_producer* prod);
+
+dynmq_producer* dynmq_producer_create(dynamic_queue* dq, uint32_t capacity,
+                                      const struct timespec* max_latency,
+                                      char** err_str);
+dynmq_producer* dynmq_producer_create_with_opts(dynamic_queue* dq,
+                                                uint32_t capacity,
+                                                const prod_opts* opts,
+                                                char** err_str);
+void __dynmq_producer_destroy(dynmq_producer* prod);
+
+#define dynmq_producer_destroy(prod) \
+  do {                               \
+    __dynmq_producer_destroy(prod);  \
+    prod = NULL;                     \
+  } while (0)
+
+ctcomm_retval_t dynmq_prod_send_zc(dynmq_producer* prod, void** msg,
+                                   uint32_t msg_size);
+ctcomm_retval_t dynmq_prod_flush(dynmq_producer* prod);
 
 // Channel related functions
 channel* channel_create(uint32_t max_size, char** err_str);
+// Both of the underlying circular queues are created with 'opts'.
+channel* channel_create_with_opts(uint32_t max_size, const circq_opts* opts,
+                                  char** err_str);
 void __channel_destroy(channel* ch);
 
 #define channel_destroy(ch) \
@@ -138,6 +582,11 @@ ctcomm_retval_t chan_try_recv_zc(channel* ch, void** target_buf);
 ctcomm_retval_t chan_timed_recv_zc(channel* ch, void** target_buf,
                                    struct timespec* timeout);
 
+ctcomm_retval_t chan_send_until_zc(channel* ch, void** msg, uint32_t msg_size,
+                                   const struct timespec* deadline);
+ctcomm_retval_t chan_recv_until_zc(channel* ch, void** target_buf,
+                                   const struct timespec* deadline);
+
 typedef enum channel_direction {
   owner_to_workers = 0,
   workers_to_owner
@@ -147,3 +596,425 @@ ctcomm_retval_t chan_disable_sending(channel* ch, channel_direction d);
 ctcomm_retval_t chan_enable_sending(channel* ch, channel_direction d);
 
 int chan_msg_count(channel* ch, channel_direction d);
+
+ctcomm_retval_t chan_recv_or_wait(channel* ch, void** target_buf,
+                                  ctcomm_waiter* w);
+ctcomm_retval_t chan_send_or_wait(channel* ch, void** msg, uint32_t msg_size,
+                                  ctcomm_waiter* w);
+bool chan_cancel_wait(channel* ch, ctcomm_waiter* w);
+
+// Calls
+// A call sends a request the same way chan_send_zc() does, and the
+// reply goes straight into a one-shot slot of the caller, which is woken
+// up once. The other side receives the requests with the functions
+// below, along with the ordinary messages; '*req' is set for the
+// requests and NULL for the rest. Every request has to be replied to
+// exactly once. The zero copy receive calls leave a request in the
+// queue and return ctcom_wrong_msg_kind. Calls can't be made on lossy
+// channels. Timeouts are on CLOCK_MONOTONIC.
+// Returns the size of the reply, which goes into '*reply'.
+ctcomm_retval_t chan_call(channel* ch, void** msg, uint32_t msg_size,
+                          void** reply);
+// The timeout covers both sending and waiting for the reply. A reply
+// which comes after the timeout is released as chan_reply*() says.
+ctcomm_retval_t chan_timed_call(channel* ch, void** msg, uint32_t msg_size,
+                                void** reply, struct timespec* timeout);
+
+// Sends the request and returns right away, the reply is waited for
+// through '*f', which has to be released.
+ctcomm_retval_t chan_call_async(channel* ch, void** msg, uint32_t msg_size,
+                                chan_future** f);
+// Return the size of the reply, which can only be taken once.
+// chan_future_try_get() returns ctcom_container_empty while it's not
+// there.
+ctcomm_retval_t chan_future_wait(chan_future* f, void** reply);
+ctcomm_retval_t chan_future_try_get(chan_future* f, void** reply);
+ctcomm_retval_t chan_future_timed_wait(chan_future* f, void** reply,
+                                       struct timespec* timeout);
+// Gives up on the reply if it's not there yet; it's released once it
+// comes. A reply which has come but hasn't been taken is released.
+void chan_future_release(chan_future* f);
+
+ctcomm_retval_t chan_recv_request(channel* ch, void** msg,
+                                  chan_request** req);
+ctcomm_retval_t chan_try_recv_request(channel* ch, void** msg,
+                                      chan_request** req);
+ctcomm_retval_t chan_timed_recv_request(channel* ch, void** msg,
+                                        chan_request** req,
+                                        struct timespec* timeout);
+// Takes over '*reply', 'req' can't be used afterwards. A reply the
+// caller has given up on goes to 'release_cb', which is run by whichever
+// side finds the call abandoned. chan_reply() passes NULL, which means
+// free() and doesn't suit replies from a custom allocator, a message
+// pool or chan_alloc_buf().
+ctcomm_retval_t chan_reply(chan_request* req, void** reply,
+                           uint32_t reply_size);
+ctcomm_retval_t chan_reply_with_release(chan_request* req, void** reply,
+                                        uint32_t reply_size,
+                                        void (*release_cb)(void*, uint32_t,
+                                                           void*),
+                                        void* release_ctx);
+
+// The circq_*_slice() counterparts.
+ctcomm_retval_t chan_send_slice(channel* ch, ctcomm_slice* slice);
+ctcomm_retval_t chan_try_send_slice(channel* ch, ctcomm_slice* slice);
+ctcomm_retval_t chan_timed_send_slice(channel* ch, ctcomm_slice* slice,
+                                      struct timespec* timeout);
+ctcomm_retval_t chan_recv_slice(channel* ch, ctcomm_slice* slice);
+ctcomm_retval_t chan_try_recv_slice(channel* ch, ctcomm_slice* slice);
+ctcomm_retval_t chan_timed_recv_slice(channel* ch, ctcomm_slice* slice,
+                                      struct timespec* timeout);
+
+// Buffer recycling. chan_alloc_buf() hands out a buffer of at least
+// 'size' bytes, which is sent as usual. Instead of freeing it, the
+// receiving side gives it back with chan_return_bufs(), ideally a batch
+// at a time, and the side which allocated it reuses it for its next
+// sends. Every buffer remembers that side, so buffers which are echoed
+// back or returned by their own side still end up there. Returning is
+// done on a lane of its own, it never waits for the queues. The owner
+// takes everything returned to it at once into a cache only it touches;
+// the workers share theirs.
+// These buffers must not be given to free(), chan_free_buf() releases
+// one for good. The ones still returned are freed with the channel.
+void* chan_alloc_buf(channel* ch, uint32_t size);
+// Sets the returned entries to NULL, NULL entries are skipped.
+ctcomm_retval_t chan_return_bufs(channel* ch, void** bufs, uint32_t count);
+void chan_free_buf(channel* ch, void* buf);
+
+// Conflating queue related functions
+// Every message of a conflating queue carries a 64 bit key. Sending a
+// message whose key already has an unconsumed message in the queue
+// replaces that message in place (keeping its position), the replaced
+// one is passed to 'release_cb'. Hence the receivers see the latest
+// value of each key, in the order the keys first arrived, and the
+// memory use is bounded by the number of distinct keys rather than the
+// update rate. Like dynamic queues, sending never blocks.
+typedef struct conflq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // Invoked after the queue's lock is released, NULL means free().
+  void (*release_cb)(void* msg, uint32_t msg_size, void* release_ctx);
+  void* release_ctx;
+} conflq_opts;
+
+conflating_queue* conflating_queue_create(const conflq_opts* opts,
+                                          char** err_str);
+void __conflating_queue_destroy(conflating_queue* cfq);
+
+#define conflating_queue_destroy(cfq) \
+  do {                                \
+    __conflating_queue_destroy(cfq);  \
+    cfq = NULL;                       \
+  } while (0)
+
+ctcomm_retval_t conflq_send_zc(conflating_queue* cfq, uint64_t key,
+                               void** msg, uint32_t msg_size);
+
+// 'key' is optional, it receives the key of the message if not NULL.
+ctcomm_retval_t conflq_recv_zc(conflating_queue* cfq, uint64_t* key,
+                               void** target_buf);
+ctcomm_retval_t conflq_try_recv_zc(conflating_queue* cfq, uint64_t* key,
+                                   void** target_buf);
+ctcomm_retval_t conflq_timed_recv_zc(conflating_queue* cfq, uint64_t* key,
+                                     void** target_buf,
+                                     struct timespec* timeout);
+
+ctcomm_retval_t conflq_disable_sending(conflating_queue* cfq);
+ctcomm_retval_t conflq_enable_sending(conflating_queue* cfq);
+
+int conflq_msg_count(conflating_queue* cfq);
+// The number of messages which were replaced before being received.
+uint64_t conflq_conflated_count(conflating_queue* cfq);
+
+// Priority queue related functions
+// A priority queue has a fixed number of levels (up to 64), level 0
+// being the most urgent one. Each level is a FIFO of its own which grows
+// on demand, so like dynamic queues sending never blocks. Receivers get
+// the oldest message of the most urgent non-empty level.
+#define prioq_max_levels 64
+
+typedef struct prioq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // If non-zero, every 'aging_interval'th receive is served from one of
+  // the other non-empty levels instead, taking turns among them, so
+  // that no level can be starved by a steady stream of more urgent
+  // messages.
+  uint32_t aging_interval;
+} prioq_opts;
+
+priority_queue* priority_queue_create(uint32_t levels, const prioq_opts* opts,
+                                      char** err_str);
+void __priority_queue_destroy(priority_queue* pq);
+
+#define priority_queue_destroy(pq) \
+  do {                             \
+    __priority_queue_destroy(pq);  \
+    pq = NULL;                     \
+  } while (0)
+
+ctcomm_retval_t prioq_send_zc(priority_queue* pq, uint32_t prio, void** msg,
+                              uint32_t msg_size);
+
+// 'prio' is optional, it receives the level of the message if not NULL.
+ctcomm_retval_t prioq_recv_zc(priority_queue* pq, void** target_buf,
+                              uint32_t* prio);
+ctcomm_retval_t prioq_try_recv_zc(priority_queue* pq, void** target_buf,
+                                  uint32_t* prio);
+ctcomm_retval_t prioq_timed_recv_zc(priority_queue* pq, void** target_buf,
+                                    uint32_t* prio, struct timespec* timeout);
+
+ctcomm_retval_t prioq_disable_sending(priority_queue* pq);
+ctcomm_retval_t prioq_enable_sending(priority_queue* pq);
+
+int prioq_msg_count(priority_queue* pq);
+
+// Delay queue related functions
+// Messages of a delay queue become receivable once their delay has
+// elapsed (or their deadline has arrived). They are kept in a
+// hierarchical timing wheel, so both scheduling and expiring are O(1).
+// There is no timer thread, the wheel is advanced by the receivers,
+// and a blocking receiver sleeps until the next deadline. Deadlines are
+// on CLOCK_MONOTONIC and rounded up to the tick of the queue.
+typedef struct delayq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // The resolution of the wheel, 0 means one millisecond.
+  uint64_t tick_ns;
+} delayq_opts;
+
+// Identifies a scheduled message, it goes stale once the message is
+// received or cancelled.
+typedef struct delayq_handle {
+  void* node;
+  uint64_t seq;
+} delayq_handle;
+
+delay_queue* delay_queue_create(const delayq_opts* opts, char** err_str);
+void __delay_queue_destroy(delay_queue* dlq);
+
+#define delay_queue_destroy(dlq) \
+  do {                           \
+    __delay_queue_destroy(dlq);  \
+    dlq = NULL;                  \
+  } while (0)
+
+// 'handle' is optional.
+ctcomm_retval_t delayq_send_after(delay_queue* dlq, void** msg,
+                                  uint32_t msg_size,
+                                  const struct timespec* delay,
+                                  delayq_handle* handle);
+ctcomm_retval_t delayq_send_at(delay_queue* dlq, void** msg,
+                               uint32_t msg_size,
+                               const struct timespec* deadline,
+                               delayq_handle* handle);
+
+// Takes a message back, whether it's due or not, as long as it hasn't
+// been received yet. Returns ctcom_container_empty for stale handles.
+ctcomm_retval_t delayq_cancel(delay_queue* dlq, delayq_handle* handle,
+                              void** target_buf);
+
+ctcomm_retval_t delayq_recv_zc(delay_queue* dlq, void** target_buf);
+ctcomm_retval_t delayq_try_recv_zc(delay_queue* dlq, void** target_buf);
+ctcomm_retval_t delayq_timed_recv_zc(delay_queue* dlq, void** target_buf,
+                                     struct timespec* timeout);
+
+ctcomm_retval_t delayq_disable_sending(delay_queue* dlq);
+ctcomm_retval_t delayq_enable_sending(delay_queue* dlq);
+
+// Counts both the pending and the due messages.
+int delayq_msg_count(delay_queue* dlq);
+
+// Journal queue related functions
+// A journal queue copies every message into a rolling log of memory
+// mapped segment files in a directory, and persists the position of its
+// (single) consumer there too. Reopening the directory, say after a
+// restart, resumes from the last committed position; messages received
+// but not committed are delivered again. Received messages are returned
+// as pointers into the log, there's nothing to free and nothing to
+// deserialise. Segments are deleted once the committed position has
+// moved past them. Records and the committed position are checksummed:
+// after a power loss, a record which didn't make it to the disk in full
+// ends the journal, and a torn commit falls back to the previous one.
+typedef enum jrnq_sync_policy {
+  // Leave writing back to the kernel, this survives the process dying
+  // but not the machine.
+  jrnq_sync_none,
+  // Sync once 'sync_interval' has passed since the last sync, checked by
+  // the send and commit calls.
+  jrnq_sync_periodic,
+  // Sync before every send (or send batch) and commit call returns.
+  jrnq_sync_per_batch
+} jrnq_sync_policy;
+
+typedef struct jrnq_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // 0 means 64MiB, bigger messages get a segment of their own.
+  size_t segment_size;
+  jrnq_sync_policy sync_policy;
+  struct timespec sync_interval;
+} jrnq_opts;
+
+// 'dir' has to exist, an existing journal in it is reopened.
+journal_queue* journal_queue_create(const char* dir, const jrnq_opts* opts,
+                                    char** err_str);
+void __journal_queue_destroy(journal_queue* jq);
+
+#define journal_queue_destroy(jq) \
+  do {                            \
+    __journal_queue_destroy(jq);  \
+    jq = NULL;                    \
+  } while (0)
+
+// Both copy the messages into the log.
+ctcomm_retval_t jrnq_send(journal_queue* jq, const void* msg,
+                          uint32_t msg_size);
+// Returns the number of messages written.
+ctcomm_retval_t jrnq_send_batch(journal_queue* jq, const void** msgs,
+                                const uint32_t* sizes, uint32_t count);
+
+// '*msg' points into the log and stays valid until the next commit.
+// Timeouts are on CLOCK_MONOTONIC.
+ctcomm_retval_t jrnq_recv(journal_queue* jq, const void** msg);
+ctcomm_retval_t jrnq_try_recv(journal_queue* jq, const void** msg);
+ctcomm_retval_t jrnq_timed_recv(journal_queue* jq, const void** msg,
+                                struct timespec* timeout);
+
+// Persists the position after the last received message.
+ctcomm_retval_t jrnq_commit(journal_queue* jq);
+// Syncs the log and the position regardless of the policy.
+ctcomm_retval_t jrnq_sync(journal_queue* jq);
+
+// Message pool related functions
+// A message pool hands out the buffers to be sent through the zero copy
+// calls, and takes them back on the receiving side, without the malloc/
+// free round trip across threads. Buffers are grouped into power of two
+// size classes. Every thread keeps two magazines (free lists) per class,
+// so most calls don't take any lock; a thread which frees more than it
+// allocates hands full magazines back to the pool's depot in one go, and
+// an allocating thread reloads from there.
+// Pool buffers have to be freed with msgpool_free(), so don't leave
+// them in a queue which frees what it holds on destruction. The pool
+// has to outlive the threads which have used it, or be destroyed once
+// none of them uses it anymore; a pool takes one pthread key.
+typedef struct msgpool_opts {
+  // NULL means the default allocator.
+  const ctcomm_allocator* allocator;
+  // Buffers per magazine, 0 means 32.
+  uint32_t magazine_size;
+  // 0 means 64KiB, can't exceed 2GiB. Bigger buffers come from the
+  // allocator every time.
+  uint32_t max_buffer_size;
+} msgpool_opts;
+
+typedef struct msgpool_stats {
+  // Allocations served from a magazine, the hit rate is
+  // hits / (hits + misses + oversized).
+  uint64_t hits;
+  // Allocations which had to go to the allocator.
+  uint64_t misses;
+  uint64_t oversized;
+  uint64_t frees;
+  // Full magazines handed back to the depot by the freeing threads.
+  uint64_t returned_magazines;
+} msgpool_stats;
+
+msg_pool* msg_pool_create(const msgpool_opts* opts, char** err_str);
+void __msg_pool_destroy(msg_pool* pool);
+
+#define msg_pool_destroy(pool) \
+  do {                         \
+    __msg_pool_destroy(pool);  \
+    pool = NULL;               \
+  } while (0)
+
+// Returns NULL if the allocator fails.
+void* msgpool_alloc(msg_pool* pool, uint32_t size);
+// Can be called from any thread, not just the allocating one.
+void msgpool_free(msg_pool* pool, void* buf);
+// Sums the counters of all the threads.
+ctcomm_retval_t msgpool_get_stats(msg_pool* pool, msgpool_stats* stats);
+
+// Rendezvous related functions
+// A rendezvous has no capacity at all: a send completes only once a
+// receiver has taken the message, and vice versa. Whoever comes second
+// moves the message straight from/into the waiting side's stack slot and
+// wakes it up with a single futex call. Waiters are served in arrival
+// order. Timeouts are on CLOCK_MONOTONIC.
+rendezvous* rendezvous_create(char** err_str);
+// There should be nobody waiting on 'r' anymore.
+void __rendezvous_destroy(rendezvous* r);
+
+#define rendezvous_destroy(r) \
+  do {                        \
+    __rendezvous_destroy(r);  \
+    r = NULL;                 \
+  } while (0)
+
+// The try functions only succeed if the other side is already waiting,
+// otherwise they return ctcom_container_full/ctcom_container_empty.
+ctcomm_retval_t rdv_send_zc(rendezvous* r, void** msg, uint32_t msg_size);
+ctcomm_retval_t rdv_try_send_zc(rendezvous* r, void** msg,
+                                uint32_t msg_size);
+ctcomm_retval_t rdv_timed_send_zc(rendezvous* r, void** msg,
+                                  uint32_t msg_size,
+                                  struct timespec* timeout);
+
+ctcomm_retval_t rdv_recv_zc(rendezvous* r, void** target_buf);
+ctcomm_retval_t rdv_try_recv_zc(rendezvous* r, void** target_buf);
+ctcomm_retval_t rdv_timed_recv_zc(rendezvous* r, void** target_buf,
+                                  struct timespec* timeout);
+
+// With nothing to drain, disabling a rendezvous fails the waiting
+// senders and receivers alike with ctcom_writing_disabled, as well as
+// the calls made until it's enabled again.
+ctcomm_retval_t rdv_disable_sending(rendezvous* r);
+ctcomm_retval_t rdv_enable_sending(rendezvous* r);
+
+// One-shot cells
+// A one-shot cell carries a single value from whoever sets it to
+// whoever waits for it. It's meant to be embedded in the caller's
+// structs: there is nothing to create or destroy, a cell is ready once
+// it's initialised. A waiter parks on 'state' with a futex, the setter
+// only makes a system call if somebody is actually parked. Instead of
+// being waited for, a cell can be given a callback, which is run by the
+// setting thread once the value is there. Its members are private.
+typedef struct ctcomm_oneshot ctcomm_oneshot;
+// The callback owns the cell from then on, it may free it.
+typedef void (*ctcomm_oneshot_cb)(ctcomm_oneshot* cell, void* value,
+                                  uint32_t size);
+
+struct ctcomm_oneshot {
+  uint32_t state;
+  uint32_t size;
+  void* value;
+  ctcomm_oneshot_cb callback;
+};
+
+// Makes the cell empty again, it can't be in use.
+void oneshot_init(ctcomm_oneshot* cell);
+
+// A cell can only be set once; setting it again fails with
+// ctcom_invalid_arguments.
+ctcomm_retval_t oneshot_set(ctcomm_oneshot* cell, void* value,
+                            uint32_t size);
+
+// Return the size of the value, which goes into '*value'. A set cell
+// keeps its value, waiting for it again returns it right away. Only a
+// single thread can wait for a cell at a time. Timeouts are on
+// CLOCK_MONOTONIC.
+ctcomm_retval_t oneshot_wait(ctcomm_oneshot* cell, void** value);
+ctcomm_retval_t oneshot_try_get(ctcomm_oneshot* cell, void** value);
+ctcomm_retval_t oneshot_timed_wait(ctcomm_oneshot* cell, void** value,
+                                   struct timespec* timeout);
+
+// Arms the callback, which takes the place of waiting: it can only be
+// done with no thread waiting, after a timed out wait for instance. If
+// the cell is already set, the callback is run right away by the
+// calling thread.
+ctcomm_retval_t oneshot_on_set(ctcomm_oneshot* cell, ctcomm_oneshot_cb cb);
+
+#ifdef __cplusplus
+}
+#endif
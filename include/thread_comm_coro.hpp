@@ -0,0 +1,171 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// C++20 coroutine adapters built on top of the waiter interface of
+// thread_comm.h. Instead of blocking a thread, 'co_await q.recv()' and
+// 'co_await q.send(...)' suspend the calling coroutine, which is then
+// handed to the given executor once the queue has completed the
+// operation. The executor is any callable accepting a
+// std::coroutine_handle<>, it is invoked with the queue's lock held, so
+// it should only enqueue the handle and return.
+//
+// Example:
+//
+//   auto q = ctcomm::async_queue(cq, [&](std::coroutine_handle<> h) {
+//     scheduler.post(h);
+//   });
+//   auto r = co_await q.recv();
+//   if (r.status >= ctcom_success_threshold) { ... free(r.msg); }
+
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <utility>
+
+#include <thread_comm.h>
+
+namespace ctcomm {
+
+// 'status' carries what the blocking C call would have returned. On
+// a failed send, 'msg' gives the ownership of the message back.
+// A receive on a circular queue or a channel which carries slices or
+// requests may complete with ctcom_wrong_msg_kind. If 'buffer' or 'req'
+// is set, the slice or the request was handed over in 'msg' and
+// 'msg_size' (see ctcomm_waiter) and it's up to the caller now;
+// otherwise it was left in the queue for the slice or request calls.
+struct op_result {
+  int status;
+  void* msg;
+  uint32_t msg_size = 0;
+  ctcomm_buffer* buffer = nullptr;
+  chan_request* req = nullptr;
+};
+
+template <typename Queue>
+struct queue_ops;
+
+template <>
+struct queue_ops<circular_queue> {
+  static int recv(circular_queue* q, void** buf, ctcomm_waiter* w) {
+    return circq_recv_or_wait(q, buf, w);
+  }
+  static int send(circular_queue* q, void** msg, uint32_t size,
+                  ctcomm_waiter* w) {
+    return circq_send_or_wait(q, msg, size, w);
+  }
+};
+
+template <>
+struct queue_ops<dynamic_queue> {
+  static int recv(dynamic_queue* q, void** buf, ctcomm_waiter* w) {
+    return dynmq_recv_or_wait(q, buf, w);
+  }
+  static int send(dynamic_queue* q, void** msg, uint32_t size,
+                  ctcomm_waiter*) {
+    return dynmq_send_zc(q, msg, size);
+  }
+};
+
+template <>
+struct queue_ops<channel> {
+  static int recv(channel* q, void** buf, ctcomm_waiter* w) {
+    return chan_recv_or_wait(q, buf, w);
+  }
+  static int send(channel* q, void** msg, uint32_t size, ctcomm_waiter* w) {
+    return chan_send_or_wait(q, msg, size, w);
+  }
+};
+
+template <typename Queue, typename Executor>
+class async_queue {
+ public:
+  async_queue(Queue* q, Executor ex) : q_(q), ex_(std::move(ex)) {}
+
+  class awaiter : private ctcomm_waiter {
+   public:
+    awaiter(async_queue* owner, bool sending, void* msg, uint32_t size)
+        : ctcomm_waiter{}, owner_(owner), sending_(sending) {
+      this->notify = &awaiter::on_notify;
+      this->msg = msg;
+      this->msg_size = size;
+    }
+
+    // Everything is done in await_suspend, as the waiter has to be armed
+    // under the queue's lock to avoid missing a wake up.
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+      handle_ = h;
+      void* m = this->msg;
+      int pending = sending_ ? ctcom_container_full : ctcom_container_empty;
+      int rv;
+
+      if (sending_) {
+        rv = queue_ops<Queue>::send(owner_->q_, &m, this->msg_size, this);
+      } else {
+        rv = queue_ops<Queue>::recv(owner_->q_, &m, this);
+      }
+
+      if (rv == pending) {
+        // Armed, the executor will resume us. We may already be running
+        // somewhere else at this point, so 'this' is off limits.
+        return true;
+      }
+
+      // Completed (or failed) synchronously, keep running.
+      this->msg = m;
+      this->result = rv;
+      return false;
+    }
+
+    op_result await_resume() {
+      return {this->result, this->msg, this->msg_size, this->buffer,
+              this->req};
+    }
+
+   private:
+    static void on_notify(ctcomm_waiter* w) {
+      awaiter* self = static_cast<awaiter*>(w);
+      self->owner_->ex_(self->handle_);
+    }
+
+    async_queue* owner_;
+    bool sending_;
+    std::coroutine_handle<> handle_;
+  };
+
+  awaiter recv() { return awaiter(this, false, nullptr, 0); }
+
+  // The queue takes over 'msg' unless the returned status is negative.
+  awaiter send(void* msg, uint32_t msg_size) {
+    return awaiter(this, true, msg, msg_size);
+  }
+
+ private:
+  Queue* q_;
+  Executor ex_;
+};
+
+}  // namespace ctcomm
@@ -27,11 +27,20 @@ SOFTWARE.
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
-
-#define mem_alloc(size) malloc(size)
-#define mem_calloc(elem_count, elem_size) calloc(elem_count, elem_size)
-#define mem_realloc(ptr, new_size) realloc(ptr, new_size)
-#define mem_free(ptr) free(ptr)
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define mem_alloc(a, size) (a)->alloc((a)->ctx, size)
+#define mem_realloc(a, ptr, new_size) (a)->realloc((a)->ctx, ptr, new_size)
+#define mem_free(a, ptr) (a)->free((a)->ctx, ptr)
 
 #define mutex_t pthread_mutex_t
 #define mutex_destroy(m) pthread_mutex_destroy(&m)
@@ -45,6 +54,16 @@ SOFTWARE.
 #define cond_var_wait(c, m) pthread_cond_wait(&c, &m)
 #define cond_var_timedwait(c, m, t) pthread_cond_timedwait(&c, &m, &t)
 #define cond_var_signal(c) pthread_cond_signal(&c)
+#define cond_var_broadcast(c) pthread_cond_broadcast(&c)
+
+int cond_var_init_with_clock(pthread_cond_t* c, clockid_t clock_id) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, clock_id);
+  int retval = pthread_cond_init(c, &attr);
+  pthread_condattr_destroy(&attr);
+  return retval;
+}
 
 #define thread_id_t pthread_t
 #define get_thread_id pthread_self
@@ -59,11 +78,187 @@ SOFTWARE.
 
 const uint32_t max_allowed_cq_size = INT32_MAX;
 
+void* libc_alloc(void* ctx, size_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+void* libc_realloc(void* ctx, void* ptr, size_t new_size) {
+  (void)ctx;
+  return realloc(ptr, new_size);
+}
+
+void libc_free(void* ctx, void* ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+const ctcomm_allocator libc_allocator = {libc_alloc, libc_realloc, libc_free,
+                                         NULL};
+ctcomm_allocator default_allocator = {libc_alloc, libc_realloc, libc_free,
+                                      NULL};
+
+bool allocator_is_valid(const ctcomm_allocator* alloc) {
+  return alloc->alloc && alloc->realloc && alloc->free;
+}
+
+ctcomm_retval_t ctcomm_set_default_allocator(const ctcomm_allocator* alloc) {
+  if (!alloc) {
+    default_allocator = libc_allocator;
+    return ctcom_success_threshold;
+  }
+
+  if (!allocator_is_valid(alloc)) {
+    return ctcom_invalid_arguments;
+  }
+
+  default_allocator = *alloc;
+  return ctcom_success_threshold;
+}
+
+// Picks the allocator a new queue should use, NULL if the given one is
+// not usable.
+const ctcomm_allocator* select_allocator(const ctcomm_allocator* alloc) {
+  if (!alloc) {
+    return &default_allocator;
+  }
+
+  return allocator_is_valid(alloc) ? alloc : NULL;
+}
+
+// Only circular queues set the kind of their messages.
+typedef enum msg_kind {
+  msg_plain = 0,
+  // 'ref' is the ctcomm_buffer the slice holds a reference to.
+  msg_slice,
+  // 'ref' is the chan_call the reply goes to.
+  msg_request
+} msg_kind;
+
 typedef struct message {
   void* data;
   uint32_t size;
+  uint32_t kind;
+  void* ref;
 } message;
 
+// Placement of the memory mapped message arrays.
+#define huge_page_size ((size_t)2 * 1024 * 1024)
+#define max_numa_nodes 1024
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+typedef struct mapping_opts {
+  bool use_hugepages;
+  bool bind_to_numa_node;
+  int numa_node;
+  bool prefault;
+} mapping_opts;
+
+bool mapping_requested(const mapping_opts* mo) {
+  return mo->use_hugepages || mo->bind_to_numa_node || mo->prefault;
+}
+
+size_t round_up_to(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Maps 'size' bytes as requested by 'mo', the actual length of the
+// mapping is stored in 'mapped_size'.
+void* map_memory(const mapping_opts* mo, size_t size, size_t* mapped_size,
+                 char** err_str) {
+  void* addr = MAP_FAILED;
+  size_t length = 0;
+
+  if (mo->use_hugepages) {
+    length = round_up_to(size, huge_page_size);
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+
+  if (addr == MAP_FAILED) {
+    // No reserved huge pages, fall back to the regular pages.
+    length = round_up_to(size, (size_t)sysconf(_SC_PAGESIZE));
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      if (err_str) {
+        *err_str = CERR_STR("Failed to map memory for cq msg_array");
+      }
+      return NULL;
+    }
+
+    if (mo->use_hugepages) {
+      // Best effort, transparent huge pages might be disabled.
+      madvise(addr, length, MADV_HUGEPAGE);
+    }
+  }
+
+  if (mo->bind_to_numa_node) {
+    unsigned long node_mask[max_numa_nodes / (8 * sizeof(unsigned long))];
+    memset(node_mask, 0, sizeof(node_mask));
+
+    if (mo->numa_node < 0 || mo->numa_node >= max_numa_nodes) {
+      munmap(addr, length);
+      if (err_str) {
+        *err_str = CERR_STR("numa_node is out of range");
+      }
+      return NULL;
+    }
+
+    node_mask[mo->numa_node / (8 * sizeof(unsigned long))] |=
+        1UL << (mo->numa_node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, addr, length, MPOL_BIND, node_mask,
+                max_numa_nodes + 1, 0) != 0) {
+      munmap(addr, length);
+      if (err_str) {
+        *err_str = CERR_STR("Failed to bind cq msg_array to the numa_node");
+      }
+      return NULL;
+    }
+  }
+
+  if (mo->prefault) {
+    // Binding is done by now, so the pages land on the right node.
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < length; offset += page_size) {
+      ((volatile char*)addr)[offset] = 0;
+    }
+  }
+
+  *mapped_size = length;
+  return addr;
+}
+
+// Futex helpers for the one-shot hand-offs, the words are private to
+// the process. The waiter may be gone by the time it's woken up, the
+// wake up then lands on a stale address; that's harmless, futex waiters
+// always recheck their words.
+void wake_futex_word(uint32_t* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Waits while '*word' equals 'value'. 'deadline' is on CLOCK_MONOTONIC,
+// NULL means waiting for as long as it takes.
+int wait_on_futex_word(uint32_t* word, uint32_t value,
+                       const struct timespec* deadline) {
+  while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+    long retval = syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE, value,
+                          deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (retval && errno == ETIMEDOUT) {
+      return ctcom_timedout;
+    }
+  }
+
+  return 0;
+}
+
+uint64_t timespec_to_ns(const struct timespec* t) {
+  return (uint64_t)t->tv_sec * 1000000000ULL + (uint64_t)t->tv_nsec;
+}
+
 void add_duration_to_timespec(struct timespec* target,
                               struct timespec* duration) {
   static const long int max_nsecs = 1000000000;
@@ -90,21 +285,385 @@ void add_duration_to_timespec(struct timespec* target,
   }
 }
 
+// Armed waiters are kept in FIFO order, they are served the same way
+// the threads blocked on the condition variables are.
+typedef struct waiter_list {
+  ctcomm_waiter* head;
+  ctcomm_waiter* tail;
+} waiter_list;
+
+void waiter_list_push(waiter_list* wl, ctcomm_waiter* w) {
+  w->next = NULL;
+  if (wl->tail) {
+    wl->tail->next = w;
+  } else {
+    wl->head = w;
+  }
+  wl->tail = w;
+}
+
+ctcomm_waiter* waiter_list_pop(waiter_list* wl) {
+  ctcomm_waiter* w = wl->head;
+  if (w) {
+    wl->head = w->next;
+    if (!wl->head) {
+      wl->tail = NULL;
+    }
+    w->next = NULL;
+  }
+  return w;
+}
+
+bool waiter_list_remove(waiter_list* wl, ctcomm_waiter* w) {
+  ctcomm_waiter* prev = NULL;
+  for (ctcomm_waiter* it = wl->head; it; prev = it, it = it->next) {
+    if (it == w) {
+      if (prev) {
+        prev->next = w->next;
+      } else {
+        wl->head = w->next;
+      }
+      if (wl->tail == w) {
+        wl->tail = prev;
+      }
+      w->next = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+// An open addressing hash index from 64 bit keys to non-NULL values,
+// using linear probing and backward shift deletion, so no tombstones
+// are needed. A NULL value marks an empty slot.
+typedef struct u64_map_entry {
+  uint64_t key;
+  void* value;
+} u64_map_entry;
+
+typedef struct u64_map {
+  u64_map_entry* entries;
+  uint32_t capacity;  // Always a power of two
+  uint32_t count;
+  const ctcomm_allocator* allocator;
+} u64_map;
+
+#define u64_map_min_capacity 16
+
+uint32_t u64_map_slot(const u64_map* map, uint64_t key) {
+  // splitmix64 finalizer, the keys are often sequential ids.
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return (uint32_t)key & (map->capacity - 1);
+}
+
+bool u64_map_init(u64_map* map, const ctcomm_allocator* allocator) {
+  map->allocator = allocator;
+  map->capacity = u64_map_min_capacity;
+  map->count = 0;
+  map->entries = (u64_map_entry*)mem_alloc(
+      allocator, map->capacity * sizeof(u64_map_entry));
+  if (!map->entries) {
+    return false;
+  }
+  memset(map->entries, 0, map->capacity * sizeof(u64_map_entry));
+  return true;
+}
+
+void u64_map_destroy(u64_map* map) {
+  mem_free(map->allocator, map->entries);
+  map->entries = NULL;
+}
+
+// Returns where the value of 'key' is stored, so that it can be
+// replaced in place with another non-NULL value, or NULL.
+void** u64_map_find(const u64_map* map, uint64_t key) {
+  uint32_t mask = map->capacity - 1;
+  for (uint32_t i = u64_map_slot(map, key);; i = (i + 1) & mask) {
+    if (!map->entries[i].value) {
+      return NULL;
+    }
+    if (map->entries[i].key == key) {
+      return &map->entries[i].value;
+    }
+  }
+}
+
+void* u64_map_get(const u64_map* map, uint64_t key) {
+  void** value = u64_map_find(map, key);
+  return value ? *value : NULL;
+}
+
+void u64_map_insert_unchecked(u64_map* map, uint64_t key, void* value) {
+  uint32_t i = u64_map_slot(map, key);
+  while (map->entries[i].value) {
+    i = (i + 1) & (map->capacity - 1);
+  }
+  map->entries[i].key = key;
+  map->entries[i].value = value;
+  ++map->count;
+}
+
+bool u64_map_rehash(u64_map* map, uint32_t new_capacity) {
+  u64_map_entry* new_entries = (u64_map_entry*)mem_alloc(
+      map->allocator, new_capacity * sizeof(u64_map_entry));
+  if (!new_entries) {
+    return false;
+  }
+  memset(new_entries, 0, new_capacity * sizeof(u64_map_entry));
+
+  u64_map_entry* old_entries = map->entries;
+  uint32_t old_capacity = map->capacity;
+
+  map->entries = new_entries;
+  map->capacity = new_capacity;
+  map->count = 0;
+
+  for (uint32_t i = 0; i < old_capacity; ++i) {
+    if (old_entries[i].value) {
+      u64_map_insert_unchecked(map, old_entries[i].key, old_entries[i].value);
+    }
+  }
+
+  mem_free(map->allocator, old_entries);
+  return true;
+}
+
+// The key should not be in the map already.
+bool u64_map_put(u64_map* map, uint64_t key, void* value) {
+  // Keep the load factor under 3/4.
+  if ((map->count + 1) * 4 > map->capacity * 3) {
+    if (map->capacity > UINT32_MAX / 2 ||
+        !u64_map_rehash(map, map->capacity * 2)) {
+      return false;
+    }
+  }
+
+  u64_map_insert_unchecked(map, key, value);
+  return true;
+}
+
+void* u64_map_remove(u64_map* map, uint64_t key) {
+  uint32_t mask = map->capacity - 1;
+  uint32_t i = u64_map_slot(map, key);
+
+  while (map->entries[i].value && map->entries[i].key != key) {
+    i = (i + 1) & mask;
+  }
+
+  void* value = map->entries[i].value;
+  if (!value) {
+    return NULL;
+  }
+
+  // Shift the following entries of the cluster back if they would be
+  // unreachable otherwise.
+  uint32_t hole = i;
+  for (uint32_t j = (i + 1) & mask; map->entries[j].value; j = (j + 1) & mask) {
+    uint32_t home = u64_map_slot(map, map->entries[j].key);
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      map->entries[hole] = map->entries[j];
+      hole = j;
+    }
+  }
+  map->entries[hole].value = NULL;
+  --map->count;
+
+  // Shrinking is best effort.
+  if (map->capacity > u64_map_min_capacity && map->count * 8 < map->capacity) {
+    u64_map_rehash(map, map->capacity / 2);
+  }
+
+  return value;
+}
+
 struct circular_queue {
   mutex_t mutex;
   cond_var_t read_cond;
   cond_var_t write_cond;
 
+  // Batch receivers sleep on batch_cond, which is only signalled when
+  // msg_count reaches batch_threshold (0 when nobody is waiting).
+  cond_var_t batch_cond;
+  uint32_t batch_threshold;
+  uint32_t batch_waiters;
+
+  waiter_list recv_waiters;
+  waiter_list send_waiters;
+
   uint32_t read_index;
   uint32_t write_index;
   uint32_t max_size;
   uint32_t msg_count;
 
+  // The number of slots in msg_array, it equals to max_size unless the
+  // queue is elastic.
+  uint32_t array_size;
+  uint32_t min_array_size;
+  uint32_t shrink_after;
+  uint32_t low_occupancy_streak;
+
   message* msg_array;
   bool writing_disabled;
+
+  // The clock the condition variables, hence the deadlines, are on.
+  clockid_t clock_id;
+
+  bool overwrite_oldest;
+  // Stack mode, messages are received from the write end.
+  bool lifo;
+  void (*drop_cb)(void* msg, uint32_t msg_size, void* drop_ctx);
+  void* drop_ctx;
+  uint64_t dropped_count;
+
+  ctcomm_allocator allocator;
+  mapping_opts mapping;
+  // Non-zero when msg_array is a mapping rather than an allocation.
+  size_t msg_array_mapped_size;
+
+  // Copy mode only, the slots point at the records in the arena.
+  // arena_head is where the next record goes, arena_tail is the oldest
+  // record which hasn't been released yet.
+  char* arena;
+  uint32_t arena_size;
+  uint32_t arena_head;
+  uint32_t arena_tail;
+  uint32_t arena_used;
+
+  // Loaning only, max_size slots of slot_size bytes, a stack of the
+  // indices of the ones which aren't loaned out and the cq_slot_state of
+  // every slot.
+  char* slab;
+  uint32_t slot_size;
+  uint32_t* free_slots;
+  uint32_t free_slot_count;
+  uint8_t* slot_states;
 };
 
+// Where a loaning slot is, only the transitions below are allowed:
+// free -> loaned -> queued -> viewed -> free, or loaned -> free.
+typedef enum cq_slot_state {
+  slot_free = 0,
+  slot_loaned,
+  slot_queued,
+  slot_viewed
+} cq_slot_state;
+
+// True for the copy mode and the loaning queues, where the queue owns
+// the message buffers and the zero copy calls aren't allowed.
+bool cq_owns_buffers(const circular_queue* cq) {
+  return cq->arena || cq->slab;
+}
+
+// Returns the index of the slot 'buf' points at, or -1 if it doesn't
+// point at the start of a slot.
+int64_t cq_slot_index(const circular_queue* cq, const void* buf) {
+  const char* p = (const char*)buf;
+  size_t slab_size = (size_t)cq->max_size * cq->slot_size;
+
+  if (p < cq->slab || p >= cq->slab + slab_size ||
+      (size_t)(p - cq->slab) % cq->slot_size) {
+    return -1;
+  }
+
+  return (p - cq->slab) / cq->slot_size;
+}
+
+message* alloc_msg_array(circular_queue* cq, uint32_t slot_count,
+                         size_t* mapped_size, char** err_str) {
+  size_t size = (size_t)slot_count * sizeof(message);
+
+  *mapped_size = 0;
+  if (mapping_requested(&cq->mapping)) {
+    return (message*)map_memory(&cq->mapping, size, mapped_size, err_str);
+  }
+
+  message* msg_array = (message*)mem_alloc(&cq->allocator, size);
+  if (!msg_array && err_str) {
+    *err_str = CERR_STR("Failed to allocate memory for cq msg_array");
+  }
+
+  return msg_array;
+}
+
+void free_msg_array(circular_queue* cq, message* msg_array,
+                    size_t mapped_size) {
+  if (mapped_size) {
+    munmap(msg_array, mapped_size);
+  } else {
+    mem_free(&cq->allocator, msg_array);
+  }
+}
+
+// Moves the queued messages into a new array of 'new_size' slots,
+// unwrapping them on the way so that the oldest one lands on slot zero.
+// This function should always be called while holding the mutex.
+bool resize_msg_array(circular_queue* cq, uint32_t new_size) {
+  size_t new_mapped_size;
+  message* new_array = alloc_msg_array(cq, new_size, &new_mapped_size, NULL);
+  if (!new_array) {
+    return false;
+  }
+
+  uint32_t first_part = cq->array_size - cq->read_index;
+  if (first_part > cq->msg_count) {
+    first_part = cq->msg_count;
+  }
+
+  memcpy(new_array, cq->msg_array + cq->read_index,
+         first_part * sizeof(message));
+  memcpy(new_array + first_part, cq->msg_array,
+         (cq->msg_count - first_part) * sizeof(message));
+
+  free_msg_array(cq, cq->msg_array, cq->msg_array_mapped_size);
+
+  cq->msg_array = new_array;
+  cq->msg_array_mapped_size = new_mapped_size;
+  cq->array_size = new_size;
+  cq->read_index = 0;
+  cq->write_index = cq->msg_count == new_size ? 0 : cq->msg_count;
+  cq->low_occupancy_streak = 0;
+
+  return true;
+}
+
+uint32_t initial_array_size(const circq_opts* opts, uint32_t max_size) {
+  if (!opts->elastic) {
+    return max_size;
+  }
+
+  uint32_t size = 1;
+  uint32_t requested = opts->initial_size ? opts->initial_size : 64;
+  while (size < requested && size < max_size) {
+    size <<= 1;
+  }
+
+  return size < max_size ? size : max_size;
+}
+
 circular_queue* circular_queue_create(uint32_t max_size, char** err_str) {
+  return circular_queue_create_with_opts(max_size, NULL, err_str);
+}
+
+circular_queue* circular_queue_create_with_opts(uint32_t max_size,
+                                                const circq_opts* opts,
+                                                char** err_str) {
+  static const circq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
   if (max_size == 0) {
     if (err_str) {
       *err_str = CERR_STR("max_size should be positive");
@@ -119,7 +678,27 @@ circular_queue* circular_queue_create(uint32_t max_size, char** err_str) {
     return NULL;
   }
 
-  circular_queue* cq = (circular_queue*)mem_alloc(sizeof(circular_queue));
+  if (opts->copy_arena_size &&
+      (opts->overwrite_oldest || opts->copy_arena_size > UINT32_MAX - 7)) {
+    if (err_str) {
+      *err_str = CERR_STR("Copy mode queues can not be lossy or that big");
+    }
+    return NULL;
+  }
+
+  if (opts->loan_slot_size &&
+      (opts->overwrite_oldest || opts->copy_arena_size ||
+       opts->loan_slot_size > UINT32_MAX - 15)) {
+    if (err_str) {
+      *err_str = CERR_STR(
+          "Loaning queues can not be lossy, copy mode or have that big "
+          "slots");
+    }
+    return NULL;
+  }
+
+  circular_queue* cq =
+      (circular_queue*)mem_alloc(alloc, sizeof(circular_queue));
   if (!cq) {
     if (err_str) {
       *err_str = CERR_STR("Failed to allocate memory for circular_queue");
@@ -127,23 +706,95 @@ circular_queue* circular_queue_create(uint32_t max_size, char** err_str) {
     return NULL;
   }
 
-  cq->msg_array = (message*)mem_alloc(max_size * sizeof(message));
+  cq->allocator = *alloc;
+  cq->mapping.use_hugepages = opts->use_hugepages;
+  cq->mapping.bind_to_numa_node = opts->bind_to_numa_node;
+  cq->mapping.numa_node = opts->numa_node;
+  cq->mapping.prefault = opts->prefault;
+
+  cq->array_size = initial_array_size(opts, max_size);
+  cq->min_array_size = cq->array_size;
+  cq->shrink_after = opts->elastic ? opts->shrink_after : 0;
+  cq->low_occupancy_streak = 0;
+
+  cq->msg_array = alloc_msg_array(cq, cq->array_size,
+                                  &cq->msg_array_mapped_size, err_str);
   if (!cq->msg_array) {
-    if (err_str) {
-      *err_str = CERR_STR("Failed to allocate memory for cq msg_array");
-    }
-    mem_free(cq);
+    mem_free(alloc, cq);
     return NULL;
   }
 
+  cq->arena = NULL;
+  cq->arena_size = (opts->copy_arena_size + 7) & ~(uint32_t)7;
+  cq->arena_head = 0;
+  cq->arena_tail = 0;
+  cq->arena_used = 0;
+  if (cq->arena_size) {
+    cq->arena = (char*)mem_alloc(alloc, cq->arena_size);
+    if (!cq->arena) {
+      free_msg_array(cq, cq->msg_array, cq->msg_array_mapped_size);
+      mem_free(alloc, cq);
+      if (err_str) {
+        *err_str = CERR_STR("Failed to allocate memory for cq arena");
+      }
+      return NULL;
+    }
+  }
+
+  cq->slab = NULL;
+  cq->free_slots = NULL;
+  cq->slot_states = NULL;
+  cq->slot_size = (opts->loan_slot_size + 15) & ~(uint32_t)15;
+  cq->free_slot_count = 0;
+  if (cq->slot_size) {
+    cq->slab = (char*)mem_alloc(alloc, (size_t)max_size * cq->slot_size);
+    cq->free_slots =
+        (uint32_t*)mem_alloc(alloc, (size_t)max_size * sizeof(uint32_t));
+    cq->slot_states = (uint8_t*)mem_alloc(alloc, max_size);
+    if (!cq->slab || !cq->free_slots || !cq->slot_states) {
+      if (cq->slab) {
+        mem_free(alloc, cq->slab);
+      }
+      if (cq->free_slots) {
+        mem_free(alloc, cq->free_slots);
+      }
+      if (cq->slot_states) {
+        mem_free(alloc, cq->slot_states);
+      }
+      free_msg_array(cq, cq->msg_array, cq->msg_array_mapped_size);
+      mem_free(alloc, cq);
+      if (err_str) {
+        *err_str = CERR_STR("Failed to allocate memory for cq slots");
+      }
+      return NULL;
+    }
+    // Handed out from the start of the slab first.
+    for (uint32_t i = 0; i < max_size; ++i) {
+      cq->free_slots[i] = max_size - 1 - i;
+    }
+    cq->free_slot_count = max_size;
+    memset(cq->slot_states, slot_free, max_size);
+  }
+
   mutex_init(cq->mutex);
-  cond_var_init(cq->read_cond);
-  cond_var_init(cq->write_cond);
+  cq->clock_id = opts->monotonic_clock ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+  cond_var_init_with_clock(&cq->read_cond, cq->clock_id);
+  cond_var_init_with_clock(&cq->write_cond, cq->clock_id);
+  cond_var_init_with_clock(&cq->batch_cond, cq->clock_id);
+  cq->batch_threshold = 0;
+  cq->batch_waiters = 0;
   cq->read_index = 0;
   cq->write_index = 0;
   cq->max_size = max_size;
   cq->msg_count = 0;
+  cq->recv_waiters = (waiter_list){NULL, NULL};
+  cq->send_waiters = (waiter_list){NULL, NULL};
   cq->writing_disabled = false;
+  cq->overwrite_oldest = opts->overwrite_oldest;
+  cq->lifo = opts->lifo;
+  cq->drop_cb = opts->drop_cb;
+  cq->drop_ctx = opts->drop_ctx;
+  cq->dropped_count = 0;
 
   if (err_str) {
     *err_str = NULL;
@@ -154,52 +805,155 @@ circular_queue* circular_queue_create(uint32_t max_size, char** err_str) {
 
 void __circular_queue_destroy(circular_queue* cq) {
   if (cq) {
+    ctcomm_allocator alloc = cq->allocator;
+
     if (cq->msg_array) {
-      mem_free(cq->msg_array);
+      free_msg_array(cq, cq->msg_array, cq->msg_array_mapped_size);
       cq->msg_array = NULL;
     }
 
+    if (cq->arena) {
+      mem_free(&alloc, cq->arena);
+      cq->arena = NULL;
+    }
+
+    if (cq->slab) {
+      mem_free(&alloc, cq->slab);
+      mem_free(&alloc, cq->free_slots);
+      mem_free(&alloc, cq->slot_states);
+      cq->slab = NULL;
+    }
+
     mutex_destroy(cq->mutex);
     cond_var_destroy(cq->read_cond);
     cond_var_destroy(cq->write_cond);
+    cond_var_destroy(cq->batch_cond);
 
-    mem_free(cq);
+    mem_free(&alloc, cq);
   }
 }
 
 // This function should always be called while holding the mutex.
-// Please notice that it's not exposed to the caller via the header file.
-int _sendto_cq(circular_queue* cq, void** msg, uint32_t msg_size) {
-  cq->msg_array[cq->write_index].data = *msg;
+// 'kind' and 'ref' are those of the message, see msg_kind.
+int _send_ref_to_cq(circular_queue* cq, void** msg, uint32_t msg_size,
+                    msg_kind kind, void* ref) {
   if (*msg == NULL) {
     msg_size = 0;
   }
+
+  // Receive waiters are only armed while the queue is empty, so handing
+  // the message over directly doesn't break the ordering. A slice or a
+  // request goes to a single waiter along with its reference, flagged by
+  // ctcom_wrong_msg_kind as the zero copy calls would do.
+  ctcomm_waiter* w = waiter_list_pop(&cq->recv_waiters);
+  if (w) {
+    w->msg = *msg;
+    w->msg_size = msg_size;
+    w->result = kind == msg_plain ? (int)msg_size : ctcom_wrong_msg_kind;
+    w->buffer = kind == msg_slice ? (ctcomm_buffer*)ref : NULL;
+    w->req = kind == msg_request ? (chan_request*)ref : NULL;
+    *msg = NULL;
+    w->notify(w);
+    return msg_size;
+  }
+
+  if (cq->msg_count == cq->array_size) {
+    // Only elastic queues get here, the callers make sure that there is
+    // room for one more message with respect to max_size.
+    uint32_t new_size = cq->array_size << 1;
+    if (new_size > cq->max_size || new_size < cq->array_size) {
+      new_size = cq->max_size;
+    }
+    if (!resize_msg_array(cq, new_size)) {
+      return ctcom_not_enough_memory;
+    }
+  }
+
+  cq->msg_array[cq->write_index].data = *msg;
+  cq->msg_array[cq->write_index].kind = kind;
+  cq->msg_array[cq->write_index].ref = ref;
   cq->msg_array[cq->write_index++].size = msg_size;
   *msg = NULL;  // The sender loses the ownership of the msg pointer.
-  if (cq->write_index == cq->max_size) {
+  if (cq->write_index == cq->array_size) {
     cq->write_index = 0;
   }
   ++cq->msg_count;
 
   cond_var_signal(cq->read_cond);
+  if (cq->msg_count == cq->batch_threshold) {
+    cond_var_broadcast(cq->batch_cond);
+  }
 
   return msg_size;
 }
 
+// This function should always be called while holding the mutex.
+// Please notice that it's not exposed to the caller via the header file.
+int _sendto_cq(circular_queue* cq, void** msg, uint32_t msg_size) {
+  return _send_ref_to_cq(cq, msg, msg_size, msg_plain, NULL);
+}
+
 ctcomm_retval_t verify_circq_send_zc_params(circular_queue* cq, void** msg,
                                             uint32_t msg_size) {
-  if (!cq || !msg || (msg_size == 0 && *msg != NULL)) {
+  if (!cq || !msg || (msg_size == 0 && *msg != NULL) ||
+      cq_owns_buffers(cq)) {
     return ctcom_invalid_arguments;
   }
 
   return ctcom_success_threshold;
 }
 
+// All of the send functions end up here for lossy queues.
+int _overwrite_cq(circular_queue* cq, void** msg, uint32_t msg_size,
+                  msg_kind kind, void* ref) {
+  message evicted;
+  bool dropped = false;
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  if (cq->msg_count == cq->max_size) {
+    evicted = cq->msg_array[cq->read_index++];
+    if (cq->read_index == cq->array_size) {
+      cq->read_index = 0;
+    }
+    --cq->msg_count;
+    ++cq->dropped_count;
+    dropped = true;
+  }
+
+  int result = _send_ref_to_cq(cq, msg, msg_size, kind, ref);
+
+  mutex_unlock(cq->mutex);
+
+  // Evicted slices just drop their references. There are no requests
+  // in lossy queues.
+  if (dropped && evicted.kind == msg_slice) {
+    ctcomm_buffer_release((ctcomm_buffer*)evicted.ref);
+  } else if (dropped && cq->drop_cb) {
+    cq->drop_cb(evicted.data, evicted.size, cq->drop_ctx);
+  }
+
+  return result;
+}
+
+int _send_overwriting_cq(circular_queue* cq, void** msg, uint32_t msg_size) {
+  return _overwrite_cq(cq, msg, msg_size, msg_plain, NULL);
+}
+
 int circq_send_zc(circular_queue* cq, void** msg, uint32_t msg_size) {
   if (verify_circq_send_zc_params(cq, msg, msg_size) != 0) {
     return ctcom_invalid_arguments;
   }
 
+  if (cq->overwrite_oldest) {
+    return _send_overwriting_cq(cq, msg, msg_size);
+  }
+
   mutex_lock(cq->mutex);
 
   if (cq->writing_disabled) {
@@ -223,6 +977,10 @@ int circq_try_send_zc(circular_queue* cq, void** msg, uint32_t msg_size) {
     return ctcom_invalid_arguments;
   }
 
+  if (cq->overwrite_oldest) {
+    return _send_overwriting_cq(cq, msg, msg_size);
+  }
+
   // Assuming we won't have space for the new message.
   int result = ctcom_container_full;
 
@@ -243,34 +1001,59 @@ int circq_try_send_zc(circular_queue* cq, void** msg, uint32_t msg_size) {
   return result;
 }
 
-int circq_timed_send_zc(circular_queue* cq, void** msg, uint32_t msg_size,
-                        struct timespec* timeout_duration) {
-  if (verify_circq_send_zc_params(cq, msg, msg_size) != 0) {
-    return ctcom_invalid_arguments;
+// This function should always be called while holding the mutex.
+int wait_until_cq_not_full(circular_queue* cq,
+                           const struct timespec* deadline) {
+  while (cq->msg_count == cq->max_size) {
+    int retval = cond_var_timedwait(cq->write_cond, cq->mutex, *deadline);
+    if (retval) {
+      return retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+    }
   }
 
-  mutex_lock(cq->mutex);
+  return 0;
+}
 
-  if (cq->writing_disabled) {
+// This function should always be called while holding the mutex.
+int wait_until_cq_not_empty(circular_queue* cq,
+                            const struct timespec* deadline) {
+  while (cq->msg_count == 0) {
+    int retval = cond_var_timedwait(cq->read_cond, cq->mutex, *deadline);
+    if (retval) {
+      return retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+    }
+  }
+
+  return 0;
+}
+
+int circq_timed_send_zc(circular_queue* cq, void** msg, uint32_t msg_size,
+                        struct timespec* timeout_duration) {
+  if (verify_circq_send_zc_params(cq, msg, msg_size) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (cq->overwrite_oldest) {
+    return _send_overwriting_cq(cq, msg, msg_size);
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
     mutex_unlock(cq->mutex);
     return ctcom_writing_disabled;
   }
 
   if (cq->msg_count == cq->max_size) {
-    int retval;
+    // The clock is only read if we really have to wait.
     struct timespec abs_time;
-    clock_gettime(CLOCK_REALTIME, &abs_time);
+    clock_gettime(cq->clock_id, &abs_time);
     add_duration_to_timespec(&abs_time, timeout_duration);
 
-    while (cq->msg_count == cq->max_size) {
-      if ((retval = cond_var_timedwait(cq->write_cond, cq->mutex, abs_time))) {
-        if (retval != ETIMEDOUT) {
-          mutex_unlock(cq->mutex);
-          return ctcom_unexpected_failure;
-        }
-        mutex_unlock(cq->mutex);
-        return ctcom_timedout;
-      }
+    int retval = wait_until_cq_not_full(cq, &abs_time);
+    if (retval) {
+      mutex_unlock(cq->mutex);
+      return retval;
     }
   }
 
@@ -281,24 +1064,106 @@ int circq_timed_send_zc(circular_queue* cq, void** msg, uint32_t msg_size,
   return msg_size;
 }
 
+int circq_send_until_zc(circular_queue* cq, void** msg, uint32_t msg_size,
+                        const struct timespec* deadline) {
+  if (verify_circq_send_zc_params(cq, msg, msg_size) != 0 || !deadline) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (cq->overwrite_oldest) {
+    return _send_overwriting_cq(cq, msg, msg_size);
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  int retval = wait_until_cq_not_full(cq, deadline);
+  if (retval) {
+    mutex_unlock(cq->mutex);
+    return retval;
+  }
+
+  msg_size = _sendto_cq(cq, msg, msg_size);
+
+  mutex_unlock(cq->mutex);
+
+  return msg_size;
+}
+
+// The message the next receive call gets, the queue shouldn't be empty.
+message* cq_next_msg(circular_queue* cq) {
+  if (cq->lifo) {
+    uint32_t index = cq->write_index ? cq->write_index : cq->array_size;
+    return &cq->msg_array[index - 1];
+  }
+
+  return &cq->msg_array[cq->read_index];
+}
+
 // This function should always be called while holding the mutex.
-// Please notice that it's not exposed to the caller via the header file.
-ctcomm_retval_t _recvfrom_cq(circular_queue* cq, void** target_buf) {
-  ctcomm_retval_t msg_size = cq->msg_array[cq->read_index].size;
-  *target_buf = cq->msg_array[cq->read_index++].data;
-  if (cq->read_index == cq->max_size) {
-    cq->read_index = 0;
+void _pop_from_cq(circular_queue* cq, message* msg) {
+  if (cq->lifo) {
+    if (cq->write_index == 0) {
+      cq->write_index = cq->array_size;
+    }
+    *msg = cq->msg_array[--cq->write_index];
+  } else {
+    *msg = cq->msg_array[cq->read_index++];
+    if (cq->read_index == cq->array_size) {
+      cq->read_index = 0;
+    }
   }
 
   --cq->msg_count;
 
-  cond_var_signal(cq->write_cond);
+  if (cq->shrink_after && cq->array_size > cq->min_array_size) {
+    if (cq->msg_count <= cq->array_size / 4) {
+      if (++cq->low_occupancy_streak >= cq->shrink_after) {
+        uint32_t new_size = cq->array_size / 2;
+        if (new_size < cq->min_array_size) {
+          new_size = cq->min_array_size;
+        }
+        // Failing to shrink is harmless, we'll retry later on.
+        resize_msg_array(cq, new_size);
+        cq->low_occupancy_streak = 0;
+      }
+    } else {
+      cq->low_occupancy_streak = 0;
+    }
+  }
 
-  return msg_size;
+  // A send waiter takes over the slot we have just freed.
+  ctcomm_waiter* w = waiter_list_pop(&cq->send_waiters);
+  if (w) {
+    w->result = _sendto_cq(cq, &w->msg, w->msg_size);
+    w->notify(w);
+  } else {
+    cond_var_signal(cq->write_cond);
+  }
+}
+
+// This function should always be called while holding the mutex.
+// Please notice that it's not exposed to the caller via the header file.
+// Slices and requests are left in the queue, they can only be received
+// as such.
+ctcomm_retval_t _recvfrom_cq(circular_queue* cq, void** target_buf) {
+  if (cq_next_msg(cq)->kind != msg_plain) {
+    return ctcom_wrong_msg_kind;
+  }
+
+  message msg;
+  _pop_from_cq(cq, &msg);
+  *target_buf = msg.data;
+
+  return msg.size;
 }
 
 int verify_recvfrom_cq_zc_params(circular_queue* cq, void** target_buf) {
-  if (!cq || !target_buf) {
+  if (!cq || !target_buf || cq_owns_buffers(cq)) {
     return ctcom_invalid_arguments;
   }
 
@@ -350,20 +1215,14 @@ ctcomm_retval_t circq_timed_recv_zc(circular_queue* cq, void** target_buf,
   mutex_lock(cq->mutex);
 
   if (cq->msg_count == 0) {
-    int retval;
     struct timespec abs_time;
-    clock_gettime(CLOCK_REALTIME, &abs_time);
+    clock_gettime(cq->clock_id, &abs_time);
     add_duration_to_timespec(&abs_time, timeout);
 
-    while (cq->msg_count == 0) {
-      if ((retval = cond_var_timedwait(cq->read_cond, cq->mutex, abs_time))) {
-        if (retval != ETIMEDOUT) {
-          mutex_unlock(cq->mutex);
-          return ctcom_unexpected_failure;
-        }
-        mutex_unlock(cq->mutex);
-        return ctcom_timedout;
-      }
+    int retval = wait_until_cq_not_empty(cq, &abs_time);
+    if (retval) {
+      mutex_unlock(cq->mutex);
+      return retval;
     }
   }
 
@@ -374,490 +1233,6143 @@ ctcomm_retval_t circq_timed_recv_zc(circular_queue* cq, void** target_buf,
   return msg_size;
 }
 
-ctcomm_retval_t circq_disable_sending(circular_queue* cq) {
-  if (cq) {
-    mutex_lock(cq->mutex);
-    cq->writing_disabled = true;
-    mutex_unlock(cq->mutex);
-    return ctcom_success_threshold;
-  }
-  return ctcom_invalid_arguments;
-}
-
-ctcomm_retval_t circq_enable_sending(circular_queue* cq) {
-  if (cq) {
-    mutex_lock(cq->mutex);
-    cq->writing_disabled = false;
-    mutex_unlock(cq->mutex);
-    return ctcom_success_threshold;
+ctcomm_retval_t circq_recv_until_zc(circular_queue* cq, void** target_buf,
+                                    const struct timespec* deadline) {
+  if (verify_recvfrom_cq_zc_params(cq, target_buf) != 0 || !deadline) {
+    return ctcom_invalid_arguments;
   }
-  return ctcom_invalid_arguments;
-}
 
-int circq_msg_count(circular_queue* cq) {
-  int result = -1;
+  mutex_lock(cq->mutex);
 
-  if (cq) {
-    mutex_lock(cq->mutex);
-    result = cq->msg_count;
+  int retval = wait_until_cq_not_empty(cq, deadline);
+  if (retval) {
     mutex_unlock(cq->mutex);
+    return retval;
   }
 
-  return result;
-}
-
-// Dynamic queue related section starts here.
-typedef struct dllist_node {
-  struct dllist_node* prev;
-  message msg;
-  struct dllist_node* next;
-} dllist_node;
-
-struct dynamic_queue {
-  mutex_t mutex;
-  cond_var_t read_cond;
-
-  uint32_t msg_count;
+  ctcomm_retval_t msg_size = _recvfrom_cq(cq, target_buf);
 
-  dllist_node* head;
-  dllist_node* tail;
+  mutex_unlock(cq->mutex);
 
-  bool writing_disabled;
-};
+  return msg_size;
+}
 
-ctcomm_retval_t append_msg_to_dq_tail(dynamic_queue* dq, void** data,
-                                      uint32_t msg_size) {
-  dllist_node* new_elem = (dllist_node*)mem_alloc(sizeof(dllist_node));
-  if (!new_elem) {
-    return ctcom_not_enough_memory;
+// This function should always be called while holding the mutex.
+// A NULL deadline means waiting for as long as it takes.
+int wait_for_cq_batch(circular_queue* cq, uint32_t count,
+                      const struct timespec* deadline) {
+  if (cq->msg_count >= count) {
+    return 0;
   }
 
-  if (*data == NULL) {
-    msg_size = 0;
-  }
+  int retval = 0;
 
-  new_elem->msg.data = *data;
-  *data = NULL;
-  new_elem->msg.size = msg_size;
-  new_elem->next = NULL;
+  ++cq->batch_waiters;
+  while (cq->msg_count < count) {
+    // The smallest threshold wins, the others recheck when woken up.
+    if (cq->batch_threshold == 0 || count < cq->batch_threshold) {
+      cq->batch_threshold = count;
+    }
+    if (deadline) {
+      retval = cond_var_timedwait(cq->batch_cond, cq->mutex, *deadline);
+    } else {
+      retval = cond_var_wait(cq->batch_cond, cq->mutex);
+    }
+    if (retval) {
+      retval = retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+      break;
+    }
+  }
 
-  if (!dq->head) {
-#ifdef RUNNING_UNIT_TESTS
-    assert(!dq->tail);
-#endif
-    new_elem->prev = NULL;
-    dq->head = new_elem;
-    dq->tail = new_elem;
-  } else {
-#ifdef RUNNING_UNIT_TESTS
-    assert(dq->tail && !dq->tail->next);
-#endif
-    new_elem->prev = dq->tail;
-    dq->tail->next = new_elem;
-    dq->tail = new_elem;
+  // Thresholds aren't tracked per waiter, so the remaining waiters are
+  // woken up to put theirs back.
+  cq->batch_threshold = 0;
+  if (--cq->batch_waiters > 0) {
+    cond_var_broadcast(cq->batch_cond);
   }
 
-  return msg_size;
+  return retval;
 }
 
-ctcomm_retval_t remove_msg_from_dq_head(dynamic_queue* dq,
-                                        void** data_buf_ptr) {
-  if (!dq->head) {
-#ifdef RUNNING_UNIT_TESTS
-    assert(!dq->tail);
-#endif
-    return ctcom_container_empty;
+ctcomm_retval_t circq_recv_batch_min(circular_queue* cq, void** bufs,
+                                     uint32_t* sizes, uint32_t min_count,
+                                     uint32_t max_count,
+                                     struct timespec* linger) {
+  if (!cq || !bufs || !linger || min_count == 0 || max_count < min_count ||
+      min_count > cq->max_size || cq_owns_buffers(cq)) {
+    return ctcom_invalid_arguments;
   }
 
-#ifdef RUNNING_UNIT_TESTS
-  assert(!dq->head->prev);
-  assert(dq->tail && !dq->tail->next);
-#endif
+  int retval;
 
-  dllist_node* node_to_be_freed = dq->head;
+  mutex_lock(cq->mutex);
 
-  *data_buf_ptr = dq->head->msg.data;
-  int msg_size = dq->head->msg.size;
+  for (;;) {
+    if ((retval = wait_for_cq_batch(cq, 1, NULL))) {
+      break;
+    }
 
-  dq->head = dq->head->next;
-  if (dq->head) {
-    dq->head->prev = NULL;
-  } else {
-    // The head just became NULL, let's not forget about the tail
-    dq->tail = NULL;
-  }
+    if (cq->msg_count < min_count) {
+      // The linger period starts with the first message we see.
+      struct timespec deadline;
+      clock_gettime(cq->clock_id, &deadline);
+      add_duration_to_timespec(&deadline, linger);
 
-  mem_free(node_to_be_freed);
+      retval = wait_for_cq_batch(cq, min_count, &deadline);
+      if (retval && retval != ctcom_timedout) {
+        break;
+      }
+      retval = 0;
+    }
 
-  return msg_size;
-}
+    // Somebody else might have drained the queue in the meantime.
+    if (cq->msg_count > 0) {
+      break;
+    }
+  }
 
-void destroy_dq_dllist(dynamic_queue* dq) {
-  dllist_node* node_to_be_freed = NULL;
-  while (dq->head) {
-    node_to_be_freed = dq->head;
-    dq->head = dq->head->next;
-    mem_free(node_to_be_freed);
+  if (retval) {
+    mutex_unlock(cq->mutex);
+    return retval;
   }
-  dq->tail = NULL;
-}
 
-dynamic_queue* dynamic_queue_create(char** err_str) {
-  dynamic_queue* dq = (dynamic_queue*)mem_alloc(sizeof(dynamic_queue));
-  if (!dq) {
-    if (err_str) {
-      *err_str = CERR_STR("Failed to allocate memory for dynamic queue");
+  uint32_t count = cq->msg_count < max_count ? cq->msg_count : max_count;
+  for (uint32_t i = 0; i < count; ++i) {
+    ctcomm_retval_t msg_size = _recvfrom_cq(cq, &bufs[i]);
+    if (msg_size < 0) {
+      // Stopping at a slice.
+      count = i;
+      break;
+    }
+    if (sizes) {
+      sizes[i] = msg_size;
     }
-    return NULL;
   }
 
-  mutex_init(dq->mutex);
-  cond_var_init(dq->read_cond);
-  dq->msg_count = 0;
-  dq->head = NULL;
-  dq->tail = NULL;
-  dq->writing_disabled = false;
-
-  if (err_str) {
-    *err_str = NULL;
-  }
+  mutex_unlock(cq->mutex);
 
-  return dq;
+  return count ? (int)count : ctcom_wrong_msg_kind;
 }
 
-void __dynamic_queue_destroy(dynamic_queue* dq) {
-  if (dq) {
-    mutex_destroy(dq->mutex);
-    cond_var_destroy(dq->read_cond);
-    destroy_dq_dllist(dq);
-    mem_free(dq);
+ctcomm_retval_t circq_recv_or_wait(circular_queue* cq, void** target_buf,
+                                   ctcomm_waiter* w) {
+  if (verify_recvfrom_cq_zc_params(cq, target_buf) != 0 || !w ||
+      !w->notify) {
+    return ctcom_invalid_arguments;
   }
-}
 
-ctcomm_retval_t _sendto_dq(dynamic_queue* dq, void** msg, uint32_t msg_size) {
-  ctcomm_retval_t retval = append_msg_to_dq_tail(dq, msg, msg_size);
+  ctcomm_retval_t result = ctcom_container_empty;
 
-  if (retval != ctcom_not_enough_memory) {
-    ++dq->msg_count;
-    cond_var_signal(dq->read_cond);
+  mutex_lock(cq->mutex);
+
+  if (cq->msg_count > 0) {
+    result = _recvfrom_cq(cq, target_buf);
+  } else {
+    w->msg = NULL;
+    w->msg_size = 0;
+    w->result = ctcom_container_empty;
+    w->buffer = NULL;
+    w->req = NULL;
+    waiter_list_push(&cq->recv_waiters, w);
   }
 
-  return retval;
+  mutex_unlock(cq->mutex);
+
+  return result;
 }
 
-int verify_dynmq_send_zc_params(dynamic_queue* dq, void** msg,
-                                uint32_t msg_size) {
-  if (!dq || !msg || (msg_size == 0 && *msg != NULL)) {
+ctcomm_retval_t circq_send_or_wait(circular_queue* cq, void** msg,
+                                   uint32_t msg_size, ctcomm_waiter* w) {
+  if (verify_circq_send_zc_params(cq, msg, msg_size) != 0 || !w ||
+      !w->notify) {
     return ctcom_invalid_arguments;
   }
 
-  return ctcom_success_threshold;
-}
-
-ctcomm_retval_t dynmq_send_zc(dynamic_queue* dq, void** msg,
-                              uint32_t msg_size) {
-  if (verify_dynmq_send_zc_params(dq, msg, msg_size) != 0) {
-    return ctcom_invalid_arguments;
+  if (cq->overwrite_oldest) {
+    return _send_overwriting_cq(cq, msg, msg_size);
   }
 
-  mutex_lock(dq->mutex);
+  int result = ctcom_container_full;
 
-  if (dq->writing_disabled) {
-    mutex_unlock(dq->mutex);
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
     return ctcom_writing_disabled;
   }
 
-  msg_size = _sendto_dq(dq, msg, msg_size);
+  if (cq->msg_count < cq->max_size) {
+    result = _sendto_cq(cq, msg, msg_size);
+  } else {
+    w->msg = *msg;
+    w->msg_size = msg_size;
+    w->result = ctcom_container_full;
+    *msg = NULL;
+    waiter_list_push(&cq->send_waiters, w);
+  }
 
-  mutex_unlock(dq->mutex);
+  mutex_unlock(cq->mutex);
+
+  return result;
+}
+
+bool circq_cancel_wait(circular_queue* cq, ctcomm_waiter* w) {
+  if (!cq || !w) {
+    return false;
+  }
+
+  mutex_lock(cq->mutex);
+  bool removed = waiter_list_remove(&cq->recv_waiters, w) ||
+                 waiter_list_remove(&cq->send_waiters, w);
+  mutex_unlock(cq->mutex);
+
+  return removed;
+}
+
+ctcomm_retval_t circq_disable_sending(circular_queue* cq) {
+  if (cq) {
+    mutex_lock(cq->mutex);
+    cq->writing_disabled = true;
+    // Pending send waiters would never make it in, fail them now.
+    ctcomm_waiter* w;
+    while ((w = waiter_list_pop(&cq->send_waiters))) {
+      w->result = ctcom_writing_disabled;
+      w->notify(w);
+    }
+    mutex_unlock(cq->mutex);
+    return ctcom_success_threshold;
+  }
+  return ctcom_invalid_arguments;
+}
+
+ctcomm_retval_t circq_enable_sending(circular_queue* cq) {
+  if (cq) {
+    mutex_lock(cq->mutex);
+    cq->writing_disabled = false;
+    mutex_unlock(cq->mutex);
+    return ctcom_success_threshold;
+  }
+  return ctcom_invalid_arguments;
+}
+
+int circq_msg_count(circular_queue* cq) {
+  int result = -1;
+
+  if (cq) {
+    mutex_lock(cq->mutex);
+    result = cq->msg_count;
+    mutex_unlock(cq->mutex);
+  }
+
+  return result;
+}
+
+uint64_t circq_dropped_count(circular_queue* cq) {
+  uint64_t result = 0;
+
+  if (cq) {
+    mutex_lock(cq->mutex);
+    result = cq->dropped_count;
+    mutex_unlock(cq->mutex);
+  }
+
+  return result;
+}
+
+// Copy mode related section starts here.
+// A record is a cq_record followed by the payload, padded to 8 bytes.
+// A record whose size is cq_wrap_marker only says that the rest of the
+// arena is unused and the next record is at the start.
+#define cq_wrap_marker UINT32_MAX
+
+// Records are queued, then handed out by the view calls, then released.
+enum cq_record_state { record_queued, record_viewed, record_released };
+
+typedef struct cq_record {
+  uint32_t size;
+  uint32_t state;
+} cq_record;
+
+uint32_t cq_record_size(uint32_t len) {
+  return sizeof(cq_record) + ((len + 7) & ~(uint32_t)7);
+}
+
+// Returns the payload of a new record, or NULL if there isn't enough
+// contiguous space. This function should always be called while holding
+// the mutex.
+char* alloc_cq_record(circular_queue* cq, uint32_t len) {
+  uint32_t record_size = cq_record_size(len);
+
+  if (cq->arena_used == 0) {
+    cq->arena_head = 0;
+    cq->arena_tail = 0;
+  } else if (cq->arena_head == cq->arena_tail) {
+    return NULL;
+  }
+
+  if (cq->arena_head >= cq->arena_tail &&
+      cq->arena_size - cq->arena_head < record_size) {
+    // Doesn't fit at the end, try the start.
+    if (cq->arena_tail < record_size) {
+      return NULL;
+    }
+    cq_record* marker = (cq_record*)(cq->arena + cq->arena_head);
+    marker->size = cq_wrap_marker;
+    cq->arena_used += cq->arena_size - cq->arena_head;
+    cq->arena_head = 0;
+  } else if (cq->arena_head < cq->arena_tail &&
+             cq->arena_tail - cq->arena_head < record_size) {
+    return NULL;
+  }
+
+  cq_record* record = (cq_record*)(cq->arena + cq->arena_head);
+  record->size = len;
+  record->state = record_queued;
+
+  cq->arena_used += record_size;
+  cq->arena_head += record_size;
+  if (cq->arena_head == cq->arena_size) {
+    cq->arena_head = 0;
+  }
+
+  return (char*)(record + 1);
+}
+
+// This function should always be called while holding the mutex.
+void release_cq_record(circular_queue* cq, const void* payload) {
+  ((cq_record*)payload - 1)->state = record_released;
+
+  while (cq->arena_used > 0) {
+    cq_record* record = (cq_record*)(cq->arena + cq->arena_tail);
+    uint32_t record_size;
+
+    if (record->size == cq_wrap_marker) {
+      record_size = cq->arena_size - cq->arena_tail;
+    } else if (record->state == record_released) {
+      record_size = cq_record_size(record->size);
+    } else {
+      break;
+    }
+
+    cq->arena_used -= record_size;
+    cq->arena_tail += record_size;
+    if (cq->arena_tail == cq->arena_size) {
+      cq->arena_tail = 0;
+    }
+  }
+
+  // Senders may be waiting for different amounts of space.
+  cond_var_broadcast(cq->write_cond);
+}
+
+// Whether 'view' is the payload of a record which has been handed out
+// and not released yet. The live records are walked from the oldest
+// one, views are mostly released in order so there are few in front of
+// it. This function should always be called while holding the mutex.
+bool cq_record_viewed(circular_queue* cq, const void* view) {
+  // An empty record at the very end has its payload right past it.
+  const char* payload = (const char*)view;
+  if (payload < cq->arena + sizeof(cq_record) ||
+      payload > cq->arena + cq->arena_size) {
+    return false;
+  }
+
+  uint32_t offset = cq->arena_tail;
+  uint32_t used = cq->arena_used;
+  while (used > 0) {
+    cq_record* record = (cq_record*)(cq->arena + offset);
+    uint32_t record_size;
+
+    if (record->size == cq_wrap_marker) {
+      record_size = cq->arena_size - offset;
+    } else if ((const char*)(record + 1) == payload) {
+      return record->state == record_viewed;
+    } else {
+      record_size = cq_record_size(record->size);
+    }
+
+    used -= record_size;
+    offset += record_size;
+    if (offset == cq->arena_size) {
+      offset = 0;
+    }
+  }
+
+  return false;
+}
+
+// This function should always be called while holding the mutex.
+// Doesn't wait if 'blocking' is false, otherwise a NULL 'timeout' waits
+// for as long as it takes.
+int wait_for_cq_msg(circular_queue* cq, bool blocking,
+                    struct timespec* timeout) {
+  if (cq->msg_count > 0) {
+    return 0;
+  }
+
+  if (!blocking) {
+    return ctcom_container_empty;
+  }
+
+  if (!timeout) {
+    while (cq->msg_count == 0) {
+      cond_var_wait(cq->read_cond, cq->mutex);
+    }
+    return 0;
+  }
+
+  struct timespec abs_time;
+  clock_gettime(cq->clock_id, &abs_time);
+  add_duration_to_timespec(&abs_time, timeout);
+
+  return wait_until_cq_not_empty(cq, &abs_time);
+}
+
+// The copy mode calls share the following two functions. They don't
+// block if 'blocking' is false, otherwise a NULL 'timeout' blocks for as
+// long as it takes.
+int _send_copy_cq(circular_queue* cq, const void* buf, uint32_t len,
+                  bool blocking, struct timespec* timeout) {
+  if (!cq || !cq->arena || (!buf && len > 0) ||
+      len > cq->arena_size - sizeof(cq_record)) {
+    return ctcom_invalid_arguments;
+  }
+
+  char* payload = NULL;
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  bool deadline_set = false;
+  struct timespec abs_time;
+  while (cq->msg_count == cq->max_size ||
+         !(payload = alloc_cq_record(cq, len))) {
+    int retval = 0;
+    if (!blocking) {
+      retval = ctcom_container_full;
+    } else if (!timeout) {
+      cond_var_wait(cq->write_cond, cq->mutex);
+    } else {
+      // The clock is only read if we really have to wait.
+      if (!deadline_set) {
+        clock_gettime(cq->clock_id, &abs_time);
+        add_duration_to_timespec(&abs_time, timeout);
+        deadline_set = true;
+      }
+      retval = cond_var_timedwait(cq->write_cond, cq->mutex, abs_time);
+      if (retval) {
+        retval = retval == ETIMEDOUT ? ctcom_timedout
+                                     : ctcom_unexpected_failure;
+      }
+    }
+
+    if (retval) {
+      mutex_unlock(cq->mutex);
+      return retval;
+    }
+  }
+
+  if (len > 0) {
+    memcpy(payload, buf, len);
+  }
+
+  void* msg = payload;
+  int result = _sendto_cq(cq, &msg, len);
+  if (result < 0) {
+    release_cq_record(cq, payload);
+  }
+
+  mutex_unlock(cq->mutex);
+
+  return result;
+}
+
+// Fails with ctcom_invalid_arguments, without receiving it, if the next
+// message is bigger than 'max_len'.
+int _recv_view_cq(circular_queue* cq, const void** view, uint32_t max_len,
+                  bool blocking, struct timespec* timeout) {
+  if (!cq || !cq_owns_buffers(cq) || !view) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  int retval = wait_for_cq_msg(cq, blocking, timeout);
+  if (retval) {
+    mutex_unlock(cq->mutex);
+    return retval;
+  }
+
+  if (cq_next_msg(cq)->size > max_len) {
+    mutex_unlock(cq->mutex);
+    return ctcom_invalid_arguments;
+  }
+
+  void* msg = NULL;
+  ctcomm_retval_t msg_size = _recvfrom_cq(cq, &msg);
+  *view = msg;
+  if (cq->slab) {
+    cq->slot_states[cq_slot_index(cq, msg)] = slot_viewed;
+  } else {
+    ((cq_record*)msg - 1)->state = record_viewed;
+  }
+
+  mutex_unlock(cq->mutex);
+
+  return msg_size;
+}
+
+// Loaning related section starts here.
+// Gives back a received slot, or a loaned one which won't be committed.
+ctcomm_retval_t release_cq_slot(circular_queue* cq, const void* slot) {
+  int64_t index = cq_slot_index(cq, slot);
+  if (index < 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  uint8_t state = cq->slot_states[index];
+  if (state != slot_loaned && state != slot_viewed) {
+    mutex_unlock(cq->mutex);
+    return ctcom_invalid_arguments;
+  }
+
+  cq->slot_states[index] = slot_free;
+  cq->free_slots[cq->free_slot_count++] = index;
+  cond_var_signal(cq->write_cond);
+  mutex_unlock(cq->mutex);
+
+  return ctcom_success_threshold;
+}
+
+// Same conventions as _send_copy_cq().
+int _loan_from_cq(circular_queue* cq, void** slot, bool blocking,
+                  struct timespec* timeout) {
+  if (!cq || !cq->slab || !slot) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  if (cq->free_slot_count == 0) {
+    int retval = 0;
+    if (!blocking) {
+      retval = ctcom_container_full;
+    } else if (!timeout) {
+      while (cq->free_slot_count == 0) {
+        cond_var_wait(cq->write_cond, cq->mutex);
+      }
+    } else {
+      struct timespec abs_time;
+      clock_gettime(cq->clock_id, &abs_time);
+      add_duration_to_timespec(&abs_time, timeout);
+      while (!retval && cq->free_slot_count == 0) {
+        retval = cond_var_timedwait(cq->write_cond, cq->mutex, abs_time);
+        if (retval) {
+          retval = retval == ETIMEDOUT ? ctcom_timedout
+                                       : ctcom_unexpected_failure;
+        }
+      }
+    }
+
+    if (retval) {
+      mutex_unlock(cq->mutex);
+      return retval;
+    }
+  }
+
+  uint32_t index = cq->free_slots[--cq->free_slot_count];
+  cq->slot_states[index] = slot_loaned;
+  *slot = cq->slab + (size_t)index * cq->slot_size;
+
+  mutex_unlock(cq->mutex);
+
+  return cq->slot_size;
+}
+
+ctcomm_retval_t circq_loan(circular_queue* cq, void** slot) {
+  return _loan_from_cq(cq, slot, true, NULL);
+}
+
+ctcomm_retval_t circq_try_loan(circular_queue* cq, void** slot) {
+  return _loan_from_cq(cq, slot, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_loan(circular_queue* cq, void** slot,
+                                 struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _loan_from_cq(cq, slot, true, timeout);
+}
+
+ctcomm_retval_t circq_commit_loan(circular_queue* cq, void* slot,
+                                  uint32_t len) {
+  if (!cq || !cq->slab || len > cq->slot_size) {
+    return ctcom_invalid_arguments;
+  }
+
+  int64_t index = cq_slot_index(cq, slot);
+  if (index < 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (cq->slot_states[index] != slot_loaned) {
+    mutex_unlock(cq->mutex);
+    return ctcom_invalid_arguments;
+  }
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  // There are as many slots as the queue can hold messages, so there's
+  // always room for a loaned one with respect to max_size. An elastic
+  // ring may still fail to grow, the slot stays loaned then.
+  cq->slot_states[index] = slot_queued;
+  int result = _sendto_cq(cq, &slot, len);
+  if (result < 0) {
+    cq->slot_states[index] = slot_loaned;
+  }
+
+  mutex_unlock(cq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t circq_send_copy(circular_queue* cq, const void* buf,
+                                uint32_t len) {
+  return _send_copy_cq(cq, buf, len, true, NULL);
+}
+
+ctcomm_retval_t circq_try_send_copy(circular_queue* cq, const void* buf,
+                                    uint32_t len) {
+  return _send_copy_cq(cq, buf, len, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_send_copy(circular_queue* cq, const void* buf,
+                                      uint32_t len,
+                                      struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _send_copy_cq(cq, buf, len, true, timeout);
+}
+
+ctcomm_retval_t circq_recv_view(circular_queue* cq, const void** view) {
+  return _recv_view_cq(cq, view, UINT32_MAX, true, NULL);
+}
+
+ctcomm_retval_t circq_try_recv_view(circular_queue* cq, const void** view) {
+  return _recv_view_cq(cq, view, UINT32_MAX, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_recv_view(circular_queue* cq, const void** view,
+                                      struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _recv_view_cq(cq, view, UINT32_MAX, true, timeout);
+}
+
+ctcomm_retval_t circq_release_view(circular_queue* cq, const void* view) {
+  if (!cq || !cq_owns_buffers(cq) || !view) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (cq->slab) {
+    return release_cq_slot(cq, view);
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (!cq_record_viewed(cq, view)) {
+    mutex_unlock(cq->mutex);
+    return ctcom_invalid_arguments;
+  }
+  release_cq_record(cq, view);
+
+  mutex_unlock(cq->mutex);
+
+  return ctcom_success_threshold;
+}
+
+// The copy is taken outside the lock, the record is only released after.
+int copy_out_of_cq(circular_queue* cq, void* buf, uint32_t buf_size,
+                   bool blocking, struct timespec* timeout) {
+  if (!buf && buf_size > 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  const void* view = NULL;
+  int msg_size = _recv_view_cq(cq, &view, buf_size, blocking, timeout);
+  if (msg_size < 0) {
+    return msg_size;
+  }
+
+  if (msg_size > 0) {
+    memcpy(buf, view, msg_size);
+  }
+  circq_release_view(cq, view);
+
+  return msg_size;
+}
+
+ctcomm_retval_t circq_recv_copy(circular_queue* cq, void* buf,
+                                uint32_t buf_size) {
+  return copy_out_of_cq(cq, buf, buf_size, true, NULL);
+}
+
+ctcomm_retval_t circq_try_recv_copy(circular_queue* cq, void* buf,
+                                    uint32_t buf_size) {
+  return copy_out_of_cq(cq, buf, buf_size, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_recv_copy(circular_queue* cq, void* buf,
+                                      uint32_t buf_size,
+                                      struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return copy_out_of_cq(cq, buf, buf_size, true, timeout);
+}
+
+// Refcounted buffer related section starts here.
+struct ctcomm_buffer {
+  uint32_t refs;
+  void* data;
+  size_t size;
+  // NULL when the data was allocated along with the buffer.
+  void (*free_fn)(void* data, void* ctx);
+  void* ctx;
+  ctcomm_allocator allocator;
+};
+
+ctcomm_buffer* ctcomm_buffer_create(size_t size) {
+  const ctcomm_allocator* alloc = select_allocator(NULL);
+  ctcomm_buffer* b =
+      (ctcomm_buffer*)mem_alloc(alloc, sizeof(ctcomm_buffer) + size);
+  if (!b) {
+    return NULL;
+  }
+
+  b->refs = 1;
+  b->data = b + 1;
+  b->size = size;
+  b->free_fn = NULL;
+  b->ctx = NULL;
+  b->allocator = *alloc;
+
+  return b;
+}
+
+void free_wrapped_data(void* data, void* ctx) {
+  (void)ctx;
+  free(data);
+}
+
+ctcomm_buffer* ctcomm_buffer_wrap(void* data, size_t size,
+                                  void (*free_fn)(void* data, void* ctx),
+                                  void* ctx) {
+  if (!data) {
+    return NULL;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(NULL);
+  ctcomm_buffer* b = (ctcomm_buffer*)mem_alloc(alloc, sizeof(ctcomm_buffer));
+  if (!b) {
+    return NULL;
+  }
+
+  b->refs = 1;
+  b->data = data;
+  b->size = size;
+  b->free_fn = free_fn ? free_fn : free_wrapped_data;
+  b->ctx = ctx;
+  b->allocator = *alloc;
+
+  return b;
+}
+
+void* ctcomm_buffer_data(ctcomm_buffer* b) {
+  return b ? b->data : NULL;
+}
+
+size_t ctcomm_buffer_size(ctcomm_buffer* b) {
+  return b ? b->size : 0;
+}
+
+ctcomm_buffer* ctcomm_buffer_ref(ctcomm_buffer* b) {
+  if (b) {
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  return b;
+}
+
+void ctcomm_buffer_release(ctcomm_buffer* b) {
+  if (!b || __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  if (b->free_fn) {
+    b->free_fn(b->data, b->ctx);
+  }
+  ctcomm_allocator alloc = b->allocator;
+  mem_free(&alloc, b);
+}
+
+ctcomm_retval_t ctcomm_slice_make(ctcomm_buffer* b, size_t offset,
+                                  uint32_t size, ctcomm_slice* slice) {
+  if (!b || !slice || offset > b->size || b->size - offset < size) {
+    return ctcom_invalid_arguments;
+  }
+
+  slice->data = (char*)b->data + offset;
+  slice->size = size;
+  slice->buffer = ctcomm_buffer_ref(b);
+
+  return ctcom_success_threshold;
+}
+
+void ctcomm_slice_release(ctcomm_slice* slice) {
+  if (!slice) {
+    return;
+  }
+
+  if (slice->buffer) {
+    ctcomm_buffer_release(slice->buffer);
+  } else {
+    free(slice->data);
+  }
+
+  slice->data = NULL;
+  slice->size = 0;
+  slice->buffer = NULL;
+}
+
+// The slice calls of the circular queues share the following two
+// functions, with the same conventions as _send_copy_cq().
+int _send_slice_cq(circular_queue* cq, ctcomm_slice* slice, bool blocking,
+                   struct timespec* timeout) {
+  if (!cq || !slice || !slice->buffer || cq_owns_buffers(cq)) {
+    return ctcom_invalid_arguments;
+  }
+
+  void* data = slice->data;
+  int result;
+
+  if (cq->overwrite_oldest) {
+    result = _overwrite_cq(cq, &data, slice->size, msg_slice, slice->buffer);
+  } else {
+    mutex_lock(cq->mutex);
+
+    if (cq->writing_disabled) {
+      mutex_unlock(cq->mutex);
+      return ctcom_writing_disabled;
+    }
+
+    result = 0;
+    if (cq->msg_count == cq->max_size) {
+      if (!blocking) {
+        result = ctcom_container_full;
+      } else if (!timeout) {
+        while (cq->msg_count == cq->max_size) {
+          cond_var_wait(cq->write_cond, cq->mutex);
+        }
+      } else {
+        struct timespec abs_time;
+        clock_gettime(cq->clock_id, &abs_time);
+        add_duration_to_timespec(&abs_time, timeout);
+        result = wait_until_cq_not_full(cq, &abs_time);
+      }
+    }
+
+    if (!result) {
+      result =
+          _send_ref_to_cq(cq, &data, slice->size, msg_slice, slice->buffer);
+    }
+
+    mutex_unlock(cq->mutex);
+  }
+
+  // The queue holds the reference now.
+  if (result >= 0) {
+    slice->data = NULL;
+    slice->size = 0;
+    slice->buffer = NULL;
+  }
+
+  return result;
+}
+
+int _recv_slice_cq(circular_queue* cq, ctcomm_slice* slice, bool blocking,
+                   struct timespec* timeout) {
+  if (!cq || !slice || cq_owns_buffers(cq)) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  int retval = wait_for_cq_msg(cq, blocking, timeout);
+  if (retval) {
+    mutex_unlock(cq->mutex);
+    return retval;
+  }
+
+  if (cq_next_msg(cq)->kind == msg_request) {
+    mutex_unlock(cq->mutex);
+    return ctcom_wrong_msg_kind;
+  }
+
+  message msg;
+  _pop_from_cq(cq, &msg);
+
+  mutex_unlock(cq->mutex);
+
+  slice->data = msg.data;
+  slice->size = msg.size;
+  slice->buffer = (ctcomm_buffer*)msg.ref;
+
+  return msg.size;
+}
+
+ctcomm_retval_t circq_send_slice(circular_queue* cq, ctcomm_slice* slice) {
+  return _send_slice_cq(cq, slice, true, NULL);
+}
+
+ctcomm_retval_t circq_try_send_slice(circular_queue* cq,
+                                     ctcomm_slice* slice) {
+  return _send_slice_cq(cq, slice, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_send_slice(circular_queue* cq,
+                                       ctcomm_slice* slice,
+                                       struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _send_slice_cq(cq, slice, true, timeout);
+}
+
+ctcomm_retval_t circq_recv_slice(circular_queue* cq, ctcomm_slice* slice) {
+  return _recv_slice_cq(cq, slice, true, NULL);
+}
+
+ctcomm_retval_t circq_try_recv_slice(circular_queue* cq,
+                                     ctcomm_slice* slice) {
+  return _recv_slice_cq(cq, slice, false, NULL);
+}
+
+ctcomm_retval_t circq_timed_recv_slice(circular_queue* cq,
+                                       ctcomm_slice* slice,
+                                       struct timespec* timeout) {
+  if (!timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _recv_slice_cq(cq, slice, true, timeout);
+}
+
+// Dynamic queue related section starts here.
+typedef struct dllist_node {
+  struct dllist_node* prev;
+  message msg;
+  struct dllist_node* next;
+
+  // Nodes handed out as handles are shared by the queue (or a chain) and
+  // the handle, whichever lets go last frees them. 0 for plain nodes.
+  uint32_t refs;
+  // Whether a handle node is still linked into the queue, only touched
+  // under the queue's lock.
+  bool queued;
+
+  // Tagged nodes are also threaded through a circular list per tag, the
+  // oldest one of which is indexed by dynamic_queue.tags.
+  bool tagged;
+  // The queue's generation when the node got its handle or tag, see
+  // dq_node_queued().
+  uint64_t gen;
+  uint64_t tag;
+  struct dllist_node* tag_prev;
+  struct dllist_node* tag_next;
+} dllist_node;
+
+void release_dq_node(ctcomm_allocator* alloc, dllist_node* node) {
+  if (node->refs == 0 ||
+      __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    mem_free(alloc, node);
+  }
+}
+
+struct dynamic_queue {
+  mutex_t mutex;
+  cond_var_t read_cond;
+
+  // See circular_queue
+  cond_var_t batch_cond;
+  uint32_t batch_threshold;
+  uint32_t batch_waiters;
+
+  waiter_list recv_waiters;
+
+  uint32_t msg_count;
+
+  dllist_node* head;
+  dllist_node* tail;
+  // Bumped by dynmq_recv_all(), which detaches the handles and tags of
+  // the nodes it takes without visiting them.
+  uint64_t generation;
+
+  // Tag to its oldest queued node, only allocated with the first tagged
+  // message. Tagged receivers wait on tag_cond.
+  u64_map tags;
+  cond_var_t tag_cond;
+  uint32_t tag_waiters;
+
+  bool writing_disabled;
+  bool lifo;
+
+  clockid_t clock_id;
+
+  // NULL unless spilling to disk is enabled.
+  struct dq_spill* spill;
+
+  ctcomm_allocator allocator;
+};
+
+// Spilled messages are stored as [uint32_t size][payload] records, 8
+// byte aligned, in segment files which are unlinked as soon as they are
+// mapped. The space is given back once the last record of a segment has
+// been paged in and the segment is unmapped.
+typedef struct spill_segment {
+  struct spill_segment* next;
+  char* base;
+  size_t size;
+  size_t read_offset;
+  size_t write_offset;
+} spill_segment;
+
+typedef struct dq_spill {
+  char* dir;
+  size_t budget;
+  size_t segment_size;
+
+  // The payload bytes of the messages in the list.
+  size_t mem_bytes;
+  // The messages on disk, they always come after the ones in the list.
+  uint32_t spilled_count;
+  uint64_t segment_seq;
+
+  // Read from the head, written to the tail.
+  spill_segment* head;
+  spill_segment* tail;
+} dq_spill;
+
+#define spill_record_header sizeof(uint32_t)
+#define spill_default_segment_size (64 << 20)
+
+size_t spill_record_size(uint32_t msg_size) {
+  return (spill_record_header + msg_size + 7) & ~(size_t)7;
+}
+
+spill_segment* create_spill_segment(dynamic_queue* dq, size_t min_size) {
+  dq_spill* spill = dq->spill;
+  size_t size = spill->segment_size;
+  if (size < min_size) {
+    size = min_size;
+  }
+
+  spill_segment* seg =
+      (spill_segment*)mem_alloc(&dq->allocator, sizeof(spill_segment));
+  if (!seg) {
+    return NULL;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/ctcomm-spill-%ld-%p-%lu", spill->dir,
+           (long)getpid(), (void*)dq, (unsigned long)spill->segment_seq++);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    mem_free(&dq->allocator, seg);
+    return NULL;
+  }
+
+  // Nobody else needs to find it, and this way it's gone even if we
+  // crash.
+  unlink(path);
+
+  void* base = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    mem_free(&dq->allocator, seg);
+    return NULL;
+  }
+
+  seg->next = NULL;
+  seg->base = (char*)base;
+  seg->size = size;
+  seg->read_offset = 0;
+  seg->write_offset = 0;
+
+  return seg;
+}
+
+void free_spill_segment(dynamic_queue* dq, spill_segment* seg) {
+  munmap(seg->base, seg->size);
+  mem_free(&dq->allocator, seg);
+}
+
+// Writes the message to disk and frees its payload. This function should
+// always be called while holding the mutex.
+bool spill_msg(dynamic_queue* dq, void** msg, uint32_t msg_size) {
+  dq_spill* spill = dq->spill;
+  size_t record_size = spill_record_size(msg_size);
+
+  spill_segment* seg = spill->tail;
+  if (!seg || seg->size - seg->write_offset < record_size) {
+    seg = create_spill_segment(dq, record_size);
+    if (!seg) {
+      return false;
+    }
+    if (spill->tail) {
+      spill->tail->next = seg;
+    } else {
+      spill->head = seg;
+    }
+    spill->tail = seg;
+  }
+
+  char* record = seg->base + seg->write_offset;
+  memcpy(record, &msg_size, spill_record_header);
+  if (msg_size > 0) {
+    memcpy(record + spill_record_header, *msg, msg_size);
+    mem_free(&dq->allocator, *msg);
+  }
+  *msg = NULL;
+
+  seg->write_offset += record_size;
+  ++spill->spilled_count;
+
+  return true;
+}
+
+// Reads the oldest spilled message back into a freshly allocated payload,
+// leaving it on disk until drop_spilled_msg() is called. This function
+// should always be called while holding the mutex.
+ctcomm_retval_t read_spilled_msg(dynamic_queue* dq, void** data) {
+  spill_segment* seg = dq->spill->head;
+
+  char* record = seg->base + seg->read_offset;
+  uint32_t msg_size;
+  memcpy(&msg_size, record, spill_record_header);
+
+  *data = NULL;
+  if (msg_size > 0) {
+    *data = mem_alloc(&dq->allocator, msg_size);
+    if (!*data) {
+      return ctcom_not_enough_memory;
+    }
+    memcpy(*data, record + spill_record_header, msg_size);
+  }
+
+  return msg_size;
+}
+
+// Gives the space of the oldest spilled message back.
+void drop_spilled_msg(dynamic_queue* dq, uint32_t msg_size) {
+  dq_spill* spill = dq->spill;
+  spill_segment* seg = spill->head;
+
+  seg->read_offset += spill_record_size(msg_size);
+  --spill->spilled_count;
+
+  if (seg->read_offset == seg->write_offset) {
+    spill->head = seg->next;
+    if (!spill->head) {
+      spill->tail = NULL;
+    }
+    free_spill_segment(dq, seg);
+  }
+}
+
+void unlink_dq_node(dynamic_queue* dq, dllist_node* node) {
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    dq->head = node->next;
+  }
+
+  if (node->next) {
+    node->next->prev = node->prev;
+  } else {
+    dq->tail = node->prev;
+  }
+
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+// Generations are unique across the queues, as chains can carry nodes
+// from one queue to another.
+uint64_t last_dq_generation = 0;
+
+uint64_t next_dq_generation(void) {
+  return __atomic_add_fetch(&last_dq_generation, 1, __ATOMIC_RELAXED);
+}
+
+// Handles and tags only count for the nodes queued in the current
+// generation.
+bool dq_node_queued(const dynamic_queue* dq, const dllist_node* node) {
+  return node->refs && node->queued && node->gen == dq->generation;
+}
+
+bool dq_node_tagged(const dynamic_queue* dq, const dllist_node* node) {
+  return node->tagged && node->gen == dq->generation;
+}
+
+// Appends a node, which has just been queued, to the list of its tag.
+bool tag_dq_node(dynamic_queue* dq, dllist_node* node, uint64_t tag) {
+  if (!dq->tags.entries && !u64_map_init(&dq->tags, &dq->allocator)) {
+    return false;
+  }
+
+  dllist_node* oldest = (dllist_node*)u64_map_get(&dq->tags, tag);
+  if (oldest) {
+    node->tag_prev = oldest->tag_prev;
+    node->tag_next = oldest;
+    oldest->tag_prev->tag_next = node;
+    oldest->tag_prev = node;
+  } else {
+    if (!u64_map_put(&dq->tags, tag, node)) {
+      return false;
+    }
+    node->tag_prev = node;
+    node->tag_next = node;
+  }
+
+  node->tag = tag;
+  node->tagged = true;
+  node->gen = dq->generation;
+
+  return true;
+}
+
+// Should be called whenever a tagged node leaves the queue.
+void untag_dq_node(dynamic_queue* dq, dllist_node* node) {
+  if (!dq_node_tagged(dq, node)) {
+    return;
+  }
+
+  if (node->tag_next == node) {
+    u64_map_remove(&dq->tags, node->tag);
+  } else {
+    node->tag_prev->tag_next = node->tag_next;
+    node->tag_next->tag_prev = node->tag_prev;
+    void** oldest = u64_map_find(&dq->tags, node->tag);
+    if (*oldest == node) {
+      *oldest = node->tag_next;
+    }
+  }
+
+  node->tagged = false;
+}
+
+// Keeps the list of the node's tag in the queue's order once the node
+// has been moved to the head (or the tail) of the queue.
+void retag_dq_node(dynamic_queue* dq, dllist_node* node, bool to_head) {
+  if (!dq_node_tagged(dq, node) || node->tag_next == node) {
+    return;
+  }
+
+  void** oldest = u64_map_find(&dq->tags, node->tag);
+  dllist_node* first = (dllist_node*)*oldest;
+  if (first == node) {
+    first = node->tag_next;
+  }
+
+  node->tag_prev->tag_next = node->tag_next;
+  node->tag_next->tag_prev = node->tag_prev;
+
+  // Either way it goes right before the oldest one, the list being
+  // circular.
+  node->tag_prev = first->tag_prev;
+  node->tag_next = first;
+  first->tag_prev->tag_next = node;
+  first->tag_prev = node;
+  *oldest = to_head ? node : first;
+}
+
+// Links a node, which can't fail to be allocated anymore, to the tail.
+int link_msg_to_dq_tail(dynamic_queue* dq, dllist_node* new_elem,
+                        void** data, uint32_t msg_size) {
+  if (*data == NULL) {
+    msg_size = 0;
+  }
+
+  new_elem->msg.data = *data;
+  *data = NULL;
+  new_elem->msg.size = msg_size;
+  if (dq->spill) {
+    dq->spill->mem_bytes += msg_size;
+  }
+  new_elem->next = NULL;
+  new_elem->refs = 0;
+  new_elem->tagged = false;
+
+  if (!dq->head) {
+#ifdef RUNNING_UNIT_TESTS
+    assert(!dq->tail);
+#endif
+    new_elem->prev = NULL;
+    dq->head = new_elem;
+    dq->tail = new_elem;
+  } else {
+#ifdef RUNNING_UNIT_TESTS
+    assert(dq->tail && !dq->tail->next);
+#endif
+    new_elem->prev = dq->tail;
+    dq->tail->next = new_elem;
+    dq->tail = new_elem;
+  }
+
+  return msg_size;
+}
+
+ctcomm_retval_t append_msg_to_dq_tail(dynamic_queue* dq, void** data,
+                                      uint32_t msg_size) {
+  dllist_node* new_elem =
+      (dllist_node*)mem_alloc(&dq->allocator, sizeof(dllist_node));
+  if (!new_elem) {
+    return ctcom_not_enough_memory;
+  }
+
+  return link_msg_to_dq_tail(dq, new_elem, data, msg_size);
+}
+
+// Takes a message out of the queue from wherever it is. This function
+// should always be called while holding the mutex.
+int take_msg_from_dq_node(dynamic_queue* dq, dllist_node* node,
+                          void** data_buf_ptr) {
+  unlink_dq_node(dq, node);
+  untag_dq_node(dq, node);
+  if (dq_node_queued(dq, node)) {
+    node->queued = false;
+  }
+
+  *data_buf_ptr = node->msg.data;
+  int msg_size = node->msg.size;
+  if (dq->spill) {
+    dq->spill->mem_bytes -= msg_size;
+  }
+
+  release_dq_node(&dq->allocator, node);
+
+  return msg_size;
+}
+
+ctcomm_retval_t remove_msg_from_dq_head(dynamic_queue* dq,
+                                        void** data_buf_ptr) {
+  if (!dq->head) {
+#ifdef RUNNING_UNIT_TESTS
+    assert(!dq->tail);
+#endif
+    return ctcom_container_empty;
+  }
+
+#ifdef RUNNING_UNIT_TESTS
+  assert(!dq->head->prev);
+  assert(dq->tail && !dq->tail->next);
+#endif
+
+  return take_msg_from_dq_node(dq, dq->head, data_buf_ptr);
+}
+
+// LIFO queues receive from the tail, where the freshest message is.
+ctcomm_retval_t remove_msg_from_dq_tail(dynamic_queue* dq,
+                                        void** data_buf_ptr) {
+  if (!dq->tail) {
+#ifdef RUNNING_UNIT_TESTS
+    assert(!dq->head);
+#endif
+    return ctcom_container_empty;
+  }
+
+#ifdef RUNNING_UNIT_TESTS
+  assert(!dq->tail->next);
+  assert(dq->head && !dq->head->prev);
+#endif
+
+  return take_msg_from_dq_node(dq, dq->tail, data_buf_ptr);
+}
+
+void destroy_dq_dllist(dynamic_queue* dq) {
+  dllist_node* node_to_be_freed = NULL;
+  while (dq->head) {
+    node_to_be_freed = dq->head;
+    dq->head = dq->head->next;
+    mem_free(&dq->allocator, node_to_be_freed);
+  }
+  dq->tail = NULL;
+}
+
+dynamic_queue* dynamic_queue_create(char** err_str) {
+  return dynamic_queue_create_with_opts(NULL, err_str);
+}
+
+dynamic_queue* dynamic_queue_create_with_opts(const dynmq_opts* opts,
+                                              char** err_str) {
+  static const dynmq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  if (opts->spill_dir && opts->lifo) {
+    if (err_str) {
+      *err_str = CERR_STR("LIFO queues can not spill to disk");
+    }
+    return NULL;
+  }
+
+  dynamic_queue* dq = (dynamic_queue*)mem_alloc(alloc, sizeof(dynamic_queue));
+  if (!dq) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for dynamic queue");
+    }
+    return NULL;
+  }
+
+  dq->allocator = *alloc;
+  dq->spill = NULL;
+
+  if (opts->spill_dir) {
+    size_t dir_len = strlen(opts->spill_dir);
+    dq->spill = (dq_spill*)mem_alloc(alloc, sizeof(dq_spill));
+    char* dir = dq->spill ? (char*)mem_alloc(alloc, dir_len + 1) : NULL;
+    if (!dir) {
+      if (dq->spill) {
+        mem_free(alloc, dq->spill);
+      }
+      mem_free(alloc, dq);
+      if (err_str) {
+        *err_str = CERR_STR("Failed to allocate memory for spilling");
+      }
+      return NULL;
+    }
+
+    memcpy(dir, opts->spill_dir, dir_len + 1);
+    dq->spill->dir = dir;
+    dq->spill->budget = opts->spill_budget;
+    dq->spill->segment_size = opts->spill_segment_size
+                                  ? opts->spill_segment_size
+                                  : spill_default_segment_size;
+    dq->spill->mem_bytes = 0;
+    dq->spill->spilled_count = 0;
+    dq->spill->segment_seq = 0;
+    dq->spill->head = NULL;
+    dq->spill->tail = NULL;
+  }
+
+  mutex_init(dq->mutex);
+  dq->clock_id = opts->monotonic_clock ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+  cond_var_init_with_clock(&dq->read_cond, dq->clock_id);
+  cond_var_init_with_clock(&dq->batch_cond, dq->clock_id);
+  dq->batch_threshold = 0;
+  dq->batch_waiters = 0;
+  dq->msg_count = 0;
+  dq->recv_waiters = (waiter_list){NULL, NULL};
+  dq->head = NULL;
+  dq->tail = NULL;
+  dq->generation = next_dq_generation();
+  dq->tags.entries = NULL;
+  cond_var_init_with_clock(&dq->tag_cond, dq->clock_id);
+  dq->tag_waiters = 0;
+  dq->writing_disabled = false;
+  dq->lifo = opts->lifo;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return dq;
+}
+
+void __dynamic_queue_destroy(dynamic_queue* dq) {
+  if (dq) {
+    mutex_destroy(dq->mutex);
+    cond_var_destroy(dq->read_cond);
+    cond_var_destroy(dq->batch_cond);
+    cond_var_destroy(dq->tag_cond);
+    if (dq->tags.entries) {
+      u64_map_destroy(&dq->tags);
+    }
+    destroy_dq_dllist(dq);
+    if (dq->spill) {
+      while (dq->spill->head) {
+        spill_segment* seg = dq->spill->head;
+        dq->spill->head = seg->next;
+        free_spill_segment(dq, seg);
+      }
+      mem_free(&dq->allocator, dq->spill->dir);
+      mem_free(&dq->allocator, dq->spill);
+    }
+    ctcomm_allocator alloc = dq->allocator;
+    mem_free(&alloc, dq);
+  }
+}
+
+// Moves spilled messages back into the list, until half of the budget is
+// used up. A message only leaves the disk once it's linked, so running
+// out of memory leaves it (and the order) where it is. This function
+// should always be called while holding the mutex.
+ctcomm_retval_t page_in_spilled_msgs(dynamic_queue* dq) {
+  dq_spill* spill = dq->spill;
+
+  do {
+    dllist_node* node =
+        (dllist_node*)mem_alloc(&dq->allocator, sizeof(dllist_node));
+    if (!node) {
+      return ctcom_not_enough_memory;
+    }
+
+    void* data;
+    ctcomm_retval_t msg_size = read_spilled_msg(dq, &data);
+    if (msg_size < ctcom_success_threshold) {
+      mem_free(&dq->allocator, node);
+      return msg_size;
+    }
+
+    drop_spilled_msg(dq, msg_size);
+    link_msg_to_dq_tail(dq, node, &data, msg_size);
+  } while (spill->spilled_count > 0 && spill->mem_bytes < spill->budget / 2);
+
+  return ctcom_success_threshold;
+}
+
+ctcomm_retval_t _sendto_dq(dynamic_queue* dq, void** msg, uint32_t msg_size) {
+  // Receive waiters are only armed while the queue is empty.
+  ctcomm_waiter* w = waiter_list_pop(&dq->recv_waiters);
+  if (w) {
+    if (*msg == NULL) {
+      msg_size = 0;
+    }
+    w->msg = *msg;
+    w->msg_size = msg_size;
+    w->result = msg_size;
+    *msg = NULL;
+    w->notify(w);
+    return msg_size;
+  }
+
+  ctcomm_retval_t retval;
+
+  // Once a message is spilled, the following ones have to be spilled as
+  // well until the disk is drained, to keep the FIFO order.
+  if (dq->spill && (dq->spill->spilled_count > 0 ||
+                    dq->spill->mem_bytes + msg_size > dq->spill->budget)) {
+    if (*msg == NULL) {
+      msg_size = 0;
+    }
+    retval = spill_msg(dq, msg, msg_size) ? (int)msg_size
+                                          : ctcom_not_enough_memory;
+  } else {
+    retval = append_msg_to_dq_tail(dq, msg, msg_size);
+  }
+
+  if (retval != ctcom_not_enough_memory) {
+    ++dq->msg_count;
+    cond_var_signal(dq->read_cond);
+    if (dq->msg_count == dq->batch_threshold) {
+      cond_var_broadcast(dq->batch_cond);
+    }
+  }
+
+  return retval;
+}
+
+int verify_dynmq_send_zc_params(dynamic_queue* dq, void** msg,
+                                uint32_t msg_size) {
+  if (!dq || !msg || (msg_size == 0 && *msg != NULL)) {
+    return ctcom_invalid_arguments;
+  }
+
+  return ctcom_success_threshold;
+}
+
+ctcomm_retval_t dynmq_send_zc(dynamic_queue* dq, void** msg,
+                              uint32_t msg_size) {
+  if (verify_dynmq_send_zc_params(dq, msg, msg_size) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->writing_disabled) {
+    mutex_unlock(dq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  msg_size = _sendto_dq(dq, msg, msg_size);
+
+  mutex_unlock(dq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t _recvfrom_dq(dynamic_queue* dq, void** target_buf) {
+  if (!dq->head && dq->spill && dq->spill->spilled_count > 0) {
+    ctcomm_retval_t paged_in = page_in_spilled_msgs(dq);
+    if (paged_in < ctcom_success_threshold && !dq->head) {
+      return paged_in;
+    }
+  }
+
+  ctcomm_retval_t retval = dq->lifo
+                               ? remove_msg_from_dq_tail(dq, target_buf)
+                               : remove_msg_from_dq_head(dq, target_buf);
+
+  if (retval != ctcom_container_empty) {
+    --dq->msg_count;
+  }
+
+  return retval;
+}
+
+ctcomm_retval_t verify_recvfrom_dq_zc_params(dynamic_queue* dq,
+                                             void** target_buf) {
+  if (!dq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  return ctcom_success_threshold;
+}
+
+ctcomm_retval_t dynmq_recv_zc(dynamic_queue* dq, void** target_buf) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  while (dq->msg_count == 0) {
+    cond_var_wait(dq->read_cond, dq->mutex);
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_dq(dq, target_buf);
+
+  mutex_unlock(dq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t dynmq_try_recv_zc(dynamic_queue* dq, void** target_buf) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dq->mutex);
+
+  if (dq->msg_count > 0) {
+    result = _recvfrom_dq(dq, target_buf);
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+// This function should always be called while holding the mutex.
+int wait_until_dq_not_empty(dynamic_queue* dq,
+                            const struct timespec* deadline) {
+  while (dq->msg_count == 0) {
+    int retval = cond_var_timedwait(dq->read_cond, dq->mutex, *deadline);
+    if (retval) {
+      return retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+    }
+  }
+
+  return 0;
+}
+
+ctcomm_retval_t dynmq_timed_recv_zc(dynamic_queue* dq, void** target_buf,
+                                    struct timespec* timeout) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->msg_count == 0) {
+    struct timespec abs_time;
+    clock_gettime(dq->clock_id, &abs_time);
+    add_duration_to_timespec(&abs_time, timeout);
+
+    int retval = wait_until_dq_not_empty(dq, &abs_time);
+    if (retval) {
+      mutex_unlock(dq->mutex);
+      return retval;
+    }
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_dq(dq, target_buf);
+
+  mutex_unlock(dq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t dynmq_recv_until_zc(dynamic_queue* dq, void** target_buf,
+                                    const struct timespec* deadline) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0 || !deadline) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  int retval = wait_until_dq_not_empty(dq, deadline);
+  if (retval) {
+    mutex_unlock(dq->mutex);
+    return retval;
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_dq(dq, target_buf);
+
+  mutex_unlock(dq->mutex);
+
+  return msg_size;
+}
+
+// This function should always be called while holding the mutex.
+int wait_for_dq_batch(dynamic_queue* dq, uint32_t count,
+                      const struct timespec* deadline) {
+  if (dq->msg_count >= count) {
+    return 0;
+  }
+
+  int retval = 0;
+
+  ++dq->batch_waiters;
+  while (dq->msg_count < count) {
+    if (dq->batch_threshold == 0 || count < dq->batch_threshold) {
+      dq->batch_threshold = count;
+    }
+    if (deadline) {
+      retval = cond_var_timedwait(dq->batch_cond, dq->mutex, *deadline);
+    } else {
+      retval = cond_var_wait(dq->batch_cond, dq->mutex);
+    }
+    if (retval) {
+      retval = retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+      break;
+    }
+  }
+
+  dq->batch_threshold = 0;
+  if (--dq->batch_waiters > 0) {
+    cond_var_broadcast(dq->batch_cond);
+  }
+
+  return retval;
+}
+
+ctcomm_retval_t dynmq_recv_batch_min(dynamic_queue* dq, void** bufs,
+                                     uint32_t* sizes, uint32_t min_count,
+                                     uint32_t max_count,
+                                     struct timespec* linger) {
+  if (!dq || !bufs || !linger || min_count == 0 || max_count < min_count) {
+    return ctcom_invalid_arguments;
+  }
+
+  int retval;
+
+  mutex_lock(dq->mutex);
+
+  for (;;) {
+    if ((retval = wait_for_dq_batch(dq, 1, NULL))) {
+      break;
+    }
+
+    if (dq->msg_count < min_count) {
+      struct timespec deadline;
+      clock_gettime(dq->clock_id, &deadline);
+      add_duration_to_timespec(&deadline, linger);
+
+      retval = wait_for_dq_batch(dq, min_count, &deadline);
+      if (retval && retval != ctcom_timedout) {
+        break;
+      }
+      retval = 0;
+    }
+
+    if (dq->msg_count > 0) {
+      break;
+    }
+  }
+
+  if (retval) {
+    mutex_unlock(dq->mutex);
+    return retval;
+  }
+
+  uint32_t count = dq->msg_count < max_count ? dq->msg_count : max_count;
+  for (uint32_t i = 0; i < count; ++i) {
+    ctcomm_retval_t msg_size = _recvfrom_dq(dq, &bufs[i]);
+    if (msg_size < 0) {
+      // Stopping at a spilled message which couldn't be paged in.
+      if (i == 0) {
+        retval = msg_size;
+      }
+      count = i;
+      break;
+    }
+    if (sizes) {
+      sizes[i] = msg_size;
+    }
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return count ? (int)count : retval;
+}
+
+ctcomm_retval_t dynmq_recv_or_wait(dynamic_queue* dq, void** target_buf,
+                                   ctcomm_waiter* w) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0 || !w ||
+      !w->notify) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dq->mutex);
+
+  if (dq->msg_count > 0) {
+    result = _recvfrom_dq(dq, target_buf);
+  } else {
+    w->msg = NULL;
+    w->msg_size = 0;
+    w->result = ctcom_container_empty;
+    w->buffer = NULL;
+    w->req = NULL;
+    waiter_list_push(&dq->recv_waiters, w);
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+bool dynmq_cancel_wait(dynamic_queue* dq, ctcomm_waiter* w) {
+  if (!dq || !w) {
+    return false;
+  }
+
+  mutex_lock(dq->mutex);
+  bool removed = waiter_list_remove(&dq->recv_waiters, w);
+  mutex_unlock(dq->mutex);
+
+  return removed;
+}
+
+ctcomm_retval_t dynmq_disable_sending(dynamic_queue* dq) {
+  if (dq) {
+    mutex_lock(dq->mutex);
+    dq->writing_disabled = true;
+    mutex_unlock(dq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+ctcomm_retval_t dynmq_enable_sending(dynamic_queue* dq) {
+  if (dq) {
+    mutex_lock(dq->mutex);
+    dq->writing_disabled = false;
+    mutex_unlock(dq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+int dynmq_spilled_count(dynamic_queue* dq) {
+  int result = -1;
+
+  if (dq) {
+    mutex_lock(dq->mutex);
+    result = dq->spill ? dq->spill->spilled_count : 0;
+    mutex_unlock(dq->mutex);
+  }
+
+  return result;
+}
+
+int dynmq_msg_count(dynamic_queue* dq) {
+  int result = -1;
+
+  if (dq) {
+    mutex_lock(dq->mutex);
+    result = dq->msg_count;
+    mutex_unlock(dq->mutex);
+  }
+
+  return result;
+}
+
+ctcomm_retval_t dynmq_send_with_handle_zc(dynamic_queue* dq, void** msg,
+                                          uint32_t msg_size,
+                                          dynmq_handle** handle) {
+  // Spilled messages have no nodes to refer to.
+  if (verify_dynmq_send_zc_params(dq, msg, msg_size) != 0 || !handle ||
+      dq->spill) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->writing_disabled) {
+    mutex_unlock(dq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  // An armed receive waiter takes the message right away, the handle
+  // then refers to an already received message.
+  bool handed_over = dq->recv_waiters.head != NULL;
+  dllist_node* node;
+
+  if (handed_over) {
+    node = (dllist_node*)mem_alloc(&dq->allocator, sizeof(dllist_node));
+    if (!node) {
+      mutex_unlock(dq->mutex);
+      return ctcom_not_enough_memory;
+    }
+    node->msg.data = NULL;
+    node->msg.size = 0;
+    node->prev = NULL;
+    node->next = NULL;
+    node->refs = 1;
+    node->queued = false;
+    msg_size = _sendto_dq(dq, msg, msg_size);
+  } else {
+    msg_size = _sendto_dq(dq, msg, msg_size);
+    if ((int)msg_size < ctcom_success_threshold) {
+      mutex_unlock(dq->mutex);
+      return msg_size;
+    }
+    node = dq->tail;
+    node->refs = 2;
+    node->queued = true;
+    node->gen = dq->generation;
+  }
+
+  mutex_unlock(dq->mutex);
+
+  *handle = node;
+
+  return msg_size;
+}
+
+ctcomm_retval_t dynmq_cancel(dynamic_queue* dq, dynmq_handle* handle,
+                             void** target_buf) {
+  if (!dq || !handle || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  dllist_node* node = handle;
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dq->mutex);
+
+  if (dq_node_queued(dq, node)) {
+    unlink_dq_node(dq, node);
+    untag_dq_node(dq, node);
+    node->queued = false;
+    --dq->msg_count;
+
+    *target_buf = node->msg.data;
+    result = node->msg.size;
+    node->msg.data = NULL;
+
+    // The handle still holds a reference.
+    release_dq_node(&dq->allocator, node);
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t dynmq_requeue_front(dynamic_queue* dq, dynmq_handle* handle) {
+  if (!dq || !handle) {
+    return ctcom_invalid_arguments;
+  }
+
+  dllist_node* node = handle;
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dq->mutex);
+
+  if (dq_node_queued(dq, node)) {
+    // The front is where the next message is received from.
+    if (dq->lifo && node != dq->tail) {
+      unlink_dq_node(dq, node);
+      node->prev = dq->tail;
+      dq->tail->next = node;
+      dq->tail = node;
+      retag_dq_node(dq, node, false);
+    } else if (!dq->lifo && node != dq->head) {
+      unlink_dq_node(dq, node);
+      node->next = dq->head;
+      dq->head->prev = node;
+      dq->head = node;
+      retag_dq_node(dq, node, true);
+    }
+    result = ctcom_success_threshold;
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+void dynmq_handle_release(dynamic_queue* dq, dynmq_handle* handle) {
+  if (dq && handle) {
+    release_dq_node(&dq->allocator, handle);
+  }
+}
+
+ctcomm_retval_t dynmq_send_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                     void** msg, uint32_t msg_size) {
+  if (verify_dynmq_send_zc_params(dq, msg, msg_size) != 0 || dq->spill) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->writing_disabled) {
+    mutex_unlock(dq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  // A waiting untagged receiver takes it right away.
+  bool handed_over = dq->recv_waiters.head != NULL;
+  ctcomm_retval_t retval = _sendto_dq(dq, msg, msg_size);
+
+  if (!handed_over && retval >= ctcom_success_threshold) {
+    dllist_node* node = dq->tail;
+    if (!tag_dq_node(dq, node, tag)) {
+      // Take it back, the caller keeps the ownership.
+      unlink_dq_node(dq, node);
+      --dq->msg_count;
+      *msg = node->msg.data;
+      mem_free(&dq->allocator, node);
+      retval = ctcom_not_enough_memory;
+    } else if (dq->tag_waiters > 0) {
+      cond_var_broadcast(dq->tag_cond);
+    }
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return retval;
+}
+
+// This function should always be called while holding the mutex.
+ctcomm_retval_t _recv_tagged_from_dq(dynamic_queue* dq, uint64_t tag,
+                                     void** target_buf) {
+  dllist_node* node =
+      dq->tags.entries ? (dllist_node*)u64_map_get(&dq->tags, tag) : NULL;
+  if (!node) {
+    return ctcom_container_empty;
+  }
+
+  --dq->msg_count;
+
+  return take_msg_from_dq_node(dq, node, target_buf);
+}
+
+ctcomm_retval_t dynmq_recv_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                     void** target_buf) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  ctcomm_retval_t result;
+  ++dq->tag_waiters;
+  while ((result = _recv_tagged_from_dq(dq, tag, target_buf)) ==
+         ctcom_container_empty) {
+    cond_var_wait(dq->tag_cond, dq->mutex);
+  }
+  --dq->tag_waiters;
+
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t dynmq_try_recv_tagged_zc(dynamic_queue* dq, uint64_t tag,
+                                         void** target_buf) {
+  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+  ctcomm_retval_t result = _recv_tagged_from_dq(dq, tag, target_buf);
+  mutex_unlock(dq->mutex);
+
+  return result;
+}
+
+bool same_allocator(const ctcomm_allocator* a, const ctcomm_allocator* b) {
+  return a->alloc == b->alloc && a->realloc == b->realloc &&
+         a->free == b->free && a->ctx == b->ctx;
+}
+
+ctcomm_retval_t dynmq_chain_init(dynmq_chain* chain, dynamic_queue* dq) {
+  if (!chain || !dq) {
+    return ctcom_invalid_arguments;
+  }
+
+  chain->head = NULL;
+  chain->tail = NULL;
+  chain->count = 0;
+  chain->allocator = dq->allocator;
+
+  return ctcom_success_threshold;
+}
+
+ctcomm_retval_t dynmq_chain_push(dynmq_chain* chain, void** msg,
+                                 uint32_t msg_size) {
+  if (!chain || !msg || (msg_size == 0 && *msg != NULL)) {
+    return ctcom_invalid_arguments;
+  }
+
+  dllist_node* node =
+      (dllist_node*)mem_alloc(&chain->allocator, sizeof(dllist_node));
+  if (!node) {
+    return ctcom_not_enough_memory;
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  node->msg.data = *msg;
+  node->msg.size = msg_size;
+  *msg = NULL;
+  node->next = NULL;
+  node->prev = chain->tail;
+  node->refs = 0;
+  node->tagged = false;
+
+  if (chain->tail) {
+    chain->tail->next = node;
+  } else {
+    chain->head = node;
+  }
+  chain->tail = node;
+  ++chain->count;
+
+  return msg_size;
+}
+
+ctcomm_retval_t dynmq_chain_pop(dynmq_chain* chain, void** target_buf) {
+  if (!chain || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  dllist_node* node = chain->head;
+  if (!node) {
+    return ctcom_container_empty;
+  }
+
+  chain->head = node->next;
+  if (chain->head) {
+    chain->head->prev = NULL;
+  } else {
+    chain->tail = NULL;
+  }
+  --chain->count;
+
+  *target_buf = node->msg.data;
+  int msg_size = node->msg.size;
+  release_dq_node(&chain->allocator, node);
+
+  return msg_size;
+}
+
+ctcomm_retval_t dynmq_recv_all(dynamic_queue* dq, dynmq_chain* chain) {
+  if (!dq || !chain) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dq->mutex);
+
+  // Spilled messages stay where they are, they come after the list.
+  uint32_t spilled_count = dq->spill ? dq->spill->spilled_count : 0;
+
+  chain->head = dq->head;
+  chain->tail = dq->tail;
+  chain->count = dq->msg_count - spilled_count;
+  chain->allocator = dq->allocator;
+
+  // Neither handles nor tags can reach the messages once they're off the
+  // queue, a new generation leaves them behind in O(1).
+  dq->generation = next_dq_generation();
+  if (dq->tags.entries && dq->tags.count > 0) {
+    u64_map_destroy(&dq->tags);
+  }
+
+  dq->head = NULL;
+  dq->tail = NULL;
+  dq->msg_count = spilled_count;
+  if (dq->spill) {
+    dq->spill->mem_bytes = 0;
+  }
+
+  mutex_unlock(dq->mutex);
+
+  return chain->count;
+}
+
+ctcomm_retval_t dynmq_send_chain(dynamic_queue* dq, dynmq_chain* chain) {
+  // The nodes end up being freed by the queue. Spilling queues would have
+  // to write the chain to disk, which defeats the purpose.
+  if (!dq || !chain || !same_allocator(&chain->allocator, &dq->allocator) ||
+      dq->spill) {
+    return ctcom_invalid_arguments;
+  }
+
+  uint32_t count = chain->count;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->writing_disabled) {
+    mutex_unlock(dq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  // Receive waiters are only armed while the queue is empty, they get
+  // served first.
+  ctcomm_waiter* w;
+  while (chain->head && (w = waiter_list_pop(&dq->recv_waiters))) {
+    int msg_size = dynmq_chain_pop(chain, &w->msg);
+    w->msg_size = msg_size;
+    w->result = msg_size;
+    w->notify(w);
+  }
+
+  if (chain->head) {
+    uint32_t old_count = dq->msg_count;
+
+    chain->head->prev = dq->tail;
+    if (dq->tail) {
+      dq->tail->next = chain->head;
+    } else {
+      dq->head = chain->head;
+    }
+    dq->tail = chain->tail;
+    dq->msg_count += chain->count;
+
+    cond_var_broadcast(dq->read_cond);
+    if (dq->batch_threshold > old_count &&
+        dq->batch_threshold <= dq->msg_count) {
+      cond_var_broadcast(dq->batch_cond);
+    }
+  }
+
+  mutex_unlock(dq->mutex);
+
+  chain->head = NULL;
+  chain->tail = NULL;
+  chain->count = 0;
+
+  return count;
+}
+
+// Producer handle related section starts here.
+typedef struct staging_buffer {
+  message* msgs;
+  uint32_t capacity;
+  uint32_t count;
+
+  // 0 means no latency bound.
+  uint64_t max_latency_ns;
+  // When the oldest staged message was staged, on CLOCK_MONOTONIC.
+  uint64_t oldest_staged_ns;
+
+  // NULL means free().
+  void (*release_cb)(void* msg, uint32_t msg_size, void* release_ctx);
+  void* release_ctx;
+} staging_buffer;
+
+struct circq_producer {
+  circular_queue* cq;
+  staging_buffer staged;
+};
+
+struct dynmq_producer {
+  dynamic_queue* dq;
+  staging_buffer staged;
+};
+
+uint64_t monotonic_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return timespec_to_ns(&now);
+}
+
+bool staging_buffer_init(staging_buffer* sb, ctcomm_allocator* alloc,
+                         uint32_t capacity, const prod_opts* opts) {
+  sb->msgs = (message*)mem_alloc(alloc, capacity * sizeof(message));
+  if (!sb->msgs) {
+    return false;
+  }
+
+  sb->capacity = capacity;
+  sb->count = 0;
+  sb->max_latency_ns =
+      opts->max_latency ? timespec_to_ns(opts->max_latency) : 0;
+  sb->oldest_staged_ns = 0;
+  sb->release_cb = opts->release_cb;
+  sb->release_ctx = opts->release_ctx;
+
+  return true;
+}
+
+void staging_buffer_push(staging_buffer* sb, void** msg, uint32_t msg_size) {
+  if (sb->count == 0 && sb->max_latency_ns) {
+    sb->oldest_staged_ns = monotonic_now_ns();
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  sb->msgs[sb->count].data = *msg;
+  sb->msgs[sb->count++].size = msg_size;
+  *msg = NULL;
+}
+
+bool staging_buffer_is_due(const staging_buffer* sb) {
+  if (sb->count == sb->capacity) {
+    return true;
+  }
+
+  return sb->count > 0 && sb->max_latency_ns &&
+         monotonic_now_ns() - sb->oldest_staged_ns >= sb->max_latency_ns;
+}
+
+// Drops the first 'published' messages, what's left gets published with
+// the next flush.
+void staging_buffer_consume(staging_buffer* sb, uint32_t published) {
+  sb->count -= published;
+  if (sb->count > 0) {
+    memmove(sb->msgs, sb->msgs + published, sb->count * sizeof(message));
+    if (sb->max_latency_ns) {
+      sb->oldest_staged_ns = monotonic_now_ns();
+    }
+  }
+}
+
+// Messages which could never be published go to the release callback.
+void staging_buffer_destroy(staging_buffer* sb, ctcomm_allocator* alloc) {
+  for (uint32_t i = 0; i < sb->count; ++i) {
+    if (sb->release_cb) {
+      sb->release_cb(sb->msgs[i].data, sb->msgs[i].size, sb->release_ctx);
+    } else {
+      free(sb->msgs[i].data);
+    }
+  }
+  mem_free(alloc, sb->msgs);
+}
+
+circq_producer* circq_producer_create(circular_queue* cq, uint32_t capacity,
+                                      const struct timespec* max_latency,
+                                      char** err_str) {
+  prod_opts opts = {.max_latency = max_latency};
+
+  return circq_producer_create_with_opts(cq, capacity, &opts, err_str);
+}
+
+circq_producer* circq_producer_create_with_opts(circular_queue* cq,
+                                                uint32_t capacity,
+                                                const prod_opts* opts,
+                                                char** err_str) {
+  static const prod_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  if (!cq || cq_owns_buffers(cq)) {
+    if (err_str) {
+      *err_str = CERR_STR("The queue should be a zero copy one");
+    }
+    return NULL;
+  }
+
+  if (capacity == 0 || capacity > max_allowed_cq_size) {
+    if (err_str) {
+      *err_str =
+          CERR_STR("The capacity should be in the range of [1, INT32_MAX]");
+    }
+    return NULL;
+  }
+
+  circq_producer* prod =
+      (circq_producer*)mem_alloc(&cq->allocator, sizeof(circq_producer));
+  if (!prod) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate the producer");
+    }
+    return NULL;
+  }
+
+  if (!staging_buffer_init(&prod->staged, &cq->allocator, capacity, opts)) {
+    mem_free(&cq->allocator, prod);
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate the staging buffer");
+    }
+    return NULL;
+  }
+
+  prod->cq = cq;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return prod;
+}
+
+void __circq_producer_destroy(circq_producer* prod) {
+  if (prod) {
+    circq_prod_flush(prod);
+    staging_buffer_destroy(&prod->staged, &prod->cq->allocator);
+    mem_free(&prod->cq->allocator, prod);
+  }
+}
+
+int circq_prod_flush(circq_producer* prod) {
+  if (!prod) {
+    return ctcom_invalid_arguments;
+  }
+
+  circular_queue* cq = prod->cq;
+  staging_buffer* sb = &prod->staged;
+  int retval = ctcom_success_threshold;
+  uint32_t published = 0;
+
+  if (sb->count == 0) {
+    return 0;
+  }
+
+  if (cq->overwrite_oldest) {
+    // Evictions have to be reported outside of the lock, so lossy queues
+    // don't benefit from the batching.
+    for (; published < sb->count; ++published) {
+      retval = _send_overwriting_cq(cq, &sb->msgs[published].data,
+                                    sb->msgs[published].size);
+      if (retval < ctcom_success_threshold) {
+        break;
+      }
+    }
+  } else {
+    mutex_lock(cq->mutex);
+
+    if (cq->writing_disabled) {
+      retval = ctcom_writing_disabled;
+    }
+
+    for (; retval >= ctcom_success_threshold && published < sb->count;
+         ++published) {
+      while (cq->msg_count == cq->max_size) {
+        cond_var_wait(cq->write_cond, cq->mutex);
+      }
+
+      retval = _sendto_cq(cq, &sb->msgs[published].data,
+                          sb->msgs[published].size);
+      if (retval < ctcom_success_threshold) {
+        break;
+      }
+    }
+
+    mutex_unlock(cq->mutex);
+  }
+
+  staging_buffer_consume(sb, published);
+
+  return retval < ctcom_success_threshold ? retval : (int)published;
+}
+
+int circq_prod_send_zc(circq_producer* prod, void** msg, uint32_t msg_size) {
+  if (!prod || verify_circq_send_zc_params(prod->cq, msg, msg_size) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  // A previous flush has failed, don't take the message unless we can
+  // make some room.
+  if (prod->staged.count == prod->staged.capacity) {
+    int retval = circq_prod_flush(prod);
+    if (retval < ctcom_success_threshold) {
+      return retval;
+    }
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  staging_buffer_push(&prod->staged, msg, msg_size);
+
+  // Failures are reported by the next send or flush, the message has
+  // already been taken over.
+  if (staging_buffer_is_due(&prod->staged)) {
+    circq_prod_flush(prod);
+  }
+
+  return msg_size;
+}
+
+dynmq_producer* dynmq_producer_create(dynamic_queue* dq, uint32_t capacity,
+                                      const struct timespec* max_latency,
+                                      char** err_str) {
+  prod_opts opts = {.max_latency = max_latency};
+
+  return dynmq_producer_create_with_opts(dq, capacity, &opts, err_str);
+}
+
+dynmq_producer* dynmq_producer_create_with_opts(dynamic_queue* dq,
+                                                uint32_t capacity,
+                                                const prod_opts* opts,
+                                                char** err_str) {
+  static const prod_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  if (!dq) {
+    if (err_str) {
+      *err_str = CERR_STR("The queue can not be NULL");
+    }
+    return NULL;
+  }
+
+  if (capacity == 0 || capacity > max_allowed_cq_size) {
+    if (err_str) {
+      *err_str =
+          CERR_STR("The capacity should be in the range of [1, INT32_MAX]");
+    }
+    return NULL;
+  }
+
+  dynmq_producer* prod =
+      (dynmq_producer*)mem_alloc(&dq->allocator, sizeof(dynmq_producer));
+  if (!prod) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate the producer");
+    }
+    return NULL;
+  }
+
+  if (!staging_buffer_init(&prod->staged, &dq->allocator, capacity, opts)) {
+    mem_free(&dq->allocator, prod);
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate the staging buffer");
+    }
+    return NULL;
+  }
+
+  prod->dq = dq;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return prod;
+}
+
+void __dynmq_producer_destroy(dynmq_producer* prod) {
+  if (prod) {
+    dynmq_prod_flush(prod);
+    staging_buffer_destroy(&prod->staged, &prod->dq->allocator);
+    mem_free(&prod->dq->allocator, prod);
+  }
+}
+
+int dynmq_prod_flush(dynmq_producer* prod) {
+  if (!prod) {
+    return ctcom_invalid_arguments;
+  }
+
+  dynamic_queue* dq = prod->dq;
+  staging_buffer* sb = &prod->staged;
+  int retval = ctcom_success_threshold;
+  uint32_t published = 0;
+
+  if (sb->count == 0) {
+    return 0;
+  }
+
+  mutex_lock(dq->mutex);
+
+  if (dq->writing_disabled) {
+    retval = ctcom_writing_disabled;
+  }
+
+  for (; retval >= ctcom_success_threshold && published < sb->count;
+       ++published) {
+    retval = _sendto_dq(dq, &sb->msgs[published].data,
+                        sb->msgs[published].size);
+    if (retval < ctcom_success_threshold) {
+      break;
+    }
+  }
+
+  mutex_unlock(dq->mutex);
+
+  staging_buffer_consume(sb, published);
+
+  return retval < ctcom_success_threshold ? retval : (int)published;
+}
+
+int dynmq_prod_send_zc(dynmq_producer* prod, void** msg, uint32_t msg_size) {
+  if (!prod || verify_dynmq_send_zc_params(prod->dq, msg, msg_size) != 0) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (prod->staged.count == prod->staged.capacity) {
+    int retval = dynmq_prod_flush(prod);
+    if (retval < ctcom_success_threshold) {
+      return retval;
+    }
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  staging_buffer_push(&prod->staged, msg, msg_size);
+
+  if (staging_buffer_is_due(&prod->staged)) {
+    dynmq_prod_flush(prod);
+  }
+
+  return msg_size;
+}
+
+// One-shot cell related section starts here.
+
+// 'state' of a cell. A timed out waiter leaves the cell parked, which
+// only costs the setter a needless wake up.
+#define cell_empty 0
+#define cell_parked 1
+#define cell_armed 2
+#define cell_set 3
+// Taken by the setter which won the cell, until the value is stored.
+#define cell_setting 4
+
+void oneshot_init(ctcomm_oneshot* cell) {
+  if (!cell) {
+    return;
+  }
+
+  cell->size = 0;
+  cell->value = NULL;
+  cell->callback = NULL;
+  __atomic_store_n(&cell->state, cell_empty, __ATOMIC_RELEASE);
+}
+
+int oneshot_set(ctcomm_oneshot* cell, void* value, uint32_t size) {
+  if (!cell) {
+    return ctcom_invalid_arguments;
+  }
+
+  // The cell is won first, a losing setter mustn't touch it: once it's
+  // set, the callback may have freed it.
+  uint32_t prev = __atomic_load_n(&cell->state, __ATOMIC_ACQUIRE);
+  do {
+    if (prev == cell_set || prev == cell_setting) {
+      return ctcom_invalid_arguments;
+    }
+  } while (!__atomic_compare_exchange_n(&cell->state, &prev, cell_setting,
+                                        false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE));
+
+  // Nobody else touches them before the cell is set.
+  cell->value = value;
+  cell->size = size;
+
+  __atomic_store_n(&cell->state, cell_set, __ATOMIC_RELEASE);
+  if (prev == cell_parked) {
+    wake_futex_word(&cell->state);
+  } else if (prev == cell_armed) {
+    cell->callback(cell, value, size);
+  }
+
+  return ctcom_success_threshold;
+}
+
+int oneshot_try_get(ctcomm_oneshot* cell, void** value) {
+  if (!cell || !value) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (__atomic_load_n(&cell->state, __ATOMIC_ACQUIRE) != cell_set) {
+    return ctcom_container_empty;
+  }
+
+  *value = cell->value;
+
+  return cell->size;
+}
+
+int _wait_for_oneshot(ctcomm_oneshot* cell, void** value,
+                      const struct timespec* deadline) {
+  uint32_t state = __atomic_load_n(&cell->state, __ATOMIC_ACQUIRE);
+
+  while (state != cell_set) {
+    if (state == cell_armed) {
+      return ctcom_invalid_arguments;
+    }
+
+    if (state == cell_empty &&
+        !__atomic_compare_exchange_n(&cell->state, &state, cell_parked,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    // A cell which is being set is only spun on, it's set right away.
+    if (state != cell_setting) {
+      int retval = wait_on_futex_word(&cell->state, cell_parked, deadline);
+      if (retval) {
+        return retval;
+      }
+    }
+    state = __atomic_load_n(&cell->state, __ATOMIC_ACQUIRE);
+  }
+
+  *value = cell->value;
+
+  return cell->size;
+}
+
+int oneshot_wait(ctcomm_oneshot* cell, void** value) {
+  if (!cell || !value) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _wait_for_oneshot(cell, value, NULL);
+}
+
+int oneshot_timed_wait(ctcomm_oneshot* cell, void** value,
+                       struct timespec* timeout) {
+  if (!cell || !value || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  add_duration_to_timespec(&deadline, timeout);
+
+  return _wait_for_oneshot(cell, value, &deadline);
+}
+
+// Returns false if the cell is set already, the callback isn't run then.
+bool arm_oneshot(ctcomm_oneshot* cell, ctcomm_oneshot_cb cb) {
+  uint32_t state = __atomic_load_n(&cell->state, __ATOMIC_ACQUIRE);
+
+  cell->callback = cb;
+
+  while (state != cell_set) {
+    // The setter has won the cell, the value is about to be there.
+    if (state == cell_setting) {
+      state = __atomic_load_n(&cell->state, __ATOMIC_ACQUIRE);
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&cell->state, &state, cell_armed,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int oneshot_on_set(ctcomm_oneshot* cell, ctcomm_oneshot_cb cb) {
+  if (!cell || !cb) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (__atomic_load_n(&cell->state, __ATOMIC_ACQUIRE) == cell_armed) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (arm_oneshot(cell, cb)) {
+    return ctcom_success_threshold;
+  }
+
+  cb(cell, cell->value, cell->size);
+
+  return ctcom_success_threshold;
+}
+
+// Channel related section starts here.
+// Header of the buffers handed out by chan_alloc_buf(), the returned
+// ones are chained through 'next'.
+typedef struct chan_buf {
+  struct chan_buf* next;
+  // The capacity is a power of two, kept as its exponent.
+  uint32_t capacity_shift;
+  // Whether the owner allocated it, returned buffers go back to the side
+  // which allocated them.
+  uint32_t from_owner;
+} chan_buf;
+
+// Each side gets its buffers back on a lane of its own, which doesn't
+// share a lock with the queues.
+typedef struct return_lane {
+  mutex_t mutex;
+  chan_buf* head;
+} return_lane;
+
+struct channel {
+  thread_id_t owner_tid;
+  circular_queue* owner_to_workers_cq;
+  circular_queue* workers_to_owner_cq;
+
+  // The buffers allocated by the owner, and by the workers.
+  return_lane owner_lane;
+  return_lane workers_lane;
+  // Only touched by the owner, reloaded from owner_lane as a whole.
+  chan_buf* owner_cache;
+
+  ctcomm_allocator allocator;
+};
+
+channel* channel_create(uint32_t max_size, char** err_str) {
+  return channel_create_with_opts(max_size, NULL, err_str);
+}
+
+channel* channel_create_with_opts(uint32_t max_size, const circq_opts* opts,
+                                  char** err_str) {
+  if (opts && opts->copy_arena_size) {
+    if (err_str) {
+      *err_str = CERR_STR("Channels don't support the copy mode");
+    }
+    return NULL;
+  }
+
+  const ctcomm_allocator* alloc =
+      select_allocator(opts ? opts->allocator : NULL);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  channel* ch = (channel*)mem_alloc(alloc, sizeof(channel));
+  if (!ch) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for channel");
+    }
+    return NULL;
+  }
+
+  ch->allocator = *alloc;
+
+  ch->owner_to_workers_cq =
+      circular_queue_create_with_opts(max_size, opts, err_str);
+  if (!ch->owner_to_workers_cq) {
+    mem_free(alloc, ch);
+    return NULL;
+  }
+
+  ch->workers_to_owner_cq =
+      circular_queue_create_with_opts(max_size, opts, err_str);
+  if (!ch->workers_to_owner_cq) {
+    circular_queue_destroy(ch->owner_to_workers_cq);
+    mem_free(alloc, ch);
+    return NULL;
+  }
+
+  ch->owner_tid = get_thread_id();
+
+  mutex_init(ch->owner_lane.mutex);
+  mutex_init(ch->workers_lane.mutex);
+  ch->owner_lane.head = NULL;
+  ch->workers_lane.head = NULL;
+  ch->owner_cache = NULL;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return ch;
+}
+
+void free_chan_bufs(channel* ch, chan_buf* head) {
+  while (head) {
+    chan_buf* next = head->next;
+    mem_free(&ch->allocator, head);
+    head = next;
+  }
+}
+
+void __channel_destroy(channel* ch) {
+  if (ch) {
+    circular_queue_destroy(ch->owner_to_workers_cq);
+    circular_queue_destroy(ch->workers_to_owner_cq);
+    free_chan_bufs(ch, ch->owner_lane.head);
+    free_chan_bufs(ch, ch->workers_lane.head);
+    free_chan_bufs(ch, ch->owner_cache);
+    mutex_destroy(ch->owner_lane.mutex);
+    mutex_destroy(ch->workers_lane.mutex);
+    ctcomm_allocator alloc = ch->allocator;
+    mem_free(&alloc, ch);
+  }
+}
+
+int chan_send_zc(channel* ch, void** msg, uint32_t msg_size) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_send_zc(ch->owner_to_workers_cq, msg, msg_size);
+  }
+
+  return circq_send_zc(ch->workers_to_owner_cq, msg, msg_size);
+}
+
+int chan_try_send_zc(channel* ch, void** msg, uint32_t msg_size) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_try_send_zc(ch->owner_to_workers_cq, msg, msg_size);
+  }
+
+  return circq_try_send_zc(ch->workers_to_owner_cq, msg, msg_size);
+}
+
+int chan_timed_send_zc(channel* ch, void** msg, uint32_t msg_size,
+                       struct timespec* timeout) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_timed_send_zc(ch->owner_to_workers_cq, msg, msg_size, timeout);
+  }
+
+  return circq_timed_send_zc(ch->workers_to_owner_cq, msg, msg_size, timeout);
+}
+
+int chan_recv_zc(channel* ch, void** target_buf) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_recv_zc(ch->workers_to_owner_cq, target_buf);
+  }
+
+  return circq_recv_zc(ch->owner_to_workers_cq, target_buf);
+}
+
+int chan_try_recv_zc(channel* ch, void** target_buf) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_try_recv_zc(ch->workers_to_owner_cq, target_buf);
+  }
+
+  return circq_try_recv_zc(ch->owner_to_workers_cq, target_buf);
+}
+
+int chan_timed_recv_zc(channel* ch, void** target_buf,
+                       struct timespec* timeout) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_timed_recv_zc(ch->workers_to_owner_cq, target_buf, timeout);
+  }
+
+  return circq_timed_recv_zc(ch->owner_to_workers_cq, target_buf, timeout);
+}
+
+int chan_send_until_zc(channel* ch, void** msg, uint32_t msg_size,
+                       const struct timespec* deadline) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_send_until_zc(ch->owner_to_workers_cq, msg, msg_size,
+                               deadline);
+  }
+
+  return circq_send_until_zc(ch->workers_to_owner_cq, msg, msg_size,
+                             deadline);
+}
+
+int chan_recv_until_zc(channel* ch, void** target_buf,
+                       const struct timespec* deadline) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_recv_until_zc(ch->workers_to_owner_cq, target_buf, deadline);
+  }
+
+  return circq_recv_until_zc(ch->owner_to_workers_cq, target_buf, deadline);
+}
+
+int chan_disable_sending(channel* ch, channel_direction d) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (d == owner_to_workers) {
+    circq_disable_sending(ch->owner_to_workers_cq);
+  } else if (d == workers_to_owner) {
+    circq_disable_sending(ch->workers_to_owner_cq);
+  } else {
+    return ctcom_invalid_arguments;
+  }
+
+  return 0;
+}
+
+int chan_enable_sending(channel* ch, channel_direction d) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (d == owner_to_workers) {
+    circq_enable_sending(ch->owner_to_workers_cq);
+  } else if (d == workers_to_owner) {
+    circq_enable_sending(ch->workers_to_owner_cq);
+  } else {
+    return ctcom_invalid_arguments;
+  }
+
+  return 0;
+}
+
+int chan_msg_count(channel* ch, channel_direction d) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (d == owner_to_workers) {
+    return circq_msg_count(ch->owner_to_workers_cq);
+  } else if (d == workers_to_owner) {
+    return circq_msg_count(ch->workers_to_owner_cq);
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+int chan_recv_or_wait(channel* ch, void** target_buf, ctcomm_waiter* w) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_recv_or_wait(ch->workers_to_owner_cq, target_buf, w);
+  }
+
+  return circq_recv_or_wait(ch->owner_to_workers_cq, target_buf, w);
+}
+
+int chan_send_or_wait(channel* ch, void** msg, uint32_t msg_size,
+                      ctcomm_waiter* w) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_send_or_wait(ch->owner_to_workers_cq, msg, msg_size, w);
+  }
+
+  return circq_send_or_wait(ch->workers_to_owner_cq, msg, msg_size, w);
+}
+
+bool chan_cancel_wait(channel* ch, ctcomm_waiter* w) {
+  if (!ch) {
+    return false;
+  }
+
+  // The waiter can only be armed on one of the queues.
+  return circq_cancel_wait(ch->owner_to_workers_cq, w) ||
+         circq_cancel_wait(ch->workers_to_owner_cq, w);
+}
+
+int chan_send_slice(channel* ch, ctcomm_slice* slice) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_send_slice(ch->owner_to_workers_cq, slice);
+  }
+
+  return circq_send_slice(ch->workers_to_owner_cq, slice);
+}
+
+int chan_try_send_slice(channel* ch, ctcomm_slice* slice) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_try_send_slice(ch->owner_to_workers_cq, slice);
+  }
+
+  return circq_try_send_slice(ch->workers_to_owner_cq, slice);
+}
+
+int chan_timed_send_slice(channel* ch, ctcomm_slice* slice,
+                          struct timespec* timeout) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_timed_send_slice(ch->owner_to_workers_cq, slice, timeout);
+  }
+
+  return circq_timed_send_slice(ch->workers_to_owner_cq, slice, timeout);
+}
+
+int chan_recv_slice(channel* ch, ctcomm_slice* slice) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_recv_slice(ch->workers_to_owner_cq, slice);
+  }
+
+  return circq_recv_slice(ch->owner_to_workers_cq, slice);
+}
+
+int chan_try_recv_slice(channel* ch, ctcomm_slice* slice) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_try_recv_slice(ch->workers_to_owner_cq, slice);
+  }
+
+  return circq_try_recv_slice(ch->owner_to_workers_cq, slice);
+}
+
+int chan_timed_recv_slice(channel* ch, ctcomm_slice* slice,
+                          struct timespec* timeout) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (get_thread_id() == ch->owner_tid) {
+    return circq_timed_recv_slice(ch->workers_to_owner_cq, slice, timeout);
+  }
+
+  return circq_timed_recv_slice(ch->owner_to_workers_cq, slice, timeout);
+}
+
+// The queue a call from this thread goes through, and the one the
+// requests made to this thread come in from.
+circular_queue* chan_outbound_cq(channel* ch) {
+  return get_thread_id() == ch->owner_tid ? ch->owner_to_workers_cq
+                                          : ch->workers_to_owner_cq;
+}
+
+circular_queue* chan_inbound_cq(channel* ch) {
+  return get_thread_id() == ch->owner_tid ? ch->workers_to_owner_cq
+                                          : ch->owner_to_workers_cq;
+}
+
+// The reply slot of a call, the caller's future and the replier's
+// request handle at the same time.
+struct call_slot {
+  // Kept first, the callbacks get it back from the cell.
+  ctcomm_oneshot reply;
+  // Only touched by the caller.
+  bool reply_taken;
+  // Set by the replier along with the reply, for the case nobody takes
+  // it. NULL means free().
+  void (*release_cb)(void* reply, uint32_t reply_size, void* release_ctx);
+  void* release_ctx;
+  // Abandoned slots are freed by the replier.
+  ctcomm_allocator allocator;
+};
+
+void init_call_slot(call_slot* call, const ctcomm_allocator* alloc) {
+  oneshot_init(&call->reply);
+  call->reply_taken = false;
+  call->release_cb = NULL;
+  call->release_ctx = NULL;
+  call->allocator = *alloc;
+}
+
+// Blocks while the queue is full, until 'deadline' (on the queue's
+// clock) unless it's NULL.
+int _send_request_cq(circular_queue* cq, void** msg, uint32_t msg_size,
+                     call_slot* call, const struct timespec* deadline) {
+  if (verify_circq_send_zc_params(cq, msg, msg_size) != 0 ||
+      cq->overwrite_oldest) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  if (cq->writing_disabled) {
+    mutex_unlock(cq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  int retval = 0;
+  if (!deadline) {
+    while (cq->msg_count == cq->max_size) {
+      cond_var_wait(cq->write_cond, cq->mutex);
+    }
+  } else {
+    retval = wait_until_cq_not_full(cq, deadline);
+  }
+
+  if (!retval) {
+    retval = _send_ref_to_cq(cq, msg, msg_size, msg_request, call);
+  }
+
+  mutex_unlock(cq->mutex);
+
+  return retval;
+}
+
+int take_call_reply(call_slot* call, void** reply,
+                    const struct timespec* deadline) {
+  if (call->reply_taken) {
+    return ctcom_invalid_arguments;
+  }
+
+  int retval = _wait_for_oneshot(&call->reply, reply, deadline);
+  if (retval >= 0) {
+    call->reply_taken = true;
+  }
+
+  return retval;
+}
+
+void free_call_slot(call_slot* call) {
+  ctcomm_allocator alloc = call->allocator;
+  mem_free(&alloc, call);
+}
+
+// Run by the replier once the caller has given up, or by the caller
+// right away if the reply is already there.
+void drop_abandoned_call(ctcomm_oneshot* cell, void* reply, uint32_t size) {
+  call_slot* call = (call_slot*)cell;
+
+  if (!call->reply_taken && reply) {
+    if (call->release_cb) {
+      call->release_cb(reply, size, call->release_ctx);
+    } else {
+      free(reply);
+    }
+  }
+  free_call_slot(call);
+}
+
+int chan_call(channel* ch, void** msg, uint32_t msg_size, void** reply) {
+  if (!ch || !reply) {
+    return ctcom_invalid_arguments;
+  }
+
+  // Nobody gives up on this one, so it can live on the stack.
+  call_slot call;
+  init_call_slot(&call, &ch->allocator);
+
+  int retval = _send_request_cq(chan_outbound_cq(ch), msg, msg_size, &call,
+                                NULL);
+  if (retval < 0) {
+    return retval;
+  }
+
+  return take_call_reply(&call, reply, NULL);
+}
+
+int chan_timed_call(channel* ch, void** msg, uint32_t msg_size,
+                    void** reply, struct timespec* timeout) {
+  if (!ch || !reply || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  circular_queue* cq = chan_outbound_cq(ch);
+
+  // The same timeout on both clocks, sending waits on the queue's one.
+  struct timespec send_deadline;
+  struct timespec reply_deadline;
+  clock_gettime(cq->clock_id, &send_deadline);
+  add_duration_to_timespec(&send_deadline, timeout);
+  clock_gettime(CLOCK_MONOTONIC, &reply_deadline);
+  add_duration_to_timespec(&reply_deadline, timeout);
+
+  call_slot* call = (call_slot*)mem_alloc(&ch->allocator, sizeof(call_slot));
+  if (!call) {
+    return ctcom_not_enough_memory;
+  }
+  init_call_slot(call, &ch->allocator);
+
+  int retval = _send_request_cq(cq, msg, msg_size, call, &send_deadline);
+  if (retval < 0) {
+    free_call_slot(call);
+    return retval;
+  }
+
+  retval = take_call_reply(call, reply, &reply_deadline);
+  if (retval < 0) {
+    if (arm_oneshot(&call->reply, drop_abandoned_call)) {
+      return retval;
+    }
+    // The reply came in after the wait timed out, it's delivered all the
+    // same.
+    retval = take_call_reply(call, reply, NULL);
+  }
+
+  free_call_slot(call);
+
+  return retval;
+}
+
+int chan_call_async(channel* ch, void** msg, uint32_t msg_size,
+                    chan_future** f) {
+  if (!ch || !f) {
+    return ctcom_invalid_arguments;
+  }
+
+  call_slot* call = (call_slot*)mem_alloc(&ch->allocator, sizeof(call_slot));
+  if (!call) {
+    return ctcom_not_enough_memory;
+  }
+  init_call_slot(call, &ch->allocator);
+
+  int retval = _send_request_cq(chan_outbound_cq(ch), msg, msg_size, call,
+                                NULL);
+  if (retval < 0) {
+    free_call_slot(call);
+    return retval;
+  }
+
+  *f = call;
+
+  return retval;
+}
+
+int chan_future_wait(chan_future* f, void** reply) {
+  if (!f || !reply) {
+    return ctcom_invalid_arguments;
+  }
+
+  return take_call_reply(f, reply, NULL);
+}
+
+int chan_future_try_get(chan_future* f, void** reply) {
+  if (!f || !reply) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (f->reply_taken) {
+    return ctcom_invalid_arguments;
+  }
+
+  int retval = oneshot_try_get(&f->reply, reply);
+  if (retval >= 0) {
+    f->reply_taken = true;
+  }
+
+  return retval;
+}
+
+int chan_future_timed_wait(chan_future* f, void** reply,
+                           struct timespec* timeout) {
+  if (!f || !reply || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  add_duration_to_timespec(&deadline, timeout);
+
+  return take_call_reply(f, reply, &deadline);
+}
+
+void chan_future_release(chan_future* f) {
+  if (f) {
+    oneshot_on_set(&f->reply, drop_abandoned_call);
+  }
+}
+
+int _recv_request_cq(circular_queue* cq, void** msg, chan_request** req,
+                     bool blocking, struct timespec* timeout) {
+  if (!msg || !req || cq_owns_buffers(cq)) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cq->mutex);
+
+  int retval = wait_for_cq_msg(cq, blocking, timeout);
+  if (retval) {
+    mutex_unlock(cq->mutex);
+    return retval;
+  }
+
+  if (cq_next_msg(cq)->kind == msg_slice) {
+    mutex_unlock(cq->mutex);
+    return ctcom_wrong_msg_kind;
+  }
+
+  message m;
+  _pop_from_cq(cq, &m);
+
+  mutex_unlock(cq->mutex);
+
+  *msg = m.data;
+  *req = m.kind == msg_request ? (chan_request*)m.ref : NULL;
+
+  return m.size;
+}
+
+int chan_recv_request(channel* ch, void** msg, chan_request** req) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _recv_request_cq(chan_inbound_cq(ch), msg, req, true, NULL);
+}
+
+int chan_try_recv_request(channel* ch, void** msg, chan_request** req) {
+  if (!ch) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _recv_request_cq(chan_inbound_cq(ch), msg, req, false, NULL);
+}
+
+int chan_timed_recv_request(channel* ch, void** msg, chan_request** req,
+                            struct timespec* timeout) {
+  if (!ch || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  return _recv_request_cq(chan_inbound_cq(ch), msg, req, true, timeout);
+}
+
+int chan_reply(chan_request* req, void** reply, uint32_t reply_size) {
+  return chan_reply_with_release(req, reply, reply_size, NULL, NULL);
+}
+
+int chan_reply_with_release(chan_request* req, void** reply,
+                            uint32_t reply_size,
+                            void (*release_cb)(void*, uint32_t, void*),
+                            void* release_ctx) {
+  if (!req || !reply || (reply_size == 0 && *reply != NULL)) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (*reply == NULL) {
+    reply_size = 0;
+  }
+
+  void* value = *reply;
+  *reply = NULL;
+
+  // Published by setting the cell, whoever drops the reply sees them.
+  req->release_cb = release_cb;
+  req->release_ctx = release_ctx;
+
+  // 'req' may be gone once it's set.
+  oneshot_set(&req->reply, value, reply_size);
+
+  return reply_size;
+}
+
+void* chan_alloc_buf(channel* ch, uint32_t size) {
+  if (!ch) {
+    return NULL;
+  }
+
+  chan_buf* buf = NULL;
+  bool owner = get_thread_id() == ch->owner_tid;
+
+  if (owner) {
+    if (!ch->owner_cache) {
+      // Everything returned so far, in one go.
+      mutex_lock(ch->owner_lane.mutex);
+      ch->owner_cache = ch->owner_lane.head;
+      ch->owner_lane.head = NULL;
+      mutex_unlock(ch->owner_lane.mutex);
+    }
+    buf = ch->owner_cache;
+    if (buf) {
+      ch->owner_cache = buf->next;
+    }
+  } else {
+    mutex_lock(ch->workers_lane.mutex);
+    buf = ch->workers_lane.head;
+    if (buf) {
+      ch->workers_lane.head = buf->next;
+    }
+    mutex_unlock(ch->workers_lane.mutex);
+  }
+
+  if (buf && ((uint64_t)1 << buf->capacity_shift) < size) {
+    mem_free(&ch->allocator, buf);
+    buf = NULL;
+  }
+
+  if (!buf) {
+    // Rounded up, so that a buffer can be reused for a bit bigger
+    // messages later on.
+    uint32_t shift = 6;
+    while (((uint64_t)1 << shift) < size) {
+      ++shift;
+    }
+    buf = (chan_buf*)mem_alloc(&ch->allocator,
+                               sizeof(chan_buf) + ((size_t)1 << shift));
+    if (!buf) {
+      return NULL;
+    }
+    buf->capacity_shift = shift;
+    buf->from_owner = owner;
+  }
+
+  return buf + 1;
+}
+
+ctcomm_retval_t chan_return_bufs(channel* ch, void** bufs, uint32_t count) {
+  if (!ch || (!bufs && count > 0)) {
+    return ctcom_invalid_arguments;
+  }
+
+  // Chained up per allocating side before taking the locks, index 1 is
+  // the owner's.
+  chan_buf* heads[2] = {NULL, NULL};
+  chan_buf* tails[2] = {NULL, NULL};
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!bufs[i]) {
+      continue;
+    }
+    chan_buf* buf = (chan_buf*)bufs[i] - 1;
+    uint32_t side = buf->from_owner ? 1 : 0;
+    buf->next = heads[side];
+    heads[side] = buf;
+    if (!tails[side]) {
+      tails[side] = buf;
+    }
+    bufs[i] = NULL;
+  }
+
+  return_lane* lanes[2] = {&ch->workers_lane, &ch->owner_lane};
+  for (int side = 0; side < 2; ++side) {
+    if (heads[side]) {
+      mutex_lock(lanes[side]->mutex);
+      tails[side]->next = lanes[side]->head;
+      lanes[side]->head = heads[side];
+      mutex_unlock(lanes[side]->mutex);
+    }
+  }
+
+  return ctcom_success_threshold;
+}
+
+void chan_free_buf(channel* ch, void* buf) {
+  if (ch && buf) {
+    mem_free(&ch->allocator, (chan_buf*)buf - 1);
+  }
+}
+
+// Conflating queue related section starts here.
+typedef struct conflq_node {
+  struct conflq_node* next;
+  uint64_t key;
+  message msg;
+} conflq_node;
+
+struct conflating_queue {
+  mutex_t mutex;
+  cond_var_t read_cond;
+
+  uint32_t msg_count;
+  uint64_t conflated_count;
+
+  // Keys in first arrival order, the index maps a key to its node.
+  conflq_node* head;
+  conflq_node* tail;
+  u64_map index;
+
+  bool writing_disabled;
+
+  void (*release_cb)(void* msg, uint32_t msg_size, void* release_ctx);
+  void* release_ctx;
+
+  ctcomm_allocator allocator;
+};
+
+void release_with_free(void* msg, uint32_t msg_size, void* release_ctx) {
+  (void)msg_size;
+  (void)release_ctx;
+  free(msg);
+}
+
+conflating_queue* conflating_queue_create(const conflq_opts* opts,
+                                          char** err_str) {
+  static const conflq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  conflating_queue* cfq =
+      (conflating_queue*)mem_alloc(alloc, sizeof(conflating_queue));
+  if (!cfq) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for conflating queue");
+    }
+    return NULL;
+  }
+
+  cfq->allocator = *alloc;
+
+  if (!u64_map_init(&cfq->index, &cfq->allocator)) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for the key index");
+    }
+    mem_free(alloc, cfq);
+    return NULL;
+  }
+
+  mutex_init(cfq->mutex);
+  cond_var_init(cfq->read_cond);
+  cfq->msg_count = 0;
+  cfq->conflated_count = 0;
+  cfq->head = NULL;
+  cfq->tail = NULL;
+  cfq->writing_disabled = false;
+  cfq->release_cb = opts->release_cb ? opts->release_cb : release_with_free;
+  cfq->release_ctx = opts->release_ctx;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return cfq;
+}
+
+void __conflating_queue_destroy(conflating_queue* cfq) {
+  if (cfq) {
+    mutex_destroy(cfq->mutex);
+    cond_var_destroy(cfq->read_cond);
+
+    conflq_node* node_to_be_freed = NULL;
+    while (cfq->head) {
+      node_to_be_freed = cfq->head;
+      cfq->head = cfq->head->next;
+      mem_free(&cfq->allocator, node_to_be_freed);
+    }
+
+    u64_map_destroy(&cfq->index);
+
+    ctcomm_allocator alloc = cfq->allocator;
+    mem_free(&alloc, cfq);
+  }
+}
+
+ctcomm_retval_t conflq_send_zc(conflating_queue* cfq, uint64_t key,
+                               void** msg, uint32_t msg_size) {
+  if (!cfq || !msg || (msg_size == 0 && *msg != NULL)) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  mutex_lock(cfq->mutex);
+
+  if (cfq->writing_disabled) {
+    mutex_unlock(cfq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  conflq_node* node = (conflq_node*)u64_map_get(&cfq->index, key);
+  if (node) {
+    // Replace the pending value in place, keeping its position.
+    message replaced = node->msg;
+    node->msg.data = *msg;
+    node->msg.size = msg_size;
+    *msg = NULL;
+    ++cfq->conflated_count;
+
+    mutex_unlock(cfq->mutex);
+
+    cfq->release_cb(replaced.data, replaced.size, cfq->release_ctx);
+
+    return msg_size;
+  }
+
+  node = (conflq_node*)mem_alloc(&cfq->allocator, sizeof(conflq_node));
+  if (!node || !u64_map_put(&cfq->index, key, node)) {
+    if (node) {
+      mem_free(&cfq->allocator, node);
+    }
+    mutex_unlock(cfq->mutex);
+    return ctcom_not_enough_memory;
+  }
+
+  node->next = NULL;
+  node->key = key;
+  node->msg.data = *msg;
+  node->msg.size = msg_size;
+  *msg = NULL;
+
+  if (cfq->tail) {
+    cfq->tail->next = node;
+  } else {
+    cfq->head = node;
+  }
+  cfq->tail = node;
+
+  ++cfq->msg_count;
+  cond_var_signal(cfq->read_cond);
+
+  mutex_unlock(cfq->mutex);
+
+  return msg_size;
+}
+
+// This function should always be called while holding the mutex.
+ctcomm_retval_t _recvfrom_cfq(conflating_queue* cfq, uint64_t* key,
+                              void** target_buf) {
+  conflq_node* node = cfq->head;
+
+  cfq->head = node->next;
+  if (!cfq->head) {
+    cfq->tail = NULL;
+  }
+
+  u64_map_remove(&cfq->index, node->key);
+  --cfq->msg_count;
+
+  if (key) {
+    *key = node->key;
+  }
+  *target_buf = node->msg.data;
+  ctcomm_retval_t msg_size = node->msg.size;
+
+  mem_free(&cfq->allocator, node);
+
+  return msg_size;
+}
+
+ctcomm_retval_t conflq_recv_zc(conflating_queue* cfq, uint64_t* key,
+                               void** target_buf) {
+  if (!cfq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cfq->mutex);
+
+  while (cfq->msg_count == 0) {
+    cond_var_wait(cfq->read_cond, cfq->mutex);
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_cfq(cfq, key, target_buf);
+
+  mutex_unlock(cfq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t conflq_try_recv_zc(conflating_queue* cfq, uint64_t* key,
+                                   void** target_buf) {
+  if (!cfq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(cfq->mutex);
+
+  if (cfq->msg_count > 0) {
+    result = _recvfrom_cfq(cfq, key, target_buf);
+  }
+
+  mutex_unlock(cfq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t conflq_timed_recv_zc(conflating_queue* cfq, uint64_t* key,
+                                     void** target_buf,
+                                     struct timespec* timeout) {
+  if (!cfq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(cfq->mutex);
+
+  if (cfq->msg_count == 0) {
+    int retval;
+    struct timespec abs_time;
+    clock_gettime(CLOCK_REALTIME, &abs_time);
+    add_duration_to_timespec(&abs_time, timeout);
+
+    while (cfq->msg_count == 0) {
+      if ((retval = cond_var_timedwait(cfq->read_cond, cfq->mutex, abs_time))) {
+        if (retval != ETIMEDOUT) {
+          mutex_unlock(cfq->mutex);
+          return ctcom_unexpected_failure;
+        }
+        mutex_unlock(cfq->mutex);
+        return ctcom_timedout;
+      }
+    }
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_cfq(cfq, key, target_buf);
+
+  mutex_unlock(cfq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t conflq_disable_sending(conflating_queue* cfq) {
+  if (cfq) {
+    mutex_lock(cfq->mutex);
+    cfq->writing_disabled = true;
+    mutex_unlock(cfq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+ctcomm_retval_t conflq_enable_sending(conflating_queue* cfq) {
+  if (cfq) {
+    mutex_lock(cfq->mutex);
+    cfq->writing_disabled = false;
+    mutex_unlock(cfq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+int conflq_msg_count(conflating_queue* cfq) {
+  int result = -1;
+
+  if (cfq) {
+    mutex_lock(cfq->mutex);
+    result = cfq->msg_count;
+    mutex_unlock(cfq->mutex);
+  }
+
+  return result;
+}
+
+uint64_t conflq_conflated_count(conflating_queue* cfq) {
+  uint64_t result = 0;
+
+  if (cfq) {
+    mutex_lock(cfq->mutex);
+    result = cfq->conflated_count;
+    mutex_unlock(cfq->mutex);
+  }
+
+  return result;
+}
+
+// Priority queue related section starts here.
+typedef struct prio_level {
+  message* slots;
+  uint32_t capacity;
+  uint32_t head;
+  uint32_t count;
+} prio_level;
+
+#define prio_level_initial_capacity 16
+
+struct priority_queue {
+  mutex_t mutex;
+  cond_var_t read_cond;
+
+  uint32_t msg_count;
+  uint32_t level_count;
+  // Bit i is set when level i has messages.
+  uint64_t non_empty_levels;
+
+  uint32_t aging_interval;
+  uint32_t recvs_since_aging;
+  // The level the last aged receive was served from, the next one goes
+  // to the next waiting level after it.
+  uint32_t aging_cursor;
+
+  bool writing_disabled;
+
+  prio_level* levels;
+
+  ctcomm_allocator allocator;
+};
+
+priority_queue* priority_queue_create(uint32_t levels, const prioq_opts* opts,
+                                      char** err_str) {
+  static const prioq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  if (levels == 0 || levels > prioq_max_levels) {
+    if (err_str) {
+      *err_str = CERR_STR("levels should be within [1, prioq_max_levels]");
+    }
+    return NULL;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  priority_queue* pq =
+      (priority_queue*)mem_alloc(alloc, sizeof(priority_queue));
+  if (!pq) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for priority queue");
+    }
+    return NULL;
+  }
+
+  pq->levels = (prio_level*)mem_alloc(alloc, levels * sizeof(prio_level));
+  if (!pq->levels) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for priority levels");
+    }
+    mem_free(alloc, pq);
+    return NULL;
+  }
+  // The slot arrays are allocated on first use.
+  memset(pq->levels, 0, levels * sizeof(prio_level));
+
+  mutex_init(pq->mutex);
+  cond_var_init(pq->read_cond);
+  pq->msg_count = 0;
+  pq->level_count = levels;
+  pq->non_empty_levels = 0;
+  pq->aging_interval = opts->aging_interval;
+  pq->recvs_since_aging = 0;
+  pq->aging_cursor = 0;
+  pq->writing_disabled = false;
+  pq->allocator = *alloc;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return pq;
+}
+
+void __priority_queue_destroy(priority_queue* pq) {
+  if (pq) {
+    mutex_destroy(pq->mutex);
+    cond_var_destroy(pq->read_cond);
+
+    for (uint32_t i = 0; i < pq->level_count; ++i) {
+      if (pq->levels[i].slots) {
+        mem_free(&pq->allocator, pq->levels[i].slots);
+      }
+    }
+    mem_free(&pq->allocator, pq->levels);
+
+    ctcomm_allocator alloc = pq->allocator;
+    mem_free(&alloc, pq);
+  }
+}
+
+// Doubles the slot array of a full level, unwrapping its contents.
+bool grow_prio_level(priority_queue* pq, prio_level* level) {
+  uint32_t new_capacity =
+      level->capacity ? level->capacity * 2 : prio_level_initial_capacity;
+  if (new_capacity < level->capacity) {
+    return false;
+  }
+
+  message* slots = (message*)mem_alloc(&pq->allocator,
+                                       (size_t)new_capacity * sizeof(message));
+  if (!slots) {
+    return false;
+  }
+
+  if (level->slots) {
+    uint32_t first_part = level->capacity - level->head;
+    memcpy(slots, level->slots + level->head, first_part * sizeof(message));
+    memcpy(slots + first_part, level->slots, level->head * sizeof(message));
+    mem_free(&pq->allocator, level->slots);
+  }
+
+  level->slots = slots;
+  level->capacity = new_capacity;
+  level->head = 0;
+
+  return true;
+}
+
+ctcomm_retval_t prioq_send_zc(priority_queue* pq, uint32_t prio, void** msg,
+                              uint32_t msg_size) {
+  if (!pq || !msg || (msg_size == 0 && *msg != NULL) ||
+      prio >= pq->level_count) {
+    return ctcom_invalid_arguments;
+  }
+
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  mutex_lock(pq->mutex);
+
+  if (pq->writing_disabled) {
+    mutex_unlock(pq->mutex);
+    return ctcom_writing_disabled;
+  }
+
+  prio_level* level = &pq->levels[prio];
+  if (level->count == level->capacity && !grow_prio_level(pq, level)) {
+    mutex_unlock(pq->mutex);
+    return ctcom_not_enough_memory;
+  }
+
+  uint32_t index = level->head + level->count;
+  if (index >= level->capacity) {
+    index -= level->capacity;
+  }
+  level->slots[index].data = *msg;
+  level->slots[index].size = msg_size;
+  *msg = NULL;
+
+  ++level->count;
+  ++pq->msg_count;
+  pq->non_empty_levels |= 1ULL << prio;
+
+  cond_var_signal(pq->read_cond);
+
+  mutex_unlock(pq->mutex);
+
+  return msg_size;
+}
+
+// This function should always be called while holding the mutex.
+ctcomm_retval_t _recvfrom_pq(priority_queue* pq, void** target_buf,
+                             uint32_t* prio) {
+  uint32_t lvl = (uint32_t)__builtin_ctzll(pq->non_empty_levels);
+
+  if (pq->aging_interval && ++pq->recvs_since_aging >= pq->aging_interval) {
+    // The aged receives take turns among the levels which are waiting
+    // behind the most urgent one, so that none of them can starve.
+    uint64_t waiting = pq->non_empty_levels & ~(1ULL << lvl);
+    if (waiting) {
+      uint64_t after = pq->aging_cursor >= 63
+                           ? 0
+                           : waiting & (~0ULL << (pq->aging_cursor + 1));
+      lvl = (uint32_t)__builtin_ctzll(after ? after : waiting);
+      pq->aging_cursor = lvl;
+    }
+    pq->recvs_since_aging = 0;
+  }
+
+  prio_level* level = &pq->levels[lvl];
+
+  *target_buf = level->slots[level->head].data;
+  ctcomm_retval_t msg_size = level->slots[level->head].size;
+
+  if (++level->head == level->capacity) {
+    level->head = 0;
+  }
+  if (--level->count == 0) {
+    pq->non_empty_levels &= ~(1ULL << lvl);
+  }
+  --pq->msg_count;
+
+  if (prio) {
+    *prio = lvl;
+  }
+
+  return msg_size;
+}
+
+ctcomm_retval_t prioq_recv_zc(priority_queue* pq, void** target_buf,
+                              uint32_t* prio) {
+  if (!pq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(pq->mutex);
+
+  while (pq->msg_count == 0) {
+    cond_var_wait(pq->read_cond, pq->mutex);
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_pq(pq, target_buf, prio);
+
+  mutex_unlock(pq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t prioq_try_recv_zc(priority_queue* pq, void** target_buf,
+                                  uint32_t* prio) {
+  if (!pq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(pq->mutex);
+
+  if (pq->msg_count > 0) {
+    result = _recvfrom_pq(pq, target_buf, prio);
+  }
+
+  mutex_unlock(pq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t prioq_timed_recv_zc(priority_queue* pq, void** target_buf,
+                                    uint32_t* prio, struct timespec* timeout) {
+  if (!pq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(pq->mutex);
+
+  if (pq->msg_count == 0) {
+    int retval;
+    struct timespec abs_time;
+    clock_gettime(CLOCK_REALTIME, &abs_time);
+    add_duration_to_timespec(&abs_time, timeout);
+
+    while (pq->msg_count == 0) {
+      if ((retval = cond_var_timedwait(pq->read_cond, pq->mutex, abs_time))) {
+        if (retval != ETIMEDOUT) {
+          mutex_unlock(pq->mutex);
+          return ctcom_unexpected_failure;
+        }
+        mutex_unlock(pq->mutex);
+        return ctcom_timedout;
+      }
+    }
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_pq(pq, target_buf, prio);
+
+  mutex_unlock(pq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t prioq_disable_sending(priority_queue* pq) {
+  if (pq) {
+    mutex_lock(pq->mutex);
+    pq->writing_disabled = true;
+    mutex_unlock(pq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+ctcomm_retval_t prioq_enable_sending(priority_queue* pq) {
+  if (pq) {
+    mutex_lock(pq->mutex);
+    pq->writing_disabled = false;
+    mutex_unlock(pq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+int prioq_msg_count(priority_queue* pq) {
+  int result = -1;
+
+  if (pq) {
+    mutex_lock(pq->mutex);
+    result = pq->msg_count;
+    mutex_unlock(pq->mutex);
+  }
+
+  return result;
+}
+
+// Delay queue related section starts here.
+// The wheel has 'wheel_levels' levels of 64 slots each. A message is
+// kept on the lowest level where its expiry tick and the current tick
+// have the same digits (6 bits each) above that level, so its slot is
+// always ahead of the current one. Slots of the upper levels are
+// cascaded down when the current tick reaches them. The top level gets
+// the rest, whose digits above it may differ from the current tick's
+// when a 2^48 tick boundary is crossed; it wraps around, a slot behind
+// the current one is on its next lap. Delays are below half a lap, so
+// the two can't be confused.
+#define wheel_levels 8
+#define wheel_slot_bits 6
+#define wheel_slots (1 << wheel_slot_bits)
+#define wheel_slot_mask (wheel_slots - 1)
+#define wheel_max_delay_ticks \
+  ((UINT64_C(1) << (wheel_levels * wheel_slot_bits - 1)) - 1)
+
+typedef enum delay_node_state {
+  delay_node_free = 0,
+  delay_node_pending,
+  delay_node_due
+} delay_node_state;
+
+typedef struct delay_node {
+  struct delay_node* prev;
+  struct delay_node* next;
+  uint64_t expiry_tick;
+  // Bumped whenever the node is recycled, so that stale handles can be
+  // told apart.
+  uint64_t seq;
+  message msg;
+  delay_node_state state;
+  uint8_t level;
+  uint8_t slot;
+} delay_node;
+
+typedef struct delay_list {
+  delay_node* head;
+  delay_node* tail;
+} delay_list;
+
+struct delay_queue {
+  mutex_t mutex;
+  cond_var_t read_cond;
+
+  struct timespec start_time;
+  uint64_t tick_ns;
+  // The last tick processed.
+  uint64_t current_tick;
+
+  delay_list wheel[wheel_levels][wheel_slots];
+  uint64_t occupied[wheel_levels];
+
+  delay_list due;
+  // Recycled nodes, they are only freed when the queue is destroyed.
+  delay_node* free_nodes;
+
+  uint32_t msg_count;
+  bool writing_disabled;
+
+  ctcomm_allocator allocator;
+};
+
+void delay_list_append(delay_list* list, delay_node* node) {
+  node->next = NULL;
+  node->prev = list->tail;
+  if (list->tail) {
+    list->tail->next = node;
+  } else {
+    list->head = node;
+  }
+  list->tail = node;
+}
+
+void delay_list_unlink(delay_list* list, delay_node* node) {
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    list->head = node->next;
+  }
+  if (node->next) {
+    node->next->prev = node->prev;
+  } else {
+    list->tail = node->prev;
+  }
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+// The first tick at or after the given absolute time, deadlines are
+// rounded up so that nothing becomes due early.
+uint64_t delay_queue_tick_of(const delay_queue* dlq,
+                             const struct timespec* t) {
+  uint64_t start = timespec_to_ns(&dlq->start_time);
+  uint64_t when = timespec_to_ns(t);
+  if (when <= start) {
+    return 0;
+  }
+  return (when - start + dlq->tick_ns - 1) / dlq->tick_ns;
+}
+
+// The last tick which has fully arrived.
+uint64_t delay_queue_now_tick(const delay_queue* dlq) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t start = timespec_to_ns(&dlq->start_time);
+  return (timespec_to_ns(&now) - start) / dlq->tick_ns;
+}
+
+struct timespec delay_queue_time_of(const delay_queue* dlq, uint64_t tick) {
+  uint64_t when = timespec_to_ns(&dlq->start_time) + tick * dlq->tick_ns;
+  struct timespec t;
+  t.tv_sec = (time_t)(when / 1000000000ULL);
+  t.tv_nsec = (long)(when % 1000000000ULL);
+  return t;
+}
+
+// This function should always be called while holding the mutex.
+void delay_queue_schedule(delay_queue* dlq, delay_node* node) {
+  if (node->expiry_tick <= dlq->current_tick) {
+    node->state = delay_node_due;
+    delay_list_append(&dlq->due, node);
+    return;
+  }
+
+  uint32_t level = 0;
+  while (level < wheel_levels - 1 &&
+         (node->expiry_tick >> ((level + 1) * wheel_slot_bits)) !=
+             (dlq->current_tick >> ((level + 1) * wheel_slot_bits))) {
+    ++level;
+  }
+
+  uint32_t slot = (node->expiry_tick >> (level * wheel_slot_bits)) &
+                  wheel_slot_mask;
+
+  node->state = delay_node_pending;
+  node->level = (uint8_t)level;
+  node->slot = (uint8_t)slot;
+  delay_list_append(&dlq->wheel[level][slot], node);
+  dlq->occupied[level] |= 1ULL << slot;
+}
+
+// Returns the next tick at which a slot needs processing, false if the
+// wheel is empty.
+bool delay_queue_next_event(const delay_queue* dlq, uint64_t* tick) {
+  bool found = false;
+
+  for (uint32_t level = 0; level < wheel_levels; ++level) {
+    uint32_t shift = level * wheel_slot_bits;
+    uint32_t digit = (dlq->current_tick >> shift) & wheel_slot_mask;
+    // Only the slots ahead of the current one can be occupied.
+    uint64_t ahead = digit == wheel_slot_mask
+                         ? 0
+                         : dlq->occupied[level] & (~0ULL << (digit + 1));
+    uint64_t upper_shift = shift + wheel_slot_bits;
+    uint64_t upper = upper_shift >= 64
+                         ? 0
+                         : (dlq->current_tick >> upper_shift) << upper_shift;
+    if (!ahead && level == wheel_levels - 1 && dlq->occupied[level]) {
+      // Those are on the next lap of the top level.
+      ahead = dlq->occupied[level];
+      upper += 1ULL << upper_shift;
+    }
+    if (!ahead) {
+      continue;
+    }
+
+    uint64_t slot = (uint64_t)__builtin_ctzll(ahead);
+    uint64_t candidate = upper | (slot << shift);
+
+    if (!found || candidate < *tick) {
+      *tick = candidate;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+// Processes the slots of the given tick, which should be the next event.
+void delay_queue_process_tick(delay_queue* dlq, uint64_t tick) {
+  dlq->current_tick = tick;
+
+  for (uint32_t level = wheel_levels - 1; level > 0; --level) {
+    uint32_t shift = level * wheel_slot_bits;
+    if (tick & ((1ULL << shift) - 1)) {
+      continue;
+    }
+
+    uint32_t slot = (tick >> shift) & wheel_slot_mask;
+    if (!(dlq->occupied[level] & (1ULL << slot))) {
+      continue;
+    }
+
+    delay_list cascading = dlq->wheel[level][slot];
+    dlq->wheel[level][slot] = (delay_list){NULL, NULL};
+    dlq->occupied[level] &= ~(1ULL << slot);
+
+    while (cascading.head) {
+      delay_node* node = cascading.head;
+      delay_list_unlink(&cascading, node);
+      delay_queue_schedule(dlq, node);
+    }
+  }
+
+  uint32_t slot = tick & wheel_slot_mask;
+  if (dlq->occupied[0] & (1ULL << slot)) {
+    delay_list* expiring = &dlq->wheel[0][slot];
+    while (expiring->head) {
+      delay_node* node = expiring->head;
+      delay_list_unlink(expiring, node);
+      node->state = delay_node_due;
+      delay_list_append(&dlq->due, node);
+    }
+    dlq->occupied[0] &= ~(1ULL << slot);
+  }
+}
+
+// Brings the wheel up to date, jumping over the idle ticks.
+// This function should always be called while holding the mutex.
+void delay_queue_advance(delay_queue* dlq) {
+  uint64_t now_tick = delay_queue_now_tick(dlq);
+
+  uint64_t next = 0;
+  while (delay_queue_next_event(dlq, &next) && next <= now_tick) {
+    delay_queue_process_tick(dlq, next);
+  }
+
+  if (now_tick > dlq->current_tick) {
+    dlq->current_tick = now_tick;
+  }
+}
+
+delay_queue* delay_queue_create(const delayq_opts* opts, char** err_str) {
+  static const delayq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  delay_queue* dlq = (delay_queue*)mem_alloc(alloc, sizeof(delay_queue));
+  if (!dlq) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for delay queue");
+    }
+    return NULL;
+  }
+
+  memset(dlq, 0, sizeof(delay_queue));
+
+  mutex_init(dlq->mutex);
+  cond_var_init_with_clock(&dlq->read_cond, CLOCK_MONOTONIC);
+  clock_gettime(CLOCK_MONOTONIC, &dlq->start_time);
+  dlq->tick_ns = opts->tick_ns ? opts->tick_ns : 1000000;
+  dlq->allocator = *alloc;
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return dlq;
+}
+
+void free_delay_list(delay_queue* dlq, delay_node* node) {
+  while (node) {
+    delay_node* node_to_be_freed = node;
+    node = node->next;
+    mem_free(&dlq->allocator, node_to_be_freed);
+  }
+}
+
+void __delay_queue_destroy(delay_queue* dlq) {
+  if (dlq) {
+    mutex_destroy(dlq->mutex);
+    cond_var_destroy(dlq->read_cond);
+
+    for (uint32_t level = 0; level < wheel_levels; ++level) {
+      for (uint32_t slot = 0; slot < wheel_slots; ++slot) {
+        free_delay_list(dlq, dlq->wheel[level][slot].head);
+      }
+    }
+    free_delay_list(dlq, dlq->due.head);
+    free_delay_list(dlq, dlq->free_nodes);
+
+    ctcomm_allocator alloc = dlq->allocator;
+    mem_free(&alloc, dlq);
+  }
+}
+
+ctcomm_retval_t _sendto_dlq(delay_queue* dlq, void** msg, uint32_t msg_size,
+                            uint64_t expiry_tick, delayq_handle* handle) {
+  if (*msg == NULL) {
+    msg_size = 0;
+  }
+
+  if (dlq->writing_disabled) {
+    return ctcom_writing_disabled;
+  }
+
+  delay_node* node = dlq->free_nodes;
+  if (node) {
+    dlq->free_nodes = node->next;
+  } else {
+    node = (delay_node*)mem_alloc(&dlq->allocator, sizeof(delay_node));
+    if (!node) {
+      return ctcom_not_enough_memory;
+    }
+    node->seq = 0;
+  }
+
+  node->prev = NULL;
+  node->next = NULL;
+  node->expiry_tick = expiry_tick;
+  node->msg.data = *msg;
+  node->msg.size = msg_size;
+  *msg = NULL;
+
+  delay_queue_advance(dlq);
+  delay_queue_schedule(dlq, node);
+  ++dlq->msg_count;
+
+  if (handle) {
+    handle->node = node;
+    handle->seq = node->seq;
+  }
+
+  // It might be due earlier than what the sleeping receiver waits for.
+  cond_var_signal(dlq->read_cond);
+
+  return msg_size;
+}
+
+ctcomm_retval_t delayq_send_at(delay_queue* dlq, void** msg,
+                               uint32_t msg_size,
+                               const struct timespec* deadline,
+                               delayq_handle* handle) {
+  if (!dlq || !msg || !deadline || (msg_size == 0 && *msg != NULL)) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dlq->mutex);
+  uint64_t expiry_tick = delay_queue_tick_of(dlq, deadline);
+  if (expiry_tick > dlq->current_tick + wheel_max_delay_ticks) {
+    expiry_tick = dlq->current_tick + wheel_max_delay_ticks;
+  }
+  ctcomm_retval_t retval =
+      _sendto_dlq(dlq, msg, msg_size, expiry_tick, handle);
+  mutex_unlock(dlq->mutex);
+
+  return retval;
+}
+
+ctcomm_retval_t delayq_send_after(delay_queue* dlq, void** msg,
+                                  uint32_t msg_size,
+                                  const struct timespec* delay,
+                                  delayq_handle* handle) {
+  if (!dlq || !delay) {
+    return ctcom_invalid_arguments;
+  }
+
+  struct timespec deadline;
+  struct timespec duration = *delay;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  add_duration_to_timespec(&deadline, &duration);
+
+  return delayq_send_at(dlq, msg, msg_size, &deadline, handle);
+}
+
+void recycle_delay_node(delay_queue* dlq, delay_node* node) {
+  ++node->seq;
+  node->state = delay_node_free;
+  node->next = dlq->free_nodes;
+  dlq->free_nodes = node;
+  --dlq->msg_count;
+}
+
+ctcomm_retval_t delayq_cancel(delay_queue* dlq, delayq_handle* handle,
+                              void** target_buf) {
+  if (!dlq || !handle || !target_buf || !handle->node) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dlq->mutex);
+
+  delay_node* node = (delay_node*)handle->node;
+  if (node->seq == handle->seq && node->state != delay_node_free) {
+    if (node->state == delay_node_pending) {
+      delay_list* list = &dlq->wheel[node->level][node->slot];
+      delay_list_unlink(list, node);
+      if (!list->head) {
+        dlq->occupied[node->level] &= ~(1ULL << node->slot);
+      }
+    } else {
+      delay_list_unlink(&dlq->due, node);
+    }
+
+    *target_buf = node->msg.data;
+    result = node->msg.size;
+    recycle_delay_node(dlq, node);
+  }
+
+  mutex_unlock(dlq->mutex);
+
+  return result;
+}
+
+// This function should always be called while holding the mutex, and
+// only when there is a due message.
+ctcomm_retval_t _recvfrom_dlq(delay_queue* dlq, void** target_buf) {
+  delay_node* node = dlq->due.head;
+  delay_list_unlink(&dlq->due, node);
+
+  *target_buf = node->msg.data;
+  ctcomm_retval_t msg_size = node->msg.size;
+  recycle_delay_node(dlq, node);
+
+  if (dlq->due.head) {
+    // Pass the baton, more messages became due at once.
+    cond_var_signal(dlq->read_cond);
+  }
+
+  return msg_size;
+}
+
+// Sleeps until a message is due, or 'abs_timeout' (if any) passes.
+// This function should always be called while holding the mutex.
+int wait_for_due_msg(delay_queue* dlq, const struct timespec* abs_timeout) {
+  delay_queue_advance(dlq);
+
+  while (!dlq->due.head) {
+    uint64_t next_tick = 0;
+    bool has_next = delay_queue_next_event(dlq, &next_tick);
+    int retval;
+
+    if (!has_next && !abs_timeout) {
+      retval = cond_var_wait(dlq->read_cond, dlq->mutex);
+    } else {
+      struct timespec wake_up;
+      bool timeout_first = true;
+      if (has_next) {
+        wake_up = delay_queue_time_of(dlq, next_tick);
+        timeout_first = abs_timeout && timespec_to_ns(abs_timeout) <
+                                           timespec_to_ns(&wake_up);
+      }
+      if (timeout_first) {
+        wake_up = *abs_timeout;
+      }
+
+      retval = cond_var_timedwait(dlq->read_cond, dlq->mutex, wake_up);
+      if (retval == ETIMEDOUT) {
+        retval = 0;
+        if (timeout_first) {
+          delay_queue_advance(dlq);
+          return dlq->due.head ? 0 : ctcom_timedout;
+        }
+      }
+    }
+
+    if (retval) {
+      return ctcom_unexpected_failure;
+    }
+
+    delay_queue_advance(dlq);
+  }
+
+  return 0;
+}
+
+ctcomm_retval_t delayq_recv_zc(delay_queue* dlq, void** target_buf) {
+  if (!dlq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(dlq->mutex);
+
+  ctcomm_retval_t result = wait_for_due_msg(dlq, NULL);
+  if (result == 0) {
+    result = _recvfrom_dlq(dlq, target_buf);
+  }
+
+  mutex_unlock(dlq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t delayq_try_recv_zc(delay_queue* dlq, void** target_buf) {
+  if (!dlq || !target_buf) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(dlq->mutex);
+
+  delay_queue_advance(dlq);
+  if (dlq->due.head) {
+    result = _recvfrom_dlq(dlq, target_buf);
+  }
+
+  mutex_unlock(dlq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t delayq_timed_recv_zc(delay_queue* dlq, void** target_buf,
+                                     struct timespec* timeout) {
+  if (!dlq || !target_buf || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  struct timespec abs_time;
+  clock_gettime(CLOCK_MONOTONIC, &abs_time);
+  add_duration_to_timespec(&abs_time, timeout);
+
+  mutex_lock(dlq->mutex);
+
+  ctcomm_retval_t result = wait_for_due_msg(dlq, &abs_time);
+  if (result == 0) {
+    result = _recvfrom_dlq(dlq, target_buf);
+  }
+
+  mutex_unlock(dlq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t delayq_disable_sending(delay_queue* dlq) {
+  if (dlq) {
+    mutex_lock(dlq->mutex);
+    dlq->writing_disabled = true;
+    mutex_unlock(dlq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+ctcomm_retval_t delayq_enable_sending(delay_queue* dlq) {
+  if (dlq) {
+    mutex_lock(dlq->mutex);
+    dlq->writing_disabled = false;
+    mutex_unlock(dlq->mutex);
+    return ctcom_success_threshold;
+  }
+
+  return ctcom_invalid_arguments;
+}
+
+int delayq_msg_count(delay_queue* dlq) {
+  int result = -1;
+
+  if (dlq) {
+    mutex_lock(dlq->mutex);
+    result = dlq->msg_count;
+    mutex_unlock(dlq->mutex);
+  }
+
+  return result;
+}
+
+// Journal queue related section starts here.
+// A record is a uint32_t header and a uint32_t checksum followed by the
+// payload, 8 byte aligned. The header is written last: 0 means nothing
+// has been written there yet, jrnl_skip_marker means the rest of the
+// segment is unused, anything else is the payload size plus one. Writing
+// the header last only orders the stores as far as other processes are
+// concerned; a power loss may leave a header over a payload which never
+// made it to the disk, which is what the checksum catches on reopening.
+#define jrnl_skip_marker UINT32_MAX
+#define jrnl_record_header (2 * sizeof(uint32_t))
+#define jrnl_default_segment_size (64 << 20)
+#define jrnl_max_path 4096
+
+typedef struct jrnl_segment {
+  struct jrnl_segment* next;
+  uint64_t seq;
+  char* base;
+  size_t size;
+  // Mapped from a previous run, its records are checked when read.
+  bool recovered;
+} jrnl_segment;
+
+// The committed position, along with a generation and a checksum.
+typedef struct jrnl_cursor_slot {
+  uint64_t seq;
+  uint64_t offset;
+  uint64_t gen;
+  uint64_t checksum;
+} jrnl_cursor_slot;
+
+// What's persisted in the cursor file. Commits write the slots in turns,
+// so a torn write leaves the previous position in the other one intact.
+typedef struct jrnl_cursor {
+  jrnl_cursor_slot slots[2];
+} jrnl_cursor;
+
+struct journal_queue {
+  mutex_t mutex;
+  cond_var_t read_cond;
+
+  char* dir;
+  size_t segment_size;
+
+  jrnq_sync_policy sync_policy;
+  uint64_t sync_interval_ns;
+  uint64_t last_sync_ns;
+
+  // From the segment of the committed position to the one being written.
+  jrnl_segment* head;
+  jrnl_segment* tail;
+
+  jrnl_segment* read_segment;
+  size_t read_offset;
+  // Both within the tail segment.
+  size_t write_offset;
+  size_t synced_offset;
+
+  jrnl_cursor* cursor;
+  // The latest slot, the next commit goes into the other one.
+  jrnl_cursor_slot committed;
+
+  ctcomm_allocator allocator;
+};
+
+size_t jrnl_record_size(uint32_t msg_size) {
+  return (jrnl_record_header + (size_t)msg_size + 7) & ~(size_t)7;
+}
+
+// FNV-1a, it only has to tell a torn write from a complete one.
+uint32_t jrnl_checksum(const void* data, size_t size, uint32_t hash) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t jrnl_record_checksum(uint32_t header, const void* msg,
+                              uint32_t msg_size) {
+  uint32_t hash = jrnl_checksum(&header, sizeof(header), 2166136261u);
+  return jrnl_checksum(msg, msg_size, hash);
+}
+
+// Whether the record at 'offset' is complete, given its header.
+bool jrnl_record_intact(const jrnl_segment* seg, size_t offset,
+                        uint32_t header) {
+  uint32_t msg_size = header - 1;
+  if (seg->size - offset < jrnl_record_size(msg_size)) {
+    return false;
+  }
+
+  const char* record = seg->base + offset;
+  uint32_t checksum;
+  memcpy(&checksum, record + sizeof(uint32_t), sizeof(uint32_t));
+
+  return checksum == jrnl_record_checksum(header, record + jrnl_record_header,
+                                          msg_size);
+}
+
+uint64_t jrnl_cursor_checksum(const jrnl_cursor_slot* slot) {
+  uint32_t hash = jrnl_checksum(slot, offsetof(jrnl_cursor_slot, checksum),
+                                2166136261u);
+  // Keeps an all zero slot from passing.
+  return (uint64_t)hash + 1;
+}
+
+// Picks the latest intact slot, a journal without one starts from the
+// beginning of its first segment.
+void read_jrnl_cursor(journal_queue* jq) {
+  memset(&jq->committed, 0, sizeof(jrnl_cursor_slot));
+
+  for (int i = 0; i < 2; ++i) {
+    jrnl_cursor_slot slot = jq->cursor->slots[i];
+    if (slot.checksum == jrnl_cursor_checksum(&slot) &&
+        slot.gen >= jq->committed.gen) {
+      jq->committed = slot;
+    }
+  }
+}
+
+// This function should always be called while holding the mutex.
+void write_jrnl_cursor(journal_queue* jq, uint64_t seq, uint64_t offset) {
+  jrnl_cursor_slot slot;
+  memset(&slot, 0, sizeof(slot));
+  slot.seq = seq;
+  slot.offset = offset;
+  slot.gen = jq->committed.gen + 1;
+  slot.checksum = jrnl_cursor_checksum(&slot);
+
+  jq->cursor->slots[slot.gen % 2] = slot;
+  jq->committed = slot;
+}
+
+void jrnl_segment_path(const journal_queue* jq, uint64_t seq, char* path) {
+  snprintf(path, jrnl_max_path, "%s/journal-%020llu.log", jq->dir,
+           (unsigned long long)seq);
+}
+
+// Maps an existing segment, or creates one of 'size' bytes.
+jrnl_segment* map_jrnl_segment(journal_queue* jq, uint64_t seq, size_t size,
+                               bool create) {
+  char path[jrnl_max_path];
+  jrnl_segment_path(jq, seq, path);
+
+  jrnl_segment* seg =
+      (jrnl_segment*)mem_alloc(&jq->allocator, sizeof(jrnl_segment));
+  if (!seg) {
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0600);
+  if (fd < 0) {
+    mem_free(&jq->allocator, seg);
+    return NULL;
+  }
+
+  struct stat st;
+  bool sized = false;
+  if (create) {
+    sized = ftruncate(fd, size) == 0;
+  } else if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    size = st.st_size;
+    sized = true;
+  }
+
+  void* base = MAP_FAILED;
+  if (sized) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    if (create) {
+      unlink(path);
+    }
+    mem_free(&jq->allocator, seg);
+    return NULL;
+  }
+
+  seg->next = NULL;
+  seg->seq = seq;
+  seg->base = (char*)base;
+  seg->size = size;
+  seg->recovered = !create;
+
+  return seg;
+}
+
+void unmap_jrnl_segment(journal_queue* jq, jrnl_segment* seg, bool remove) {
+  munmap(seg->base, seg->size);
+  if (remove) {
+    char path[jrnl_max_path];
+    jrnl_segment_path(jq, seg->seq, path);
+    unlink(path);
+  }
+  mem_free(&jq->allocator, seg);
+}
+
+bool find_jrnl_segments(const char* dir, uint64_t* first, uint64_t* last) {
+  DIR* d = opendir(dir);
+  if (!d) {
+    return false;
+  }
+
+  bool found = false;
+  for (struct dirent* e = readdir(d); e; e = readdir(d)) {
+    unsigned long long seq;
+    int end = 0;
+    if (sscanf(e->d_name, "journal-%20llu.log%n", &seq, &end) != 1 ||
+        end == 0 || e->d_name[end] != '\0') {
+      continue;
+    }
+    if (!found || seq < *first) {
+      *first = seq;
+    }
+    if (!found || seq > *last) {
+      *last = seq;
+    }
+    found = true;
+  }
+
+  closedir(d);
+
+  return found;
+}
+
+// Finds where the writing left off in a reopened segment.
+size_t find_jrnl_write_offset(jrnl_segment* seg) {
+  size_t offset = 0;
+
+  while (seg->size - offset >= sizeof(uint32_t)) {
+    uint32_t header;
+    memcpy(&header, seg->base + offset, sizeof(uint32_t));
+    if (header == 0) {
+      break;
+    }
+    if (header == jrnl_skip_marker) {
+      return seg->size;
+    }
+    // A torn record is overwritten by the next send. Whatever follows it
+    // is dropped too, so that no stale record resurfaces behind a
+    // shorter new one.
+    if (!jrnl_record_intact(seg, offset, header)) {
+      memset(seg->base + offset, 0, seg->size - offset);
+      break;
+    }
+    offset += jrnl_record_size(header - 1);
+  }
+
+  return offset;
+}
+
+jrnl_cursor* map_jrnl_cursor(const char* dir) {
+  char path[jrnl_max_path];
+  snprintf(path, sizeof(path), "%s/cursor", dir);
+
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // A new file reads as the start of the first segment.
+  struct stat st;
+  void* cursor = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      ((size_t)st.st_size >= sizeof(jrnl_cursor) ||
+       ftruncate(fd, sizeof(jrnl_cursor)) == 0)) {
+    cursor = mmap(NULL, sizeof(jrnl_cursor), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+  }
+  close(fd);
+
+  return cursor == MAP_FAILED ? NULL : (jrnl_cursor*)cursor;
+}
+
+void free_journal_queue(journal_queue* jq) {
+  while (jq->head) {
+    jrnl_segment* seg = jq->head;
+    jq->head = seg->next;
+    unmap_jrnl_segment(jq, seg, false);
+  }
+  if (jq->cursor) {
+    munmap(jq->cursor, sizeof(jrnl_cursor));
+  }
+  if (jq->dir) {
+    mem_free(&jq->allocator, jq->dir);
+  }
+  ctcomm_allocator alloc = jq->allocator;
+  mem_free(&alloc, jq);
+}
+
+// Maps every segment from the committed position on, creating the first
+// one if there are none.
+bool jrnl_segment_is_empty(const journal_queue* jq, uint64_t seq) {
+  char path[jrnl_max_path];
+  jrnl_segment_path(jq, seq, path);
+
+  struct stat st;
+  return stat(path, &st) == 0 && st.st_size == 0;
+}
+
+bool open_jrnl_segments(journal_queue* jq) {
+  uint64_t first = 0;
+  uint64_t last = 0;
+  jrnl_cursor_slot* cursor = &jq->committed;
+  char path[jrnl_max_path];
+
+  // A crash between creating a segment and sizing it leaves the last one
+  // empty, nothing can have been written to it.
+  bool found = find_jrnl_segments(jq->dir, &first, &last);
+  while (found && jrnl_segment_is_empty(jq, last)) {
+    jrnl_segment_path(jq, last, path);
+    unlink(path);
+    if (last == first) {
+      found = false;
+    } else {
+      --last;
+    }
+  }
+
+  if (!found) {
+    cursor->offset = 0;
+    jq->head = map_jrnl_segment(jq, cursor->seq, jq->segment_size, true);
+    jq->tail = jq->head;
+    return jq->head != NULL;
+  }
+
+  if (cursor->seq < first || cursor->seq > last) {
+    cursor->seq = first;
+    cursor->offset = 0;
+  }
+
+  // Leftovers of a commit which didn't get to delete them.
+  for (uint64_t seq = first; seq < cursor->seq; ++seq) {
+    jrnl_segment_path(jq, seq, path);
+    unlink(path);
+  }
+
+  for (uint64_t seq = cursor->seq; seq <= last; ++seq) {
+    jrnl_segment* seg = map_jrnl_segment(jq, seq, 0, false);
+    if (!seg) {
+      return false;
+    }
+    if (jq->tail) {
+      jq->tail->next = seg;
+    } else {
+      jq->head = seg;
+    }
+    jq->tail = seg;
+  }
+
+  return true;
+}
+
+journal_queue* journal_queue_create(const char* dir, const jrnq_opts* opts,
+                                    char** err_str) {
+  static const jrnq_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
+  }
+
+  if (!dir || strlen(dir) + 32 > jrnl_max_path) {
+    if (err_str) {
+      *err_str = CERR_STR("The directory should be a valid path");
+    }
+    return NULL;
+  }
+
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
+
+  journal_queue* jq = (journal_queue*)mem_alloc(alloc, sizeof(journal_queue));
+  if (!jq) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for journal queue");
+    }
+    return NULL;
+  }
+
+  memset(jq, 0, sizeof(journal_queue));
+  jq->allocator = *alloc;
+  jq->segment_size =
+      opts->segment_size ? opts->segment_size : jrnl_default_segment_size;
+  jq->sync_policy = opts->sync_policy;
+  jq->sync_interval_ns = timespec_to_ns(&opts->sync_interval);
+  jq->last_sync_ns = monotonic_now_ns();
+
+  size_t dir_len = strlen(dir);
+  jq->dir = (char*)mem_alloc(alloc, dir_len + 1);
+  if (!jq->dir) {
+    free_journal_queue(jq);
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for journal queue");
+    }
+    return NULL;
+  }
+  memcpy(jq->dir, dir, dir_len + 1);
+
+  jq->cursor = map_jrnl_cursor(dir);
+  if (jq->cursor) {
+    read_jrnl_cursor(jq);
+  }
+  if (!jq->cursor || !open_jrnl_segments(jq)) {
+    free_journal_queue(jq);
+    if (err_str) {
+      *err_str = CERR_STR("Failed to open the journal");
+    }
+    return NULL;
+  }
+
+  jq->read_segment = jq->head;
+  jq->read_offset = jq->committed.offset;
+  jq->write_offset = find_jrnl_write_offset(jq->tail);
+  jq->synced_offset = jq->write_offset;
+  if (jq->read_segment == jq->tail && jq->read_offset > jq->write_offset) {
+    jq->read_offset = jq->write_offset;
+  }
+
+  mutex_init(jq->mutex);
+  cond_var_init_with_clock(&jq->read_cond, CLOCK_MONOTONIC);
+
+  if (err_str) {
+    *err_str = NULL;
+  }
+
+  return jq;
+}
+
+// This function should always be called while holding the mutex.
+void sync_jrnl(journal_queue* jq) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t from = jq->synced_offset & ~(page_size - 1);
+
+  if (jq->write_offset > from) {
+    msync(jq->tail->base + from, jq->write_offset - from, MS_SYNC);
+  }
+  jq->synced_offset = jq->write_offset;
+
+  msync(jq->cursor, sizeof(jrnl_cursor), MS_SYNC);
+  jq->last_sync_ns = monotonic_now_ns();
+}
+
+// This function should always be called while holding the mutex.
+void sync_jrnl_by_policy(journal_queue* jq) {
+  if (jq->sync_policy == jrnq_sync_per_batch ||
+      (jq->sync_policy == jrnq_sync_periodic &&
+       monotonic_now_ns() - jq->last_sync_ns >= jq->sync_interval_ns)) {
+    sync_jrnl(jq);
+  }
+}
+
+void __journal_queue_destroy(journal_queue* jq) {
+  if (jq) {
+    if (jq->sync_policy != jrnq_sync_none) {
+      sync_jrnl(jq);
+    }
+    mutex_destroy(jq->mutex);
+    cond_var_destroy(jq->read_cond);
+    free_journal_queue(jq);
+  }
+}
+
+// This function should always be called while holding the mutex.
+bool append_to_jrnl(journal_queue* jq, const void* msg, uint32_t msg_size) {
+  size_t record_size = jrnl_record_size(msg_size);
+  jrnl_segment* seg = jq->tail;
+
+  if (seg->size - jq->write_offset < record_size) {
+    size_t size = jq->segment_size;
+    if (size < record_size) {
+      size = record_size;
+    }
+
+    jrnl_segment* next = map_jrnl_segment(jq, seg->seq + 1, size, true);
+    if (!next) {
+      return false;
+    }
+
+    if (seg->size - jq->write_offset >= sizeof(uint32_t)) {
+      uint32_t marker = jrnl_skip_marker;
+      memcpy(seg->base + jq->write_offset, &marker, sizeof(uint32_t));
+      jq->write_offset += sizeof(uint32_t);
+    }
+    // Whatever is left of the full segment won't be synced otherwise.
+    if (jq->sync_policy != jrnq_sync_none) {
+      sync_jrnl(jq);
+    }
+
+    seg->next = next;
+    jq->tail = next;
+    jq->write_offset = 0;
+    jq->synced_offset = 0;
+    seg = next;
+  }
+
+  // The header goes last, so that a reader never sees half a record.
+  char* record = seg->base + jq->write_offset;
+  if (msg_size > 0) {
+    memcpy(record + jrnl_record_header, msg, msg_size);
+  }
+  uint32_t header = msg_size + 1;
+  uint32_t checksum = jrnl_record_checksum(header, msg, msg_size);
+  memcpy(record + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+  memcpy(record, &header, sizeof(uint32_t));
+  jq->write_offset += record_size;
+
+  return true;
+}
+
+ctcomm_retval_t jrnq_send_batch(journal_queue* jq, const void** msgs,
+                                const uint32_t* sizes, uint32_t count) {
+  if (!jq || !msgs || !sizes) {
+    return ctcom_invalid_arguments;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if (sizes[i] >= jrnl_skip_marker - 1 || (sizes[i] > 0 && !msgs[i])) {
+      return ctcom_invalid_arguments;
+    }
+  }
+
+  mutex_lock(jq->mutex);
+
+  uint32_t written = 0;
+  while (written < count && append_to_jrnl(jq, msgs[written], sizes[written])) {
+    ++written;
+  }
+
+  if (written > 0) {
+    sync_jrnl_by_policy(jq);
+    cond_var_signal(jq->read_cond);
+  }
+
+  mutex_unlock(jq->mutex);
+
+  if (written == 0 && count > 0) {
+    return ctcom_not_enough_memory;
+  }
+
+  return written;
+}
+
+ctcomm_retval_t jrnq_send(journal_queue* jq, const void* msg,
+                          uint32_t msg_size) {
+  ctcomm_retval_t retval = jrnq_send_batch(jq, &msg, &msg_size, 1);
+
+  return retval == 1 ? (int)msg_size : retval;
+}
+
+// Moves the reader onto the next record, if there is one. This function
+// should always be called while holding the mutex.
+bool jrnl_has_msg(journal_queue* jq) {
+  for (;;) {
+    jrnl_segment* seg = jq->read_segment;
+    if (seg == jq->tail) {
+      return jq->read_offset < jq->write_offset;
+    }
+
+    uint32_t header = 0;
+    if (seg->size - jq->read_offset >= sizeof(uint32_t)) {
+      memcpy(&header, seg->base + jq->read_offset, sizeof(uint32_t));
+    }
+    if (header != 0 && header != jrnl_skip_marker &&
+        (!seg->recovered || jrnl_record_intact(seg, jq->read_offset, header))) {
+      return true;
+    }
+
+    // The rest of the segment is unused, or was lost along with a torn
+    // record.
+    jq->read_segment = seg->next;
+    jq->read_offset = 0;
+  }
+}
+
+// This function should always be called while holding the mutex.
+ctcomm_retval_t _recvfrom_jq(journal_queue* jq, const void** msg) {
+  char* record = jq->read_segment->base + jq->read_offset;
+  uint32_t header;
+  memcpy(&header, record, sizeof(uint32_t));
+
+  uint32_t msg_size = header - 1;
+  *msg = msg_size > 0 ? record + jrnl_record_header : NULL;
+  jq->read_offset += jrnl_record_size(msg_size);
+
+  return msg_size;
+}
+
+ctcomm_retval_t jrnq_recv(journal_queue* jq, const void** msg) {
+  if (!jq || !msg) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(jq->mutex);
+
+  while (!jrnl_has_msg(jq)) {
+    cond_var_wait(jq->read_cond, jq->mutex);
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_jq(jq, msg);
+
+  mutex_unlock(jq->mutex);
+
+  return msg_size;
+}
+
+ctcomm_retval_t jrnq_try_recv(journal_queue* jq, const void** msg) {
+  if (!jq || !msg) {
+    return ctcom_invalid_arguments;
+  }
+
+  ctcomm_retval_t result = ctcom_container_empty;
+
+  mutex_lock(jq->mutex);
+
+  if (jrnl_has_msg(jq)) {
+    result = _recvfrom_jq(jq, msg);
+  }
+
+  mutex_unlock(jq->mutex);
+
+  return result;
+}
+
+ctcomm_retval_t jrnq_timed_recv(journal_queue* jq, const void** msg,
+                                struct timespec* timeout) {
+  if (!jq || !msg || !timeout) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(jq->mutex);
+
+  if (!jrnl_has_msg(jq)) {
+    struct timespec abs_time;
+    clock_gettime(CLOCK_MONOTONIC, &abs_time);
+    add_duration_to_timespec(&abs_time, timeout);
+
+    while (!jrnl_has_msg(jq)) {
+      int retval = cond_var_timedwait(jq->read_cond, jq->mutex, abs_time);
+      if (retval) {
+        mutex_unlock(jq->mutex);
+        return retval == ETIMEDOUT ? ctcom_timedout : ctcom_unexpected_failure;
+      }
+    }
+  }
+
+  ctcomm_retval_t msg_size = _recvfrom_jq(jq, msg);
+
+  mutex_unlock(jq->mutex);
 
   return msg_size;
 }
 
-ctcomm_retval_t _recvfrom_dq(dynamic_queue* dq, void** target_buf) {
-  ctcomm_retval_t retval = remove_msg_from_dq_head(dq, target_buf);
+ctcomm_retval_t jrnq_commit(journal_queue* jq) {
+  if (!jq) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(jq->mutex);
+
+  write_jrnl_cursor(jq, jq->read_segment->seq, jq->read_offset);
+
+  // Nothing before the read segment is reachable anymore.
+  while (jq->head != jq->read_segment) {
+    jrnl_segment* seg = jq->head;
+    jq->head = seg->next;
+    unmap_jrnl_segment(jq, seg, true);
+  }
+
+  sync_jrnl_by_policy(jq);
+
+  mutex_unlock(jq->mutex);
+
+  return ctcom_success_threshold;
+}
+
+ctcomm_retval_t jrnq_sync(journal_queue* jq) {
+  if (!jq) {
+    return ctcom_invalid_arguments;
+  }
+
+  mutex_lock(jq->mutex);
+  sync_jrnl(jq);
+  mutex_unlock(jq->mutex);
+
+  return ctcom_success_threshold;
+}
+
+// Message pool related section starts here.
+#define msgpool_class_count 28
+#define msgpool_oversized UINT32_MAX
+
+// Every buffer starts with this, the caller gets what follows it. Free
+// buffers are chained through 'next', the head of a chain keeps its
+// length in 'count'. The chains in the depot are stacked through the
+// first word of their heads' payloads.
+typedef struct pool_buf {
+  struct pool_buf* next;
+  uint32_t size_class;
+  uint32_t count;
+} pool_buf;
+
+typedef struct pool_magazine {
+  pool_buf* head;
+  uint32_t count;
+} pool_magazine;
+
+// A thread's magazines. The counters are only written by the owner
+// thread, msgpool_get_stats() reads them from others.
+typedef struct pool_cache {
+  struct pool_cache* prev;
+  struct pool_cache* next;
+  msg_pool* pool;
+
+  // 'spare' is either empty or full.
+  pool_magazine loaded[msgpool_class_count];
+  pool_magazine spare[msgpool_class_count];
+
+  msgpool_stats stats;
+} pool_cache;
+
+struct msg_pool {
+  mutex_t mutex;
+  pthread_key_t key;
+
+  uint32_t magazine_size;
+  uint32_t class_count;
+
+  pool_buf* depot[msgpool_class_count];
+  pool_cache* caches;
+  // The counters of the threads which have exited.
+  msgpool_stats retired;
+
+  ctcomm_allocator allocator;
+};
+
+void bump_pool_counter(uint64_t* counter) {
+  __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+void add_pool_stats(msgpool_stats* to, msgpool_stats* from) {
+  to->hits += __atomic_load_n(&from->hits, __ATOMIC_RELAXED);
+  to->misses += __atomic_load_n(&from->misses, __ATOMIC_RELAXED);
+  to->oversized += __atomic_load_n(&from->oversized, __ATOMIC_RELAXED);
+  to->frees += __atomic_load_n(&from->frees, __ATOMIC_RELAXED);
+  to->returned_magazines +=
+      __atomic_load_n(&from->returned_magazines, __ATOMIC_RELAXED);
+}
+
+uint32_t pool_size_class(uint32_t size) {
+  return size <= 16 ? 0 : 32 - __builtin_clz(size - 1) - 4;
+}
+
+size_t pool_class_size(uint32_t size_class) {
+  return (size_t)16 << size_class;
+}
+
+void push_to_depot(msg_pool* pool, uint32_t size_class, pool_buf* head,
+                   uint32_t count) {
+  head->count = count;
+
+  mutex_lock(pool->mutex);
+  *(pool_buf**)(head + 1) = pool->depot[size_class];
+  pool->depot[size_class] = head;
+  mutex_unlock(pool->mutex);
+}
+
+void free_pool_chain(msg_pool* pool, pool_buf* head) {
+  while (head) {
+    pool_buf* next = head->next;
+    mem_free(&pool->allocator, head);
+    head = next;
+  }
+}
+
+// pthread key destructor, gives an exiting thread's buffers back.
+void retire_pool_cache(void* arg) {
+  pool_cache* cache = (pool_cache*)arg;
+  msg_pool* pool = cache->pool;
+
+  for (uint32_t i = 0; i < pool->class_count; ++i) {
+    if (cache->loaded[i].count) {
+      push_to_depot(pool, i, cache->loaded[i].head, cache->loaded[i].count);
+    }
+    if (cache->spare[i].count) {
+      push_to_depot(pool, i, cache->spare[i].head, cache->spare[i].count);
+    }
+  }
+
+  mutex_lock(pool->mutex);
+  add_pool_stats(&pool->retired, &cache->stats);
+  if (cache->prev) {
+    cache->prev->next = cache->next;
+  } else {
+    pool->caches = cache->next;
+  }
+  if (cache->next) {
+    cache->next->prev = cache->prev;
+  }
+  mutex_unlock(pool->mutex);
+
+  mem_free(&pool->allocator, cache);
+}
+
+// Returns NULL if the cache can't be allocated, the callers fall back to
+// the depot and the allocator then.
+pool_cache* get_pool_cache(msg_pool* pool) {
+  pool_cache* cache = (pool_cache*)pthread_getspecific(pool->key);
+  if (cache) {
+    return cache;
+  }
 
-  if (retval != ctcom_container_empty) {
-    --dq->msg_count;
+  cache = (pool_cache*)mem_alloc(&pool->allocator, sizeof(pool_cache));
+  if (!cache) {
+    return NULL;
   }
+  memset(cache, 0, sizeof(pool_cache));
+  cache->pool = pool;
 
-  return retval;
-}
+  if (pthread_setspecific(pool->key, cache)) {
+    mem_free(&pool->allocator, cache);
+    return NULL;
+  }
 
-ctcomm_retval_t verify_recvfrom_dq_zc_params(dynamic_queue* dq,
-                                             void** target_buf) {
-  if (!dq || !target_buf) {
-    return ctcom_invalid_arguments;
+  mutex_lock(pool->mutex);
+  cache->next = pool->caches;
+  if (pool->caches) {
+    pool->caches->prev = cache;
   }
+  pool->caches = cache;
+  mutex_unlock(pool->mutex);
 
-  return ctcom_success_threshold;
+  return cache;
 }
 
-ctcomm_retval_t dynmq_recv_zc(dynamic_queue* dq, void** target_buf) {
-  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
-    return ctcom_invalid_arguments;
+msg_pool* msg_pool_create(const msgpool_opts* opts, char** err_str) {
+  static const msgpool_opts default_opts = {0};
+  if (!opts) {
+    opts = &default_opts;
   }
 
-  mutex_lock(dq->mutex);
+  const ctcomm_allocator* alloc = select_allocator(opts->allocator);
+  if (!alloc) {
+    if (err_str) {
+      *err_str = CERR_STR("The allocator should provide all functions");
+    }
+    return NULL;
+  }
 
-  while (dq->msg_count == 0) {
-    cond_var_wait(dq->read_cond, dq->mutex);
+  uint32_t max_buffer_size =
+      opts->max_buffer_size ? opts->max_buffer_size : 64 << 10;
+  if (max_buffer_size > 1U << 31) {
+    if (err_str) {
+      *err_str = CERR_STR("max_buffer_size can not exceed 2GiB");
+    }
+    return NULL;
   }
 
-  ctcomm_retval_t msg_size = _recvfrom_dq(dq, target_buf);
+  msg_pool* pool = (msg_pool*)mem_alloc(alloc, sizeof(msg_pool));
+  if (!pool) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for msg_pool");
+    }
+    return NULL;
+  }
 
-  mutex_unlock(dq->mutex);
+  memset(pool, 0, sizeof(msg_pool));
+  if (pthread_key_create(&pool->key, retire_pool_cache)) {
+    mem_free(alloc, pool);
+    if (err_str) {
+      *err_str = CERR_STR("Failed to create a pthread key for msg_pool");
+    }
+    return NULL;
+  }
 
-  return msg_size;
-}
+  pool->allocator = *alloc;
+  pool->magazine_size = opts->magazine_size ? opts->magazine_size : 32;
+  pool->class_count = pool_size_class(max_buffer_size) + 1;
+  mutex_init(pool->mutex);
 
-ctcomm_retval_t dynmq_try_recv_zc(dynamic_queue* dq, void** target_buf) {
-  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
-    return ctcom_invalid_arguments;
+  if (err_str) {
+    *err_str = NULL;
   }
 
-  ctcomm_retval_t result = ctcom_container_empty;
+  return pool;
+}
 
-  mutex_lock(dq->mutex);
+void __msg_pool_destroy(msg_pool* pool) {
+  if (pool) {
+    // The exiting threads won't call retire_pool_cache() from now on.
+    pthread_key_delete(pool->key);
+
+    while (pool->caches) {
+      pool_cache* cache = pool->caches;
+      pool->caches = cache->next;
+      for (uint32_t i = 0; i < pool->class_count; ++i) {
+        free_pool_chain(pool, cache->loaded[i].head);
+        free_pool_chain(pool, cache->spare[i].head);
+      }
+      mem_free(&pool->allocator, cache);
+    }
 
-  if (dq->msg_count > 0) {
-    result = _recvfrom_dq(dq, target_buf);
-  }
+    for (uint32_t i = 0; i < pool->class_count; ++i) {
+      while (pool->depot[i]) {
+        pool_buf* head = pool->depot[i];
+        pool->depot[i] = *(pool_buf**)(head + 1);
+        free_pool_chain(pool, head);
+      }
+    }
 
-  mutex_unlock(dq->mutex);
+    mutex_destroy(pool->mutex);
 
-  return result;
+    ctcomm_allocator alloc = pool->allocator;
+    mem_free(&alloc, pool);
+  }
 }
 
-ctcomm_retval_t dynmq_timed_recv_zc(dynamic_queue* dq, void** target_buf,
-                                    struct timespec* timeout) {
-  if (verify_recvfrom_dq_zc_params(dq, target_buf) != 0) {
-    return ctcom_invalid_arguments;
+void* msgpool_alloc(msg_pool* pool, uint32_t size) {
+  if (!pool) {
+    return NULL;
   }
 
-  mutex_lock(dq->mutex);
-
-  if (dq->msg_count == 0) {
-    int retval;
-    struct timespec abs_time;
-    clock_gettime(CLOCK_REALTIME, &abs_time);
-    add_duration_to_timespec(&abs_time, timeout);
+  uint32_t size_class = pool_size_class(size);
+  pool_cache* cache = get_pool_cache(pool);
+  pool_buf* buf = NULL;
 
-    while (dq->msg_count == 0) {
-      if ((retval = cond_var_timedwait(dq->read_cond, dq->mutex, abs_time))) {
-        if (retval != ETIMEDOUT) {
-          mutex_unlock(dq->mutex);
-          return ctcom_unexpected_failure;
-        }
-        mutex_unlock(dq->mutex);
-        return ctcom_timedout;
+  if (size_class >= pool->class_count) {
+    buf = (pool_buf*)mem_alloc(&pool->allocator, sizeof(pool_buf) + size);
+    if (buf) {
+      buf->size_class = msgpool_oversized;
+      if (cache) {
+        bump_pool_counter(&cache->stats.oversized);
       }
     }
+    return buf ? buf + 1 : NULL;
   }
 
-  ctcomm_retval_t msg_size = _recvfrom_dq(dq, target_buf);
+  if (cache) {
+    pool_magazine* m = &cache->loaded[size_class];
+    if (m->count == 0 && cache->spare[size_class].count) {
+      *m = cache->spare[size_class];
+      cache->spare[size_class] = (pool_magazine){NULL, 0};
+    }
 
-  mutex_unlock(dq->mutex);
+    if (m->count == 0) {
+      mutex_lock(pool->mutex);
+      pool_buf* head = pool->depot[size_class];
+      if (head) {
+        pool->depot[size_class] = *(pool_buf**)(head + 1);
+      }
+      mutex_unlock(pool->mutex);
 
-  return msg_size;
-}
+      if (head) {
+        m->head = head;
+        m->count = head->count;
+      }
+    }
 
-ctcomm_retval_t dynmq_disable_sending(dynamic_queue* dq) {
-  if (dq) {
-    mutex_lock(dq->mutex);
-    dq->writing_disabled = true;
-    mutex_unlock(dq->mutex);
-    return ctcom_success_threshold;
+    if (m->count) {
+      buf = m->head;
+      m->head = buf->next;
+      --m->count;
+      bump_pool_counter(&cache->stats.hits);
+      return buf + 1;
+    }
+
+    bump_pool_counter(&cache->stats.misses);
   }
 
-  return ctcom_invalid_arguments;
+  buf = (pool_buf*)mem_alloc(&pool->allocator,
+                             sizeof(pool_buf) + pool_class_size(size_class));
+  if (!buf) {
+    return NULL;
+  }
+  buf->size_class = size_class;
+
+  return buf + 1;
 }
 
-ctcomm_retval_t dynmq_enable_sending(dynamic_queue* dq) {
-  if (dq) {
-    mutex_lock(dq->mutex);
-    dq->writing_disabled = false;
-    mutex_unlock(dq->mutex);
-    return ctcom_success_threshold;
+void msgpool_free(msg_pool* pool, void* buf) {
+  if (!pool || !buf) {
+    return;
   }
 
-  return ctcom_invalid_arguments;
+  pool_buf* b = (pool_buf*)buf - 1;
+  uint32_t size_class = b->size_class;
+  if (size_class == msgpool_oversized) {
+    mem_free(&pool->allocator, b);
+    return;
+  }
+
+  pool_cache* cache = get_pool_cache(pool);
+  if (!cache) {
+    b->next = NULL;
+    push_to_depot(pool, size_class, b, 1);
+    return;
+  }
+
+  bump_pool_counter(&cache->stats.frees);
+
+  pool_magazine* m = &cache->loaded[size_class];
+  if (m->count == pool->magazine_size) {
+    pool_magazine* spare = &cache->spare[size_class];
+    if (spare->count) {
+      push_to_depot(pool, size_class, spare->head, spare->count);
+      bump_pool_counter(&cache->stats.returned_magazines);
+    }
+    *spare = *m;
+    *m = (pool_magazine){NULL, 0};
+  }
+
+  b->next = m->head;
+  m->head = b;
+  ++m->count;
 }
 
-int dynmq_msg_count(dynamic_queue* dq) {
-  int result = -1;
+ctcomm_retval_t msgpool_get_stats(msg_pool* pool, msgpool_stats* stats) {
+  if (!pool || !stats) {
+    return ctcom_invalid_arguments;
+  }
 
-  if (dq) {
-    mutex_lock(dq->mutex);
-    result = dq->msg_count;
-    mutex_unlock(dq->mutex);
+  memset(stats, 0, sizeof(msgpool_stats));
+
+  mutex_lock(pool->mutex);
+  add_pool_stats(stats, &pool->retired);
+  for (pool_cache* cache = pool->caches; cache; cache = cache->next) {
+    add_pool_stats(stats, &cache->stats);
   }
+  mutex_unlock(pool->mutex);
 
-  return result;
+  return ctcom_success_threshold;
 }
 
-// Channel related section starts here.
-struct channel {
-  thread_id_t owner_tid;
-  circular_queue* owner_to_workers_cq;
-  circular_queue* workers_to_owner_cq;
+// Rendezvous related section starts here.
+// Lives on the stack of a waiting sender or receiver. 'done' is the
+// futex word, the other side fills the slot in and then sets it.
+typedef struct rdv_slot {
+  struct rdv_slot* next;
+  void* msg;
+  uint32_t msg_size;
+  int result;
+  uint32_t done;
+} rdv_slot;
+
+typedef struct rdv_slot_list {
+  rdv_slot* head;
+  rdv_slot* tail;
+} rdv_slot_list;
+
+struct rendezvous {
+  mutex_t mutex;
+  rdv_slot_list senders;
+  rdv_slot_list receivers;
+  bool writing_disabled;
+
+  ctcomm_allocator allocator;
 };
 
-channel* channel_create(uint32_t max_size, char** err_str) {
-  channel* ch = (channel*)mem_alloc(sizeof(channel));
-  if (!ch) {
-    if (err_str) {
-      *err_str = CERR_STR("Failed to allocate memory for channel");
+void rdv_slot_push(rdv_slot_list* l, rdv_slot* slot) {
+  slot->next = NULL;
+  if (l->tail) {
+    l->tail->next = slot;
+  } else {
+    l->head = slot;
+  }
+  l->tail = slot;
+}
+
+rdv_slot* rdv_slot_pop(rdv_slot_list* l) {
+  rdv_slot* slot = l->head;
+  if (slot) {
+    l->head = slot->next;
+    if (!l->head) {
+      l->tail = NULL;
     }
-    return NULL;
   }
+  return slot;
+}
 
-  ch->owner_to_workers_cq = circular_queue_create(max_size, err_str);
-  if (!ch->owner_to_workers_cq) {
-    mem_free(ch);
-    return NULL;
+bool rdv_slot_remove(rdv_slot_list* l, rdv_slot* slot) {
+  rdv_slot* prev = NULL;
+  for (rdv_slot* it = l->head; it; prev = it, it = it->next) {
+    if (it == slot) {
+      if (prev) {
+        prev->next = it->next;
+      } else {
+        l->head = it->next;
+      }
+      if (l->tail == it) {
+        l->tail = prev;
+      }
+      return true;
+    }
   }
+  return false;
+}
 
-  ch->workers_to_owner_cq = circular_queue_create(max_size, err_str);
-  if (!ch->workers_to_owner_cq) {
-    circular_queue_destroy(ch->owner_to_workers_cq);
-    mem_free(ch);
+// Called without holding the mutex, the slot has already left its list.
+void complete_rdv_slot(rdv_slot* slot) {
+  __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+  wake_futex_word(&slot->done);
+}
+
+// A NULL deadline waits for as long as it takes.
+int wait_for_rdv_slot(rdv_slot* slot, const struct timespec* deadline) {
+  return wait_on_futex_word(&slot->done, 0, deadline);
+}
+
+rendezvous* rendezvous_create(char** err_str) {
+  const ctcomm_allocator* alloc = select_allocator(NULL);
+  rendezvous* r = (rendezvous*)mem_alloc(alloc, sizeof(rendezvous));
+  if (!r) {
+    if (err_str) {
+      *err_str = CERR_STR("Failed to allocate memory for rendezvous");
+    }
     return NULL;
   }
 
-  ch->owner_tid = get_thread_id();
+  mutex_init(r->mutex);
+  r->senders = (rdv_slot_list){NULL, NULL};
+  r->receivers = (rdv_slot_list){NULL, NULL};
+  r->writing_disabled = false;
+  r->allocator = *alloc;
 
   if (err_str) {
     *err_str = NULL;
   }
 
-  return ch;
+  return r;
 }
 
-void __channel_destroy(channel* ch) {
-  if (ch) {
-    circular_queue_destroy(ch->owner_to_workers_cq);
-    circular_queue_destroy(ch->workers_to_owner_cq);
-    mem_free(ch);
+void __rendezvous_destroy(rendezvous* r) {
+  if (r) {
+    mutex_destroy(r->mutex);
+    ctcomm_allocator alloc = r->allocator;
+    mem_free(&alloc, r);
   }
 }
 
-int chan_send_zc(channel* ch, void** msg, uint32_t msg_size) {
-  if (!ch) {
-    return ctcom_invalid_arguments;
+// Parks 'self', which has been pushed into one of the lists, until the
+// other side completes it or the deadline passes.
+int park_on_rdv(rendezvous* r, rdv_slot_list* l, rdv_slot* self,
+                struct timespec* timeout) {
+  struct timespec deadline;
+  if (timeout) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    add_duration_to_timespec(&deadline, timeout);
   }
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_send_zc(ch->owner_to_workers_cq, msg, msg_size);
+  int retval = wait_for_rdv_slot(self, timeout ? &deadline : NULL);
+  if (retval) {
+    mutex_lock(r->mutex);
+    bool removed = rdv_slot_remove(l, self);
+    mutex_unlock(r->mutex);
+
+    if (removed) {
+      return retval;
+    }
+    // The other side has already taken it, and is about to complete it.
+    wait_for_rdv_slot(self, NULL);
   }
 
-  return circq_send_zc(ch->workers_to_owner_cq, msg, msg_size);
+  return self->result;
 }
 
-int chan_try_send_zc(channel* ch, void** msg, uint32_t msg_size) {
-  if (!ch) {
+// The rendezvous calls share the following two functions, with the same
+// conventions as _send_copy_cq().
+int _send_to_rdv(rendezvous* r, void** msg, uint32_t msg_size,
+                 bool blocking, struct timespec* timeout) {
+  if (!r || !msg || (msg_size == 0 && *msg != NULL)) {
     return ctcom_invalid_arguments;
   }
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_try_send_zc(ch->owner_to_workers_cq, msg, msg_size);
+  if (*msg == NULL) {
+    msg_size = 0;
   }
 
-  return circq_try_send_zc(ch->workers_to_owner_cq, msg, msg_size);
-}
+  mutex_lock(r->mutex);
 
-int chan_timed_send_zc(channel* ch, void** msg, uint32_t msg_size,
-                       struct timespec* timeout) {
-  if (!ch) {
-    return ctcom_invalid_arguments;
+  if (r->writing_disabled) {
+    mutex_unlock(r->mutex);
+    return ctcom_writing_disabled;
   }
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_timed_send_zc(ch->owner_to_workers_cq, msg, msg_size, timeout);
-  }
+  rdv_slot* peer = rdv_slot_pop(&r->receivers);
+  if (peer) {
+    mutex_unlock(r->mutex);
 
-  return circq_timed_send_zc(ch->workers_to_owner_cq, msg, msg_size, timeout);
-}
+    peer->msg = *msg;
+    peer->msg_size = msg_size;
+    peer->result = msg_size;
+    *msg = NULL;
+    complete_rdv_slot(peer);
 
-int chan_recv_zc(channel* ch, void** target_buf) {
-  if (!ch) {
-    return ctcom_invalid_arguments;
+    return msg_size;
   }
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_recv_zc(ch->workers_to_owner_cq, target_buf);
+  if (!blocking) {
+    mutex_unlock(r->mutex);
+    return ctcom_container_full;
   }
 
-  return circq_recv_zc(ch->owner_to_workers_cq, target_buf);
-}
+  rdv_slot self = {NULL, *msg, msg_size, 0, 0};
+  rdv_slot_push(&r->senders, &self);
 
-int chan_try_recv_zc(channel* ch, void** target_buf) {
-  if (!ch) {
-    return ctcom_invalid_arguments;
-  }
+  mutex_unlock(r->mutex);
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_try_recv_zc(ch->workers_to_owner_cq, target_buf);
+  int result = park_on_rdv(r, &r->senders, &self, timeout);
+  if (result >= 0) {
+    *msg = NULL;
   }
 
-  return circq_try_recv_zc(ch->owner_to_workers_cq, target_buf);
+  return result;
 }
 
-int chan_timed_recv_zc(channel* ch, void** target_buf,
-                       struct timespec* timeout) {
-  if (!ch) {
+int _recv_from_rdv(rendezvous* r, void** target_buf, bool blocking,
+                   struct timespec* timeout) {
+  if (!r || !target_buf) {
     return ctcom_invalid_arguments;
   }
 
-  if (get_thread_id() == ch->owner_tid) {
-    return circq_timed_recv_zc(ch->workers_to_owner_cq, target_buf, timeout);
+  mutex_lock(r->mutex);
+
+  rdv_slot* peer = rdv_slot_pop(&r->senders);
+  if (peer) {
+    mutex_unlock(r->mutex);
+
+    *target_buf = peer->msg;
+    int msg_size = peer->msg_size;
+    peer->result = msg_size;
+    complete_rdv_slot(peer);
+
+    return msg_size;
   }
 
-  return circq_timed_recv_zc(ch->owner_to_workers_cq, target_buf, timeout);
+  if (r->writing_disabled || !blocking) {
+    mutex_unlock(r->mutex);
+    return r->writing_disabled ? ctcom_writing_disabled
+                               : ctcom_container_empty;
+  }
+
+  rdv_slot self = {NULL, NULL, 0, 0, 0};
+  rdv_slot_push(&r->receivers, &self);
+
+  mutex_unlock(r->mutex);
+
+  int result = park_on_rdv(r, &r->receivers, &self, timeout);
+  if (result >= 0) {
+    *target_buf = self.msg;
+  }
+
+  return result;
 }
 
-int chan_disable_sending(channel* ch, channel_direction d) {
-  if (!ch) {
+int rdv_send_zc(rendezvous* r, void** msg, uint32_t msg_size) {
+  return _send_to_rdv(r, msg, msg_size, true, NULL);
+}
+
+int rdv_try_send_zc(rendezvous* r, void** msg, uint32_t msg_size) {
+  return _send_to_rdv(r, msg, msg_size, false, NULL);
+}
+
+int rdv_timed_send_zc(rendezvous* r, void** msg, uint32_t msg_size,
+                      struct timespec* timeout) {
+  if (!timeout) {
     return ctcom_invalid_arguments;
   }
 
-  if (d == owner_to_workers) {
-    circq_disable_sending(ch->owner_to_workers_cq);
-  } else if (d == workers_to_owner) {
-    circq_disable_sending(ch->workers_to_owner_cq);
-  } else {
+  return _send_to_rdv(r, msg, msg_size, true, timeout);
+}
+
+int rdv_recv_zc(rendezvous* r, void** target_buf) {
+  return _recv_from_rdv(r, target_buf, true, NULL);
+}
+
+int rdv_try_recv_zc(rendezvous* r, void** target_buf) {
+  return _recv_from_rdv(r, target_buf, false, NULL);
+}
+
+int rdv_timed_recv_zc(rendezvous* r, void** target_buf,
+                      struct timespec* timeout) {
+  if (!timeout) {
     return ctcom_invalid_arguments;
   }
 
-  return 0;
+  return _recv_from_rdv(r, target_buf, true, timeout);
 }
 
-int chan_enable_sending(channel* ch, channel_direction d) {
-  if (!ch) {
+int rdv_disable_sending(rendezvous* r) {
+  if (!r) {
     return ctcom_invalid_arguments;
   }
 
-  if (d == owner_to_workers) {
-    circq_enable_sending(ch->owner_to_workers_cq);
-  } else if (d == workers_to_owner) {
-    circq_enable_sending(ch->workers_to_owner_cq);
-  } else {
-    return ctcom_invalid_arguments;
+  mutex_lock(r->mutex);
+  r->writing_disabled = true;
+  rdv_slot_list senders = r->senders;
+  rdv_slot_list receivers = r->receivers;
+  r->senders = (rdv_slot_list){NULL, NULL};
+  r->receivers = (rdv_slot_list){NULL, NULL};
+  mutex_unlock(r->mutex);
+
+  // Senders keep their messages.
+  for (rdv_slot* slot = rdv_slot_pop(&senders); slot;
+       slot = rdv_slot_pop(&senders)) {
+    slot->result = ctcom_writing_disabled;
+    complete_rdv_slot(slot);
+  }
+  for (rdv_slot* slot = rdv_slot_pop(&receivers); slot;
+       slot = rdv_slot_pop(&receivers)) {
+    slot->result = ctcom_writing_disabled;
+    complete_rdv_slot(slot);
   }
 
-  return 0;
+  return ctcom_success_threshold;
 }
 
-int chan_msg_count(channel* ch, channel_direction d) {
-  if (!ch) {
+int rdv_enable_sending(rendezvous* r) {
+  if (!r) {
     return ctcom_invalid_arguments;
   }
 
-  if (d == owner_to_workers) {
-    return circq_msg_count(ch->owner_to_workers_cq);
-  } else if (d == workers_to_owner) {
-    return circq_msg_count(ch->workers_to_owner_cq);
-  }
+  mutex_lock(r->mutex);
+  r->writing_disabled = false;
+  mutex_unlock(r->mutex);
 
-  return ctcom_invalid_arguments;
+  return ctcom_success_threshold;
 }
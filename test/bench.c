@@ -0,0 +1,179 @@
+/*
+MIT License
+
+Copyright (c) 2018 Danis Ozdemir
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares FIFO and LIFO consumption on the "allocate, fill, enqueue,
+// process" pattern. A burst of messages, bigger than the caches in
+// total, is produced and then consumed; LIFO consumers start with the
+// messages which have just been written. Cache misses are counted with
+// perf_event_open where it's permitted, the run time is always reported.
+
+#include <thread_comm.h>
+
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define burst_size 512
+#define msg_size 4096
+#define rounds 200
+
+int open_cache_miss_counter(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t process(const unsigned char* msg) {
+  uint64_t sum = 0;
+  for (int i = 0; i < msg_size; i += 64) {
+    sum += msg[i];
+  }
+  return sum;
+}
+
+char* produce(int seq) {
+  char* msg = (char*)malloc(msg_size);
+  memset(msg, seq, msg_size);
+  return msg;
+}
+
+uint64_t run_dq(dynamic_queue* dq) {
+  uint64_t sum = 0;
+  for (int r = 0; r < rounds; ++r) {
+    for (int i = 0; i < burst_size; ++i) {
+      char* msg = produce(i);
+      dynmq_send_zc(dq, (void**)&msg, msg_size);
+    }
+    for (int i = 0; i < burst_size; ++i) {
+      char* msg = NULL;
+      dynmq_recv_zc(dq, (void**)&msg);
+      sum += process((unsigned char*)msg);
+      free(msg);
+    }
+  }
+  return sum;
+}
+
+uint64_t run_cq(circular_queue* cq) {
+  uint64_t sum = 0;
+  for (int r = 0; r < rounds; ++r) {
+    for (int i = 0; i < burst_size; ++i) {
+      char* msg = produce(i);
+      circq_send_zc(cq, (void**)&msg, msg_size);
+    }
+    for (int i = 0; i < burst_size; ++i) {
+      char* msg = NULL;
+      circq_recv_zc(cq, (void**)&msg);
+      sum += process((unsigned char*)msg);
+      free(msg);
+    }
+  }
+  return sum;
+}
+
+typedef enum queue_kind { dynamic_kind, circular_kind } queue_kind;
+
+void report(queue_kind kind, int counter, bool lifo) {
+  const char* name =
+      kind == dynamic_kind ? "dynamic_queue" : "circular_queue";
+  dynmq_opts dq_opts = {.lifo = lifo};
+  circq_opts cq_opts = {.lifo = lifo};
+  dynamic_queue* dq = NULL;
+  circular_queue* cq = NULL;
+  struct timespec before;
+  struct timespec after;
+  uint64_t misses = 0;
+  uint64_t sum;
+
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &before);
+
+  if (kind == dynamic_kind) {
+    dq = dynamic_queue_create_with_opts(&dq_opts, NULL);
+    sum = run_dq(dq);
+    dynamic_queue_destroy(dq);
+  } else {
+    cq = circular_queue_create_with_opts(burst_size, &cq_opts, NULL);
+    sum = run_cq(cq);
+    circular_queue_destroy(cq);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = 0;
+    }
+  }
+
+  uint64_t usecs = (after.tv_sec - before.tv_sec) * 1000000 +
+                   (after.tv_nsec - before.tv_nsec) / 1000;
+
+  if (counter >= 0) {
+    printf("%-14s %-5s %10" PRIu64 " us %14" PRIu64
+           " cache misses (checksum %" PRIu64 ")\n",
+           name, lifo ? "LIFO" : "FIFO", usecs, misses, sum);
+  } else {
+    printf("%-14s %-5s %10" PRIu64 " us (checksum %" PRIu64 ")\n", name,
+           lifo ? "LIFO" : "FIFO", usecs, sum);
+  }
+}
+
+int main(void) {
+  int counter = open_cache_miss_counter();
+  if (counter < 0) {
+    printf("perf_event_open isn't available, reporting run times only\n");
+  }
+
+  printf("%d rounds of %d messages of %d bytes\n", rounds, burst_size,
+         msg_size);
+
+  for (int lifo = 0; lifo < 2; ++lifo) {
+    report(dynamic_kind, counter, lifo);
+  }
+  for (int lifo = 0; lifo < 2; ++lifo) {
+    report(circular_kind, counter, lifo);
+  }
+
+  if (counter >= 0) {
+    close(counter);
+  }
+
+  return 0;
+}
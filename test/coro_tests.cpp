@@ -0,0 +1,146 @@
+#include <thread_comm_coro.hpp>
+
+#include <coroutine>
+#include <cstdlib>
+#include <deque>
+
+#include <tau/tau.h>
+TAU_MAIN()  // sets up Tau (+ main function)
+
+// A fire-and-forget coroutine, it starts right away and nobody waits for
+// it.
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::abort(); }
+  };
+};
+
+// Resumed handles are only queued, they're run by the test itself.
+struct test_executor {
+  std::deque<std::coroutine_handle<>>* ready;
+  void operator()(std::coroutine_handle<> h) const { ready->push_back(h); }
+};
+
+void run_all(std::deque<std::coroutine_handle<>>& ready) {
+  while (!ready.empty()) {
+    std::coroutine_handle<> h = ready.front();
+    ready.pop_front();
+    h.resume();
+  }
+}
+
+template <typename Queue>
+detached receive_one(ctcomm::async_queue<Queue, test_executor>& q,
+                     ctcomm::op_result* out) {
+  *out = co_await q.recv();
+}
+
+template <typename Queue>
+detached send_one(ctcomm::async_queue<Queue, test_executor>& q, void* msg,
+                  ctcomm::op_result* out) {
+  *out = co_await q.send(msg, 1);
+}
+
+TEST(coroutines, circular_queue_recv_suspends) {
+  std::deque<std::coroutine_handle<>> ready;
+  circular_queue* cq = circular_queue_create(1, NULL);
+  ctcomm::async_queue<circular_queue, test_executor> q(cq,
+                                                       test_executor{&ready});
+
+  ctcomm::op_result r = {ctcom_unexpected_failure, nullptr};
+  receive_one(q, &r);
+  // Nothing to receive, the coroutine is parked on the queue.
+  REQUIRE_EQ(r.status, ctcom_unexpected_failure);
+  REQUIRE(ready.empty());
+
+  char* msg = static_cast<char*>(malloc(1));
+  *msg = 'A';
+  REQUIRE_EQ(circq_send_zc(cq, (void**)&msg, 1), 1);
+  REQUIRE_EQ(ready.size(), 1u);
+  run_all(ready);
+
+  REQUIRE_EQ(r.status, 1);
+  REQUIRE_EQ(*static_cast<char*>(r.msg), 'A');
+  free(r.msg);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(coroutines, circular_queue_send_suspends) {
+  std::deque<std::coroutine_handle<>> ready;
+  circular_queue* cq = circular_queue_create(1, NULL);
+  ctcomm::async_queue<circular_queue, test_executor> q(cq,
+                                                       test_executor{&ready});
+
+  ctcomm::op_result first = {ctcom_unexpected_failure, nullptr};
+  ctcomm::op_result second = {ctcom_unexpected_failure, nullptr};
+  // The first send completes synchronously, the second one waits for
+  // space.
+  send_one(q, malloc(1), &first);
+  REQUIRE_EQ(first.status, 1);
+  send_one(q, malloc(1), &second);
+  REQUIRE_EQ(second.status, ctcom_unexpected_failure);
+
+  void* buf = nullptr;
+  REQUIRE_EQ(circq_recv_zc(cq, &buf), 1);
+  free(buf);
+  run_all(ready);
+  REQUIRE_EQ(second.status, 1);
+
+  REQUIRE_EQ(circq_recv_zc(cq, &buf), 1);
+  free(buf);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(coroutines, circular_queue_recv_slice) {
+  std::deque<std::coroutine_handle<>> ready;
+  circular_queue* cq = circular_queue_create(1, NULL);
+  ctcomm::async_queue<circular_queue, test_executor> q(cq,
+                                                       test_executor{&ready});
+  ctcomm_buffer* b = ctcomm_buffer_create(4);
+  REQUIRE(b != nullptr);
+
+  ctcomm::op_result r = {ctcom_unexpected_failure, nullptr};
+  receive_one(q, &r);
+
+  ctcomm_slice slice;
+  REQUIRE_EQ(ctcomm_slice_make(b, 0, 4, &slice), ctcom_success_threshold);
+  REQUIRE_EQ(circq_send_slice(cq, &slice), 4);
+  run_all(ready);
+
+  // Handed over rather than failed, the slice is ours to release.
+  REQUIRE_EQ(r.status, ctcom_wrong_msg_kind);
+  REQUIRE(r.buffer == b);
+  REQUIRE(r.req == nullptr);
+  REQUIRE_EQ(r.msg_size, 4u);
+  slice = {r.msg, r.msg_size, r.buffer};
+  ctcomm_slice_release(&slice);
+
+  ctcomm_buffer_release(b);
+  circular_queue_destroy(cq);
+}
+
+TEST(coroutines, dynamic_queue_recv) {
+  std::deque<std::coroutine_handle<>> ready;
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+  ctcomm::async_queue<dynamic_queue, test_executor> q(dq,
+                                                      test_executor{&ready});
+
+  ctcomm::op_result r = {ctcom_unexpected_failure, nullptr};
+  receive_one(q, &r);
+  REQUIRE(ready.empty());
+
+  ctcomm::op_result sent = {ctcom_unexpected_failure, nullptr};
+  send_one(q, malloc(1), &sent);
+  REQUIRE_EQ(sent.status, 1);
+  run_all(ready);
+  REQUIRE_EQ(r.status, 1);
+  free(r.msg);
+
+  dynamic_queue_destroy(dq);
+}
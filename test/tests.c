@@ -4,6 +4,8 @@
 #include <pthread.h>
 #include <assert.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include <tau/tau.h>
 TAU_MAIN()  // sets up Tau (+ main function)
@@ -138,6 +140,669 @@ TEST(circular_queues, create_and_destroy) {
   REQUIRE_EQ((void*)cq, NULL);
 }
 
+typedef struct counting_allocator_ctx {
+  int allocs;
+  int frees;
+} counting_allocator_ctx;
+
+void* counting_alloc(void* ctx, size_t size) {
+  ++((counting_allocator_ctx*)ctx)->allocs;
+  return malloc(size);
+}
+
+void* counting_realloc(void* ctx, void* ptr, size_t new_size) {
+  (void)ctx;
+  return realloc(ptr, new_size);
+}
+
+void counting_free(void* ctx, void* ptr) {
+  if (ptr) {
+    ++((counting_allocator_ctx*)ctx)->frees;
+  }
+  free(ptr);
+}
+
+TEST(circular_queues, custom_allocator) {
+  counting_allocator_ctx ctx = {0, 0};
+  ctcomm_allocator alloc = {counting_alloc, counting_realloc, counting_free,
+                            &ctx};
+  circq_opts opts = {.allocator = &alloc};
+
+  circular_queue* cq = circular_queue_create_with_opts(4, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+  REQUIRE_EQ(ctx.allocs, 2);  // The queue object and the msg_array.
+  circular_queue_destroy(cq);
+  REQUIRE_EQ(ctx.frees, 2);
+
+  // The default allocator is picked up at creation time.
+  REQUIRE_EQ(ctcomm_set_default_allocator(&alloc), ctcom_success_threshold);
+  cq = circular_queue_create(4, NULL);
+  REQUIRE_EQ(ctcomm_set_default_allocator(NULL), ctcom_success_threshold);
+  REQUIRE_EQ(ctx.allocs, 4);
+  circular_queue_destroy(cq);
+  REQUIRE_EQ(ctx.frees, 4);
+
+  char* err_str = NULL;
+  alloc.realloc = NULL;
+  REQUIRE_EQ(ctcomm_set_default_allocator(&alloc), ctcom_invalid_arguments);
+  cq = circular_queue_create_with_opts(4, &opts, &err_str);
+  REQUIRE_EQ((void*)cq, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+}
+
+TEST(circular_queues, mapped_msg_array) {
+  circq_opts opts = {.use_hugepages = true, .prefault = true};
+
+  circular_queue* cq = circular_queue_create_with_opts(1 << 18, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  for (uintptr_t i = 1; i <= (1 << 18); ++i) {
+    void* m = (void*)i;
+    REQUIRE_EQ(circq_try_send_zc(cq, &m, 1), 1);
+  }
+
+  for (uintptr_t i = 1; i <= (1 << 18); ++i) {
+    void* m = NULL;
+    REQUIRE_EQ(circq_try_recv_zc(cq, &m), 1);
+    REQUIRE_EQ((uintptr_t)m, i);
+  }
+
+  circular_queue_destroy(cq);
+
+  char* err_str = NULL;
+  opts.bind_to_numa_node = true;
+  opts.numa_node = -1;
+  cq = circular_queue_create_with_opts(16, &opts, &err_str);
+  REQUIRE_EQ((void*)cq, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+}
+
+TEST(circular_queues, elastic_msg_array) {
+  counting_allocator_ctx ctx = {0, 0};
+  ctcomm_allocator alloc = {counting_alloc, counting_realloc, counting_free,
+                            &ctx};
+  circq_opts opts = {.allocator = &alloc,
+                     .elastic = true,
+                     .initial_size = 3,  // Rounded up to 4
+                     .shrink_after = 8};
+
+  circular_queue* cq = circular_queue_create_with_opts(100, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+  REQUIRE_EQ(ctx.allocs, 2);
+
+  // Make the ring wrap before it grows, so that the copy has to unwrap.
+  uintptr_t next_to_send = 1;
+  uintptr_t next_to_recv = 1;
+  void* m = NULL;
+  for (int i = 0; i < 3; ++i) {
+    m = (void*)next_to_send++;
+    REQUIRE_EQ(circq_try_send_zc(cq, &m, 1), 1);
+  }
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE_EQ(circq_try_recv_zc(cq, &m), 1);
+    REQUIRE_EQ((uintptr_t)m, next_to_recv++);
+  }
+
+  while (next_to_send - next_to_recv < 100) {
+    m = (void*)next_to_send++;
+    REQUIRE_EQ(circq_try_send_zc(cq, &m, 1), 1);
+  }
+  REQUIRE_EQ(circq_msg_count(cq), 100);
+  // 4 -> 8 -> 16 -> 32 -> 64 -> 100
+  REQUIRE_EQ(ctx.allocs, 7);
+
+  // max_size backpressure is intact.
+  m = NULL;
+  REQUIRE_EQ(circq_try_send_zc(cq, &m, 0), ctcom_container_full);
+
+  while (next_to_recv < next_to_send) {
+    REQUIRE_EQ(circq_try_recv_zc(cq, &m), 1);
+    REQUIRE_EQ((uintptr_t)m, next_to_recv++);
+  }
+
+  // It should have shrunk back while draining.
+  REQUIRE_GT(ctx.allocs, 7);
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+
+  circular_queue_destroy(cq);
+  REQUIRE_EQ(ctx.allocs, ctx.frees);
+}
+
+void free_dropped_msg(void* msg, uint32_t msg_size, void* drop_ctx) {
+  (void)msg_size;
+  ++*(int*)drop_ctx;
+  free(msg);
+}
+
+TEST(circular_queues, overwrite_oldest) {
+  int dropped = 0;
+  circq_opts opts = {.overwrite_oldest = true,
+                     .drop_cb = free_dropped_msg,
+                     .drop_ctx = &dropped};
+
+  circular_queue* cq = circular_queue_create_with_opts(2, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  for (char c = 'A'; c <= 'E'; ++c) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = c;
+    // None of the send functions block or fail on a full lossy queue.
+    if (c % 3 == 0) {
+      REQUIRE_EQ(circq_send_zc(cq, (void**)&m, 1), 1);
+    } else if (c % 3 == 1) {
+      REQUIRE_EQ(circq_try_send_zc(cq, (void**)&m, 1), 1);
+    } else {
+      REQUIRE_EQ(circq_timed_send_zc(
+                     cq, (void**)&m, 1,
+                     &(struct timespec){.tv_sec = 1, .tv_nsec = 0}),
+                 1);
+    }
+    REQUIRE_EQ(m, NULL);
+  }
+
+  REQUIRE_EQ(dropped, 3);
+  REQUIRE_EQ(circq_dropped_count(cq), 3);
+  REQUIRE_EQ(circq_msg_count(cq), 2);
+
+  // Only the freshest two survived.
+  char* m = NULL;
+  REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'D');
+  free(m);
+  REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'E');
+  free(m);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(circular_queues, deadlines_on_monotonic_clock) {
+  circq_opts opts = {.monotonic_clock = true};
+  circular_queue* cq = circular_queue_create_with_opts(1, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 20 * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  char* m = NULL;
+  REQUIRE_EQ(circq_recv_until_zc(cq, (void**)&m, NULL),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_recv_until_zc(cq, (void**)&m, &deadline), ctcom_timedout);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  REQUIRE(now.tv_sec > deadline.tv_sec ||
+          (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec));
+
+  // The deadline has passed, so the calls only succeed if they don't
+  // have to wait.
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  REQUIRE_EQ(circq_send_until_zc(cq, (void**)&m1, 1, &deadline), 1);
+  REQUIRE_EQ(m1, NULL);
+
+  char* m2 = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(circq_send_until_zc(cq, (void**)&m2, 1, &deadline),
+             ctcom_timedout);
+  REQUIRE_NE(m2, NULL);
+  free(m2);
+
+  REQUIRE_EQ(circq_timed_send_zc(cq, (void**)&m2, 1,
+                                 &(struct timespec){.tv_nsec = 1000000}),
+             ctcom_timedout);
+
+  REQUIRE_EQ(circq_recv_until_zc(cq, (void**)&m, &deadline), 1);
+  REQUIRE_EQ(*m, 'A');
+  free(m);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(circular_queues, copy_mode) {
+  char* err_str = NULL;
+  circq_opts opts = {.copy_arena_size = 60, .overwrite_oldest = true};
+  REQUIRE_EQ((void*)circular_queue_create_with_opts(8, &opts, &err_str),
+             NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  // Rounded up to 64 bytes, i.e. four records of 16 bytes.
+  opts = (circq_opts){.copy_arena_size = 60};
+  circular_queue* cq = circular_queue_create_with_opts(8, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  char* m = NULL;
+  REQUIRE_EQ(circq_send_zc(cq, (void**)&m, 0), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_try_recv_zc(cq, (void**)&m), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_send_copy(cq, "too big", 57), ctcom_invalid_arguments);
+
+  char buf[8];
+  REQUIRE_EQ(circq_try_recv_copy(cq, buf, sizeof(buf)),
+             ctcom_container_empty);
+  for (int i = 0; i < 4; ++i) {
+    buf[0] = 'A' + i;
+    REQUIRE_EQ(circq_try_send_copy(cq, buf, 8), 8);
+  }
+  REQUIRE_EQ(circq_try_send_copy(cq, buf, 0), ctcom_container_full);
+  struct timespec timeout = {0, 10000000};
+  REQUIRE_EQ(circq_timed_send_copy(cq, buf, 1, &timeout), ctcom_timedout);
+
+  // Views are released out of order, the space only comes back once
+  // the oldest one is released.
+  const void* a = NULL;
+  const void* b = NULL;
+  REQUIRE_EQ(circq_recv_view(cq, &a), 8);
+  REQUIRE_EQ(circq_try_recv_view(cq, &b), 8);
+  REQUIRE_EQ(*(const char*)a, 'A');
+  REQUIRE_EQ(*(const char*)b, 'B');
+  REQUIRE_EQ(circq_release_view(cq, b), ctcom_success_threshold);
+  REQUIRE_EQ(circq_try_send_copy(cq, buf, 1), ctcom_container_full);
+
+  // Released already, inside a view, still queued, outside the arena.
+  REQUIRE_EQ(circq_release_view(cq, b), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_release_view(cq, (const char*)a + 1),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_release_view(cq, (const char*)b + 16),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_release_view(cq, buf), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_msg_count(cq), 2);
+
+  REQUIRE_EQ(circq_release_view(cq, a), ctcom_success_threshold);
+  REQUIRE_EQ(circq_release_view(cq, a), ctcom_invalid_arguments);
+
+  // Those two wrap around.
+  REQUIRE_EQ(circq_try_send_copy(cq, "E", 1), 1);
+  REQUIRE_EQ(circq_try_send_copy(cq, "F", 1), 1);
+
+  char small[4];
+  REQUIRE_EQ(circq_recv_copy(cq, small, sizeof(small)),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_recv_copy(cq, buf, sizeof(buf)), 8);
+  REQUIRE_EQ(buf[0], 'C');
+  REQUIRE_EQ(circq_timed_recv_copy(cq, buf, sizeof(buf), &timeout), 8);
+  REQUIRE_EQ(buf[0], 'D');
+  REQUIRE_EQ(circq_recv_copy(cq, small, sizeof(small)), 1);
+  REQUIRE_EQ(small[0], 'E');
+  REQUIRE_EQ(circq_timed_recv_view(cq, &a, &timeout), 1);
+  REQUIRE_EQ(*(const char*)a, 'F');
+  REQUIRE_EQ(circq_release_view(cq, a), ctcom_success_threshold);
+  REQUIRE_EQ(circq_timed_recv_view(cq, &a, &timeout), ctcom_timedout);
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+
+  circular_queue_destroy(cq);
+}
+
+void* copy_sender_thread(void* arg) {
+  circular_queue* cq = (circular_queue*)arg;
+  char buf[100];
+
+  for (int i = 0; i < 10000; ++i) {
+    uint32_t len = i % 100;
+    memset(buf, i, len);
+    assert(circq_send_copy(cq, buf, len) == (int)len);
+  }
+
+  return NULL;
+}
+
+TEST(circular_queues, copy_mode_threads) {
+  circq_opts opts = {.copy_arena_size = 512};
+  circular_queue* cq = circular_queue_create_with_opts(64, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, copy_sender_thread, cq);
+
+  char buf[100];
+  for (int i = 0; i < 10000; ++i) {
+    int len = i % 100;
+    if (i % 2) {
+      REQUIRE_EQ(circq_recv_copy(cq, buf, sizeof(buf)), len);
+      if (len > 0) {
+        REQUIRE_EQ(buf[len - 1], (char)i);
+      }
+    } else {
+      const void* view = NULL;
+      REQUIRE_EQ(circq_recv_view(cq, &view), len);
+      if (len > 0) {
+        REQUIRE_EQ(((const char*)view)[0], (char)i);
+      }
+      circq_release_view(cq, view);
+    }
+  }
+
+  pthread_join(tid, NULL);
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+  circular_queue_destroy(cq);
+}
+
+// Fails every allocation once 'remaining' reaches 0, -1 means never.
+void* failing_alloc(void* ctx, size_t size) {
+  int* remaining = (int*)ctx;
+  if (*remaining == 0) {
+    return NULL;
+  }
+  if (*remaining > 0) {
+    --*remaining;
+  }
+  return malloc(size);
+}
+
+void* failing_realloc(void* ctx, void* ptr, size_t new_size) {
+  (void)ctx;
+  return realloc(ptr, new_size);
+}
+
+void failing_free(void* ctx, void* ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+TEST(circular_queues, loaning) {
+  char* err_str = NULL;
+  circq_opts opts = {.loan_slot_size = 20, .copy_arena_size = 64};
+  REQUIRE_EQ((void*)circular_queue_create_with_opts(2, &opts, &err_str),
+             NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  opts = (circq_opts){.loan_slot_size = 20};
+  circular_queue* cq = circular_queue_create_with_opts(2, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  void* m = NULL;
+  REQUIRE_EQ(circq_send_zc(cq, &m, 0), ctcom_invalid_arguments);
+
+  // Rounded up to 32 bytes.
+  void* a = NULL;
+  void* b = NULL;
+  void* c = NULL;
+  REQUIRE_EQ(circq_loan(cq, &a), 32);
+  REQUIRE_EQ(circq_try_loan(cq, &b), 32);
+  REQUIRE_NE(a, b);
+  REQUIRE_EQ(circq_try_loan(cq, &c), ctcom_container_full);
+  struct timespec timeout = {0, 10000000};
+  REQUIRE_EQ(circq_timed_loan(cq, &c, &timeout), ctcom_timedout);
+
+  REQUIRE_EQ(circq_commit_loan(cq, (char*)a + 1, 1), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_commit_loan(cq, a, 33), ctcom_invalid_arguments);
+  strcpy((char*)a, "in place");
+  REQUIRE_EQ(circq_commit_loan(cq, a, 9), 9);
+  // Queued already, neither committed nor released again.
+  REQUIRE_EQ(circq_commit_loan(cq, a, 9), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_release_view(cq, a), ctcom_invalid_arguments);
+
+  // Giving back a slot which won't be committed.
+  REQUIRE_EQ(circq_release_view(cq, b), ctcom_success_threshold);
+  REQUIRE_EQ(circq_release_view(cq, b), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_commit_loan(cq, b, 1), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_timed_loan(cq, &c, &timeout), 32);
+  REQUIRE_EQ(c, b);
+  REQUIRE_EQ(circq_commit_loan(cq, c, 0), 0);
+
+  const void* view = NULL;
+  REQUIRE_EQ(circq_recv_view(cq, &view), 9);
+  REQUIRE_EQ((void*)view, a);
+  REQUIRE_EQ(strcmp((const char*)view, "in place"), 0);
+  REQUIRE_EQ(circq_try_loan(cq, &b), ctcom_container_full);
+  REQUIRE_EQ(circq_release_view(cq, view), ctcom_success_threshold);
+  REQUIRE_EQ(circq_release_view(cq, view), ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_try_loan(cq, &b), 32);
+  REQUIRE_EQ(b, a);
+  REQUIRE_EQ(circq_release_view(cq, b), ctcom_success_threshold);
+
+  char buf[32];
+  REQUIRE_EQ(circq_recv_copy(cq, buf, sizeof(buf)), 0);
+  REQUIRE_EQ(circq_try_recv_view(cq, &view), ctcom_container_empty);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(circular_queues, loaning_out_of_memory) {
+  int remaining = -1;
+  ctcomm_allocator alloc = {failing_alloc, failing_realloc, failing_free,
+                            &remaining};
+  circq_opts opts = {.allocator = &alloc,
+                     .loan_slot_size = 16,
+                     .elastic = true,
+                     .initial_size = 2};
+  circular_queue* cq = circular_queue_create_with_opts(8, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  void* slots[3];
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(circq_loan(cq, &slots[i]), 16);
+    *(int*)slots[i] = i;
+  }
+  REQUIRE_EQ(circq_commit_loan(cq, slots[0], sizeof(int)), sizeof(int));
+  REQUIRE_EQ(circq_commit_loan(cq, slots[1], sizeof(int)), sizeof(int));
+
+  // The ring can't grow, the slot stays loaned.
+  remaining = 0;
+  REQUIRE_EQ(circq_commit_loan(cq, slots[2], sizeof(int)),
+             ctcom_not_enough_memory);
+  REQUIRE_EQ(circq_msg_count(cq), 2);
+
+  remaining = -1;
+  REQUIRE_EQ(circq_commit_loan(cq, slots[2], sizeof(int)), sizeof(int));
+  for (int i = 0; i < 3; ++i) {
+    const void* view = NULL;
+    REQUIRE_EQ(circq_recv_view(cq, &view), sizeof(int));
+    REQUIRE_EQ(*(const int*)view, i);
+    REQUIRE_EQ(circq_release_view(cq, view), ctcom_success_threshold);
+  }
+
+  circular_queue_destroy(cq);
+}
+
+void* loaning_sender_thread(void* arg) {
+  circular_queue* cq = (circular_queue*)arg;
+
+  for (int i = 0; i < 10000; ++i) {
+    void* slot = NULL;
+    assert(circq_loan(cq, &slot) == 16);
+    *(int*)slot = i;
+    assert(circq_commit_loan(cq, slot, sizeof(int)) == sizeof(int));
+  }
+
+  return NULL;
+}
+
+TEST(circular_queues, loaning_threads) {
+  circq_opts opts = {.loan_slot_size = sizeof(int)};
+  circular_queue* cq = circular_queue_create_with_opts(4, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, loaning_sender_thread, cq);
+
+  for (int i = 0; i < 10000; ++i) {
+    const void* view = NULL;
+    REQUIRE_EQ(circq_recv_view(cq, &view), (int)sizeof(int));
+    REQUIRE_EQ(*(const int*)view, i);
+    circq_release_view(cq, view);
+  }
+
+  pthread_join(tid, NULL);
+  circular_queue_destroy(cq);
+}
+
+void count_buffer_free(void* data, void* ctx) {
+  free(data);
+  ++*(int*)ctx;
+}
+
+TEST(circular_queues, slices) {
+  int freed = 0;
+  char* block = (char*)malloc(1000);
+  for (int i = 0; i < 1000; ++i) {
+    block[i] = i / 100;
+  }
+  ctcomm_buffer* b = ctcomm_buffer_wrap(block, 1000, count_buffer_free, &freed);
+  REQUIRE_NE((void*)b, NULL);
+  REQUIRE_EQ(ctcomm_buffer_data(b), (void*)block);
+  REQUIRE_EQ(ctcomm_buffer_size(b), (size_t)1000);
+
+  circq_opts opts = {.overwrite_oldest = true};
+  circular_queue* cq = circular_queue_create_with_opts(8, &opts, NULL);
+
+  ctcomm_slice slice;
+  REQUIRE_EQ(ctcomm_slice_make(b, 950, 100, &slice), ctcom_invalid_arguments);
+  // Ten records, the first two get evicted.
+  for (int i = 0; i < 10; ++i) {
+    REQUIRE_EQ(ctcomm_slice_make(b, i * 100, 100, &slice),
+               ctcom_success_threshold);
+    REQUIRE_EQ(circq_send_slice(cq, &slice), 100);
+    REQUIRE_EQ((void*)slice.buffer, NULL);
+  }
+  REQUIRE_EQ(circq_dropped_count(cq), (uint64_t)2);
+
+  // The queue holds the only references from now on.
+  ctcomm_buffer_release(b);
+  REQUIRE_EQ(freed, 0);
+
+  void* m = NULL;
+  REQUIRE_EQ(circq_try_recv_zc(cq, &m), ctcom_wrong_msg_kind);
+  REQUIRE_EQ(circq_msg_count(cq), 8);
+
+  for (int i = 2; i < 10; ++i) {
+    REQUIRE_EQ(circq_recv_slice(cq, &slice), 100);
+    REQUIRE_EQ(((char*)slice.data)[0], i);
+    REQUIRE_EQ(((char*)slice.data)[99], i);
+    ctcomm_slice_release(&slice);
+    REQUIRE_EQ(freed, i == 9 ? 1 : 0);
+  }
+
+  // Ordinary messages come without a buffer.
+  m = malloc(4);
+  REQUIRE_EQ(circq_send_zc(cq, &m, 4), 4);
+  REQUIRE_EQ(circq_try_recv_slice(cq, &slice), 4);
+  REQUIRE_EQ((void*)slice.buffer, NULL);
+  ctcomm_slice_release(&slice);
+  struct timespec timeout = {0, 1000000};
+  REQUIRE_EQ(circq_timed_recv_slice(cq, &slice, &timeout), ctcom_timedout);
+
+  circular_queue_destroy(cq);
+}
+
+void* slice_receiver_thread(void* arg) {
+  channel* ch = (channel*)arg;
+  ctcomm_slice slice;
+
+  for (int i = 0; i < 1000; ++i) {
+    assert(chan_recv_slice(ch, &slice) == 64);
+    assert(*(int*)slice.data == i);
+    ctcomm_slice_release(&slice);
+  }
+
+  return NULL;
+}
+
+TEST(channels, slices) {
+  channel* ch = channel_create(16, NULL);
+  ctcomm_buffer* b = ctcomm_buffer_create(64 * 1000);
+  REQUIRE_NE((void*)b, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, slice_receiver_thread, ch);
+
+  for (int i = 0; i < 1000; ++i) {
+    *(int*)((char*)ctcomm_buffer_data(b) + i * 64) = i;
+    ctcomm_slice slice;
+    REQUIRE_EQ(ctcomm_slice_make(b, i * 64, 64, &slice),
+               ctcom_success_threshold);
+    REQUIRE_EQ(chan_send_slice(ch, &slice), 64);
+  }
+  ctcomm_buffer_release(b);
+
+  pthread_join(tid, NULL);
+  channel_destroy(ch);
+}
+
+void* timed_slice_receiver_thread(void* arg) {
+  channel* ch = (channel*)arg;
+  struct timespec timeout = {1, 0};
+  ctcomm_slice slice;
+
+  assert(chan_timed_recv_slice(ch, &slice, &timeout) == 4);
+  assert(slice.buffer != NULL);
+  assert(*(char*)slice.data == 'A');
+  ctcomm_slice_release(&slice);
+
+  timeout.tv_sec = 0;
+  timeout.tv_nsec = 1000000;
+  assert(chan_timed_recv_slice(ch, &slice, &timeout) == ctcom_timedout);
+
+  return NULL;
+}
+
+TEST(channels, timed_slices) {
+  channel* ch = channel_create(1, NULL);
+  ctcomm_buffer* b = ctcomm_buffer_create(8);
+  REQUIRE_NE((void*)b, NULL);
+  *(char*)ctcomm_buffer_data(b) = 'A';
+  struct timespec timeout = {0, 1000000};
+
+  // Nothing has been sent to the owner.
+  ctcomm_slice slice;
+  REQUIRE_EQ(chan_timed_recv_slice(ch, &slice, &timeout), ctcom_timedout);
+
+  REQUIRE_EQ(ctcomm_slice_make(b, 0, 4, &slice), ctcom_success_threshold);
+  REQUIRE_EQ(chan_timed_send_slice(ch, &slice, &timeout), 4);
+  REQUIRE_EQ((void*)slice.buffer, NULL);
+
+  // The queue is full, a slice which wasn't sent is still the caller's.
+  REQUIRE_EQ(ctcomm_slice_make(b, 4, 4, &slice), ctcom_success_threshold);
+  REQUIRE_EQ(chan_timed_send_slice(ch, &slice, &timeout), ctcom_timedout);
+  REQUIRE_EQ((void*)slice.buffer, (void*)b);
+  REQUIRE_EQ(chan_timed_send_slice(ch, &slice, NULL),
+             ctcom_invalid_arguments);
+  ctcomm_slice_release(&slice);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, timed_slice_receiver_thread, ch);
+  pthread_join(tid, NULL);
+
+  ctcomm_buffer_release(b);
+  channel_destroy(ch);
+}
+
+TEST(circular_queues, lifo) {
+  circq_opts opts = {.lifo = true, .elastic = true, .initial_size = 2};
+  circular_queue* cq = circular_queue_create_with_opts(16, &opts, NULL);
+  REQUIRE_NE((void*)cq, NULL);
+
+  // Wrapping around, and growing in between.
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 5; ++i) {
+      char* m = (char*)malloc(sizeof(char));
+      *m = 'A' + i;
+      REQUIRE_EQ(circq_send_zc(cq, (void**)&m, 1), 1);
+    }
+    char* m = NULL;
+    REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'E');
+    free(m);
+    REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'D');
+    free(m);
+  }
+
+  // What's left came in as A B C three times.
+  for (int i = 0; i < 9; ++i) {
+    char* m = NULL;
+    REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'C' - i % 3);
+    free(m);
+  }
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+
+  circular_queue_destroy(cq);
+}
+
 TEST(circular_queues, basic_send_and_receive) {
   circular_queue* cq = circular_queue_create(1, NULL);
 
@@ -288,6 +953,75 @@ TEST(circular_queues, timed_send_and_timed_receive) {
   circular_queue_destroy(cq);
 }
 
+void* batch_sender_thread(void* args) {
+  circular_queue* cq = (circular_queue*)args;
+
+  for (int i = 0; i < 4; ++i) {
+    usleep(5000);
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    assert(circq_send_zc(cq, (void**)&m, 1) == 1);
+  }
+
+  return NULL;
+}
+
+TEST(circular_queues, recv_batch_min) {
+  circular_queue* cq = circular_queue_create(8, NULL);
+
+  void* bufs[8];
+  uint32_t sizes[8];
+  struct timespec linger = {.tv_sec = 5, .tv_nsec = 0};
+
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, sizes, 0, 8, &linger),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, sizes, 4, 2, &linger),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, sizes, 9, 9, &linger),
+             ctcom_invalid_arguments);
+
+  // Returns as soon as the 4th message arrives, long before the linger
+  // period is over.
+  pthread_t tid;
+  pthread_create(&tid, NULL, batch_sender_thread, cq);
+
+  struct timespec before;
+  struct timespec after;
+  getWallTime(before);
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, sizes, 4, 8, &linger), 4);
+  getWallTime(after);
+  REQUIRE_LT(diffTimeUSec(before, after), 1000000);
+  pthread_join(tid, NULL);
+
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE_EQ(sizes[i], 1);
+    REQUIRE_EQ(*(char*)bufs[i], 'A' + i);
+    free(bufs[i]);
+  }
+
+  // Not enough messages, the linger period decides.
+  for (int i = 0; i < 3; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    REQUIRE_EQ(circq_send_zc(cq, (void**)&m, 1), 1);
+  }
+
+  linger.tv_sec = 0;
+  linger.tv_nsec = 20000000;
+  getWallTime(before);
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, NULL, 4, 2, &linger),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(circq_recv_batch_min(cq, bufs, NULL, 4, 8, &linger), 3);
+  getWallTime(after);
+  REQUIRE_GE(diffTimeUSec(before, after), 20000);
+
+  for (int i = 0; i < 3; ++i) {
+    free(bufs[i]);
+  }
+
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+  circular_queue_destroy(cq);
+}
+
 TEST(circular_queues, enable_disable_sending) {
   circular_queue* cq = circular_queue_create(1, NULL);
 
@@ -370,21 +1104,142 @@ TEST(circular_queues, send_and_receive_thread) {
   circular_queue_destroy(cq);
 }
 
-// DYNAMIC_QUEUE TESTS
+void count_notifications(ctcomm_waiter* w) { ++*(int*)w->ctx; }
+
+TEST(circular_queues, recv_waiters_get_slices) {
+  circular_queue* cq = circular_queue_create(4, NULL);
+  ctcomm_buffer* b = ctcomm_buffer_create(8);
+  REQUIRE_NE((void*)b, NULL);
+
+  int notified = 0;
+  ctcomm_waiter w1 = {.notify = count_notifications, .ctx = &notified};
+  ctcomm_waiter w2 = {.notify = count_notifications, .ctx = &notified};
+  void* m = NULL;
+  REQUIRE_EQ(circq_recv_or_wait(cq, &m, &w1), ctcom_container_empty);
+  REQUIRE_EQ(circq_recv_or_wait(cq, &m, &w2), ctcom_container_empty);
+
+  // Only one waiter gets the slice, along with its buffer.
+  ctcomm_slice slice;
+  REQUIRE_EQ(ctcomm_slice_make(b, 2, 4, &slice), ctcom_success_threshold);
+  REQUIRE_EQ(circq_send_slice(cq, &slice), 4);
+  REQUIRE_EQ(notified, 1);
+  REQUIRE_EQ(w1.result, ctcom_wrong_msg_kind);
+  REQUIRE_EQ(w1.msg, (char*)ctcomm_buffer_data(b) + 2);
+  REQUIRE_EQ(w1.msg_size, 4);
+  REQUIRE_EQ((void*)w1.buffer, (void*)b);
+  REQUIRE_EQ((void*)w1.req, NULL);
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+  slice = (ctcomm_slice){w1.msg, w1.msg_size, w1.buffer};
+  ctcomm_slice_release(&slice);
+
+  // The other one is still armed for a plain message.
+  m = malloc(1);
+  REQUIRE_EQ(circq_send_zc(cq, &m, 1), 1);
+  REQUIRE_EQ(notified, 2);
+  REQUIRE_EQ(w2.result, 1);
+  REQUIRE_EQ((void*)w2.buffer, NULL);
+  free(w2.msg);
+
+  ctcomm_buffer_release(b);
+  circular_queue_destroy(cq);
+}
 
-TEST(dynamic_queues, create_and_destroy) {
-  char* err_str = "";
+TEST(circular_queues, recv_and_send_waiters) {
+  circular_queue* cq = circular_queue_create(1, NULL);
 
-  dynamic_queue* dq = dynamic_queue_create(&err_str);
-  REQUIRE_NE((void*)dq, NULL);
-  REQUIRE_EQ((void*)err_str, NULL);
+  int notified = 0;
+  ctcomm_waiter w = {.notify = count_notifications, .ctx = &notified};
 
-  dynamic_queue_destroy(dq);
-  REQUIRE_EQ((void*)dq, NULL);
-}
+  char* m = NULL;
+  REQUIRE_EQ(circq_recv_or_wait(cq, (void**)&m, &w), ctcom_container_empty);
+  REQUIRE_EQ(notified, 0);
 
-TEST(dynamic_queues, basic_send_and_receive) {
-  dynamic_queue* dq = dynamic_queue_create(NULL);
+  // The message goes straight to the armed waiter.
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  REQUIRE_EQ(circq_send_zc(cq, (void**)&m1, 1), 1);
+  REQUIRE_EQ(m1, NULL);
+  REQUIRE_EQ(notified, 1);
+  REQUIRE_EQ(w.result, 1);
+  REQUIRE_EQ(*(char*)w.msg, 'A');
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+  free(w.msg);
+
+  // Fill the queue, then arm a send waiter.
+  m1 = (char*)malloc(sizeof(char));
+  *m1 = 'B';
+  REQUIRE_EQ(circq_send_or_wait(cq, (void**)&m1, 1, &w), 1);
+  m1 = (char*)malloc(sizeof(char));
+  *m1 = 'C';
+  REQUIRE_EQ(circq_send_or_wait(cq, (void**)&m1, 1, &w),
+             ctcom_container_full);
+  REQUIRE_EQ(m1, NULL);
+  REQUIRE_EQ(notified, 1);
+
+  REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'B');
+  free(m);
+  REQUIRE_EQ(notified, 2);
+  REQUIRE_EQ(w.result, 1);
+  REQUIRE_EQ(circq_msg_count(cq), 1);
+
+  // Cancelled waiters are not notified, disabled queues fail send waiters.
+  ctcomm_waiter w2 = {.notify = count_notifications, .ctx = &notified};
+  m1 = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(circq_send_or_wait(cq, (void**)&m1, 1, &w2),
+             ctcom_container_full);
+  REQUIRE(circq_cancel_wait(cq, &w2));
+  REQUIRE(!circq_cancel_wait(cq, &w2));
+  REQUIRE_EQ(circq_send_or_wait(cq, &w2.msg, 1, &w), ctcom_container_full);
+  circq_disable_sending(cq);
+  REQUIRE_EQ(notified, 3);
+  REQUIRE_EQ(w.result, ctcom_writing_disabled);
+  REQUIRE_NE(w.msg, NULL);
+  free(w.msg);
+
+  REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'C');
+  free(m);
+
+  circular_queue_destroy(cq);
+}
+
+// DYNAMIC_QUEUE TESTS
+
+TEST(dynamic_queues, create_and_destroy) {
+  char* err_str = "";
+
+  dynamic_queue* dq = dynamic_queue_create(&err_str);
+  REQUIRE_NE((void*)dq, NULL);
+  REQUIRE_EQ((void*)err_str, NULL);
+
+  dynamic_queue_destroy(dq);
+  REQUIRE_EQ((void*)dq, NULL);
+}
+
+TEST(dynamic_queues, custom_allocator) {
+  counting_allocator_ctx ctx = {0, 0};
+  ctcomm_allocator alloc = {counting_alloc, counting_realloc, counting_free,
+                            &ctx};
+  dynmq_opts opts = {.allocator = &alloc};
+
+  dynamic_queue* dq = dynamic_queue_create_with_opts(&opts, NULL);
+  REQUIRE_NE((void*)dq, NULL);
+
+  char* m = NULL;
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 0), ctcom_success_threshold);
+  }
+  REQUIRE_EQ(ctx.allocs, 4);  // The queue object plus one node per message.
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), ctcom_success_threshold);
+  REQUIRE_EQ(ctx.frees, 1);
+
+  dynamic_queue_destroy(dq);
+  REQUIRE_EQ(ctx.frees, 4);
+}
+
+TEST(dynamic_queues, basic_send_and_receive) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
 
   char* m1 = (char*)malloc(16 * sizeof(char));
   m1[0] = 'A';
@@ -591,6 +1446,590 @@ TEST(dynamic_queues, send_and_receive_thread) {
   dynamic_queue_destroy(dq);
 }
 
+TEST(dynamic_queues, recv_waiters) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+
+  int notified = 0;
+  ctcomm_waiter w = {.notify = count_notifications, .ctx = &notified};
+
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_recv_or_wait(dq, (void**)&m, &w), ctcom_container_empty);
+
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m1, 1), 1);
+  REQUIRE_EQ(notified, 1);
+  REQUIRE_EQ(w.result, 1);
+  REQUIRE_EQ(*(char*)w.msg, 'A');
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+  free(w.msg);
+
+  REQUIRE_EQ(dynmq_recv_or_wait(dq, (void**)&m, &w), ctcom_container_empty);
+  REQUIRE(dynmq_cancel_wait(dq, &w));
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 0), ctcom_success_threshold);
+  REQUIRE_EQ(notified, 1);
+  REQUIRE_EQ(dynmq_recv_or_wait(dq, (void**)&m, &w), ctcom_success_threshold);
+
+  dynamic_queue_destroy(dq);
+}
+
+TEST(dynamic_queues, deadlines_on_monotonic_clock) {
+  dynmq_opts opts = {.monotonic_clock = true};
+  dynamic_queue* dq = dynamic_queue_create_with_opts(&opts, NULL);
+  REQUIRE_NE((void*)dq, NULL);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_recv_until_zc(dq, (void**)&m, &deadline), ctcom_timedout);
+  REQUIRE_EQ(dynmq_timed_recv_zc(dq, (void**)&m,
+                                 &(struct timespec){.tv_nsec = 1000000}),
+             ctcom_timedout);
+
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m1, 1), 1);
+  REQUIRE_EQ(dynmq_recv_until_zc(dq, (void**)&m, &deadline), 1);
+  REQUIRE_EQ(*m, 'A');
+  free(m);
+
+  dynamic_queue_destroy(dq);
+}
+
+TEST(dynamic_queues, recv_batch_min) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+
+  for (int i = 0; i < 5; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 1), 1);
+  }
+
+  // Enough messages, no lingering and no more than max_count.
+  void* bufs[4];
+  uint32_t sizes[4];
+  struct timespec linger = {.tv_sec = 5, .tv_nsec = 0};
+  REQUIRE_EQ(dynmq_recv_batch_min(dq, bufs, sizes, 2, 3, &linger), 3);
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(sizes[i], 1);
+    REQUIRE_EQ(*(char*)bufs[i], 'A' + i);
+    free(bufs[i]);
+  }
+
+  linger.tv_sec = 0;
+  linger.tv_nsec = 10000000;
+  REQUIRE_EQ(dynmq_recv_batch_min(dq, bufs, sizes, 4, 4, &linger), 2);
+  REQUIRE_EQ(*(char*)bufs[0], 'D');
+  REQUIRE_EQ(*(char*)bufs[1], 'E');
+  free(bufs[0]);
+  free(bufs[1]);
+
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+  dynamic_queue_destroy(dq);
+}
+
+TEST(dynamic_queues, recv_all_and_send_chain) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+
+  dynmq_chain chain;
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_recv_all(dq, &chain), 0);
+  REQUIRE_EQ(dynmq_chain_pop(&chain, (void**)&m), ctcom_container_empty);
+
+  REQUIRE_EQ(dynmq_chain_init(&chain, dq), ctcom_success_threshold);
+  for (int i = 0; i < 4; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    REQUIRE_EQ(dynmq_chain_push(&chain, (void**)&m, 1), 1);
+    REQUIRE_EQ(m, NULL);
+  }
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  // An armed receive waiter gets the first message, the rest is spliced.
+  int notified = 0;
+  ctcomm_waiter w = {.notify = count_notifications, .ctx = &notified};
+  REQUIRE_EQ(dynmq_recv_or_wait(dq, (void**)&m, &w), ctcom_container_empty);
+
+  REQUIRE_EQ(dynmq_send_chain(dq, &chain), 4);
+  REQUIRE_EQ(chain.count, 0);
+  REQUIRE_EQ(notified, 1);
+  REQUIRE_EQ(*(char*)w.msg, 'A');
+  free(w.msg);
+  REQUIRE_EQ(dynmq_msg_count(dq), 3);
+
+  m = (char*)malloc(sizeof(char));
+  *m = 'E';
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 1), 1);
+
+  REQUIRE_EQ(dynmq_recv_all(dq, &chain), 4);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  for (int i = 1; i < 5; ++i) {
+    REQUIRE_EQ(dynmq_chain_pop(&chain, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'A' + i);
+    free(m);
+  }
+  REQUIRE_EQ(dynmq_chain_pop(&chain, (void**)&m), ctcom_container_empty);
+
+  // The queue remains usable.
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 1), 1);
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  free(m);
+
+  dynamic_queue_destroy(dq);
+}
+
+TEST(dynamic_queues, cancel_and_requeue_front) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+
+  dynmq_handle* handles[4];
+  for (int i = 0; i < 4; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    REQUIRE_EQ(dynmq_send_with_handle_zc(dq, (void**)&m, 1, &handles[i]), 1);
+    REQUIRE_EQ(m, NULL);
+  }
+
+  // Cancelling from the middle, the head and the tail.
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_cancel(dq, handles[1], (void**)&m), 1);
+  REQUIRE_EQ(*m, 'B');
+  free(m);
+  REQUIRE_EQ(dynmq_cancel(dq, handles[1], (void**)&m),
+             ctcom_container_empty);
+  REQUIRE_EQ(dynmq_requeue_front(dq, handles[1]), ctcom_container_empty);
+  REQUIRE_EQ(dynmq_msg_count(dq), 3);
+
+  REQUIRE_EQ(dynmq_requeue_front(dq, handles[3]), ctcom_success_threshold);
+  REQUIRE_EQ(dynmq_cancel(dq, handles[0], (void**)&m), 1);
+  REQUIRE_EQ(*m, 'A');
+  free(m);
+
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'D');
+  free(m);
+  REQUIRE_EQ(dynmq_cancel(dq, handles[3], (void**)&m),
+             ctcom_container_empty);
+
+  // Received messages release their node along with the handle, and
+  // handles released early let the queue free the node.
+  dynmq_handle_release(dq, handles[3]);
+  dynmq_handle_release(dq, handles[2]);
+  dynmq_handle_release(dq, handles[1]);
+  dynmq_handle_release(dq, handles[0]);
+
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'C');
+  free(m);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  // Off the queue, off limits.
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_send_with_handle_zc(dq, (void**)&m, 1, &handles[0]), 1);
+  dynmq_chain chain;
+  REQUIRE_EQ(dynmq_recv_all(dq, &chain), 1);
+  REQUIRE_EQ(dynmq_cancel(dq, handles[0], (void**)&m),
+             ctcom_container_empty);
+  dynmq_handle_release(dq, handles[0]);
+  REQUIRE_EQ(dynmq_chain_pop(&chain, (void**)&m), 1);
+  free(m);
+
+  dynamic_queue_destroy(dq);
+}
+
+void* tagged_sender_thread(void* args) {
+  dynamic_queue* dq = (dynamic_queue*)args;
+  usleep(10000);
+
+  char* m = (char*)malloc(sizeof(char));
+  *m = 'X';
+  assert(dynmq_send_tagged_zc(dq, 8, (void**)&m, 1) == 1);
+  m = (char*)malloc(sizeof(char));
+  *m = 'Y';
+  assert(dynmq_send_tagged_zc(dq, 7, (void**)&m, 1) == 1);
+
+  return NULL;
+}
+
+TEST(dynamic_queues, selective_receive) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+
+  const uint64_t tags[] = {1, 0, 2, 1, 1};
+  for (int i = 0; i < 5; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    if (tags[i]) {
+      REQUIRE_EQ(dynmq_send_tagged_zc(dq, tags[i], (void**)&m, 1), 1);
+    } else {
+      REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 1), 1);
+    }
+  }
+
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 3, (void**)&m),
+             ctcom_container_empty);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 1, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'A');
+  free(m);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 2, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'C');
+  free(m);
+
+  // The untagged receivers still see the rest in FIFO order, and the
+  // tag index keeps up with them.
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'B');
+  free(m);
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'D');
+  free(m);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 1, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'E');
+  free(m);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  // Blocked tagged receivers only return with a matching message.
+  pthread_t tid;
+  pthread_create(&tid, NULL, tagged_sender_thread, dq);
+  REQUIRE_EQ(dynmq_recv_tagged_zc(dq, 7, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'Y');
+  free(m);
+  pthread_join(tid, NULL);
+
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'X');
+  free(m);
+
+  // Draining the queue drops the tag index as well.
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_send_tagged_zc(dq, 5, (void**)&m, 1), 1);
+  dynmq_chain chain;
+  REQUIRE_EQ(dynmq_recv_all(dq, &chain), 1);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 5, (void**)&m),
+             ctcom_container_empty);
+  REQUIRE_EQ(dynmq_send_chain(dq, &chain), 1);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 5, (void**)&m),
+             ctcom_container_empty);
+
+  // Only the ones sent afterwards are tagged again.
+  m = (char*)malloc(sizeof(char));
+  *m = 'N';
+  REQUIRE_EQ(dynmq_send_tagged_zc(dq, 5, (void**)&m, 1), 1);
+  REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 5, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'N');
+  free(m);
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  free(m);
+
+  // Moving a message in front of the tagged ones keeps their order.
+  for (int i = 0; i < 2; ++i) {
+    m = (char*)malloc(sizeof(char));
+    *m = 'P' + i;
+    REQUIRE_EQ(dynmq_send_tagged_zc(dq, 6, (void**)&m, 1), 1);
+  }
+  dynmq_handle* handle = NULL;
+  m = (char*)malloc(sizeof(char));
+  *m = 'H';
+  REQUIRE_EQ(dynmq_send_with_handle_zc(dq, (void**)&m, 1, &handle), 1);
+  REQUIRE_EQ(dynmq_requeue_front(dq, handle), ctcom_success_threshold);
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE_EQ(dynmq_try_recv_tagged_zc(dq, 6, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'P' + i);
+    free(m);
+  }
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+  REQUIRE_EQ(*m, 'H');
+  free(m);
+  dynmq_handle_release(dq, handle);
+
+  dynamic_queue_destroy(dq);
+}
+
+TEST(dynamic_queues, lifo) {
+  dynmq_opts opts = {.lifo = true};
+  dynamic_queue* dq = dynamic_queue_create_with_opts(&opts, NULL);
+
+  dynmq_handle* handle = NULL;
+  for (int i = 0; i < 4; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    if (i == 1) {
+      REQUIRE_EQ(dynmq_send_with_handle_zc(dq, (void**)&m, 1, &handle), 1);
+    } else {
+      REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 1), 1);
+    }
+  }
+
+  // The front of a LIFO queue is its tail.
+  REQUIRE_EQ(dynmq_requeue_front(dq, handle), ctcom_success_threshold);
+  dynmq_handle_release(dq, handle);
+
+  const char expected[] = "BDCA";
+  for (int i = 0; i < 4; ++i) {
+    char* m = NULL;
+    REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+    REQUIRE_EQ(*m, expected[i]);
+    free(m);
+  }
+
+  dynamic_queue_destroy(dq);
+}
+
+int count_dir_entries(const char* path) {
+  int count = 0;
+  DIR* dir = opendir(path);
+  for (struct dirent* e = readdir(dir); e; e = readdir(dir)) {
+    if (e->d_name[0] != '.') {
+      ++count;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+TEST(dynamic_queues, spill_to_disk) {
+  char spill_dir[] = "/tmp/ctcomm-spill-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(spill_dir), NULL);
+
+  char* err_str = NULL;
+  dynmq_opts opts = {.spill_dir = spill_dir, .lifo = true};
+  REQUIRE_EQ((void*)dynamic_queue_create_with_opts(&opts, &err_str), NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  opts = (dynmq_opts){.spill_dir = spill_dir,
+                      .spill_budget = 64,
+                      .spill_segment_size = 256};
+  dynamic_queue* dq = dynamic_queue_create_with_opts(&opts, NULL);
+  REQUIRE_NE((void*)dq, NULL);
+
+  // Four of them fit into the budget, the rest goes to disk, including
+  // one which doesn't fit into a segment.
+  for (int i = 0; i < 50; ++i) {
+    uint32_t size = i == 30 ? 1000 : 16;
+    char* m = (char*)malloc(size);
+    memset(m, i, size);
+    REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, size), (int)size);
+    REQUIRE_EQ(m, NULL);
+  }
+  REQUIRE_EQ(dynmq_msg_count(dq), 50);
+  REQUIRE_EQ(dynmq_spilled_count(dq), 46);
+
+  char* m = NULL;
+  REQUIRE_EQ(dynmq_send_tagged_zc(dq, 1, (void**)&m, 0),
+             ctcom_invalid_arguments);
+
+  for (int i = 0; i < 50; ++i) {
+    uint32_t size = i == 30 ? 1000 : 16;
+    REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), (int)size);
+    REQUIRE_EQ(m[0], i);
+    REQUIRE_EQ(m[size - 1], i);
+    free(m);
+  }
+  REQUIRE_EQ(dynmq_spilled_count(dq), 0);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+  REQUIRE_EQ(count_dir_entries(spill_dir), 0);
+
+  // Back to memory once the disk is drained.
+  m = (char*)malloc(16);
+  REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 16), 16);
+  REQUIRE_EQ(dynmq_spilled_count(dq), 0);
+  REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 16);
+  free(m);
+
+  dynamic_queue_destroy(dq);
+  rmdir(spill_dir);
+}
+
+TEST(dynamic_queues, spill_page_in_out_of_memory) {
+  char spill_dir[] = "/tmp/ctcomm-spill-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(spill_dir), NULL);
+
+  int remaining = -1;
+  ctcomm_allocator alloc = {failing_alloc, failing_realloc, failing_free,
+                            &remaining};
+  dynmq_opts opts = {.allocator = &alloc,
+                     .spill_dir = spill_dir,
+                     .spill_budget = 32,
+                     .spill_segment_size = 256};
+  dynamic_queue* dq = dynamic_queue_create_with_opts(&opts, NULL);
+  REQUIRE_NE((void*)dq, NULL);
+
+  for (int i = 0; i < 10; ++i) {
+    char* m = (char*)malloc(16);
+    memset(m, i, 16);
+    REQUIRE_EQ(dynmq_send_zc(dq, (void**)&m, 16), 16);
+  }
+  REQUIRE_EQ(dynmq_spilled_count(dq), 8);
+
+  char* m = NULL;
+  for (int i = 0; i < 2; ++i) {
+    REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 16);
+    free(m);
+  }
+
+  // First the node can't be allocated, then the payload; the message
+  // stays on disk either way.
+  for (int allowed = 0; allowed < 2; ++allowed) {
+    remaining = allowed;
+    REQUIRE_EQ(dynmq_try_recv_zc(dq, (void**)&m), ctcom_not_enough_memory);
+    REQUIRE_EQ(dynmq_spilled_count(dq), 8);
+    REQUIRE_EQ(dynmq_msg_count(dq), 8);
+  }
+
+  // A batch stops at the first message which can't be paged in, and
+  // fails only if that's the first one.
+  void* bufs[4];
+  uint32_t sizes[4];
+  struct timespec linger = {0, 0};
+  remaining = 0;
+  REQUIRE_EQ(dynmq_recv_batch_min(dq, bufs, sizes, 1, 4, &linger),
+             ctcom_not_enough_memory);
+  REQUIRE_EQ(dynmq_msg_count(dq), 8);
+  // One node and one payload, then the next node fails.
+  remaining = 2;
+  REQUIRE_EQ(dynmq_recv_batch_min(dq, bufs, sizes, 1, 4, &linger), 1);
+  REQUIRE_EQ(sizes[0], 16);
+  REQUIRE_EQ(((char*)bufs[0])[0], 2);
+  free(bufs[0]);
+  REQUIRE_EQ(dynmq_spilled_count(dq), 7);
+
+  remaining = -1;
+  for (int i = 3; i < 10; ++i) {
+    REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 16);
+    REQUIRE_EQ(m[0], i);
+    free(m);
+  }
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  dynamic_queue_destroy(dq);
+  rmdir(spill_dir);
+}
+
+// PRODUCER HANDLE TESTS
+
+TEST(producers, create_fails) {
+  char* err_str = NULL;
+
+  circq_producer* prod = circq_producer_create(NULL, 4, NULL, &err_str);
+  REQUIRE_EQ((void*)prod, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  circular_queue* cq = circular_queue_create(4, NULL);
+  err_str = NULL;
+  prod = circq_producer_create(cq, 0, NULL, &err_str);
+  REQUIRE_EQ((void*)prod, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(producers, circq_batches_and_flushes) {
+  circular_queue* cq = circular_queue_create(8, NULL);
+  circq_producer* prod = circq_producer_create(cq, 3, NULL, NULL);
+  REQUIRE_NE((void*)prod, NULL);
+
+  for (int i = 0; i < 5; ++i) {
+    char* m = (char*)malloc(sizeof(char));
+    *m = 'A' + i;
+    REQUIRE_EQ(circq_prod_send_zc(prod, (void**)&m, 1), 1);
+    REQUIRE_EQ(m, NULL);
+    // Published three at a time.
+    REQUIRE_EQ(circq_msg_count(cq), i < 2 ? 0 : 3);
+  }
+
+  REQUIRE_EQ(circq_prod_flush(prod), 2);
+  REQUIRE_EQ(circq_prod_flush(prod), 0);
+  REQUIRE_EQ(circq_msg_count(cq), 5);
+
+  // The order is preserved.
+  for (int i = 0; i < 5; ++i) {
+    char* m = NULL;
+    REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+    REQUIRE_EQ(*m, 'A' + i);
+    free(m);
+  }
+
+  // Failed flushes keep the messages staged.
+  char* m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(circq_prod_send_zc(prod, (void**)&m, 1), 1);
+  circq_disable_sending(cq);
+  REQUIRE_EQ(circq_prod_flush(prod), ctcom_writing_disabled);
+  circq_enable_sending(cq);
+  REQUIRE_EQ(circq_prod_flush(prod), 1);
+  REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), 1);
+  free(m);
+
+  // Whatever couldn't be published is freed on destruction.
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(circq_prod_send_zc(prod, (void**)&m, 1), 1);
+  circq_disable_sending(cq);
+  circq_producer_destroy(prod);
+  REQUIRE_EQ((void*)prod, NULL);
+  REQUIRE_EQ(circq_msg_count(cq), 0);
+
+  circular_queue_destroy(cq);
+}
+
+TEST(producers, dynmq_latency_bound) {
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+  struct timespec max_latency = {.tv_sec = 0, .tv_nsec = 10000000};
+  dynmq_producer* prod = dynmq_producer_create(dq, 64, &max_latency, NULL);
+  REQUIRE_NE((void*)prod, NULL);
+
+  char* m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_prod_send_zc(prod, (void**)&m, 1), 1);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  // The next send after the bound has passed publishes both.
+  usleep(20000);
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_prod_send_zc(prod, (void**)&m, 1), 1);
+  REQUIRE_EQ(dynmq_msg_count(dq), 2);
+
+  // Destroying flushes the rest.
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(dynmq_prod_send_zc(prod, (void**)&m, 1), 1);
+  dynmq_producer_destroy(prod);
+  REQUIRE_EQ(dynmq_msg_count(dq), 3);
+
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(dynmq_recv_zc(dq, (void**)&m), 1);
+    free(m);
+  }
+
+  dynamic_queue_destroy(dq);
+}
+
+void release_to_msg_pool(void* msg, uint32_t msg_size, void* release_ctx) {
+  (void)msg_size;
+  msgpool_free((msg_pool*)release_ctx, msg);
+}
+
+TEST(producers, unpublished_messages_go_to_release_cb) {
+  msg_pool* pool = msg_pool_create(NULL, NULL);
+  dynamic_queue* dq = dynamic_queue_create(NULL);
+  prod_opts opts = {.release_cb = release_to_msg_pool, .release_ctx = pool};
+  dynmq_producer* prod = dynmq_producer_create_with_opts(dq, 4, &opts, NULL);
+  REQUIRE_NE((void*)prod, NULL);
+
+  for (int i = 0; i < 2; ++i) {
+    void* m = msgpool_alloc(pool, 32);
+    REQUIRE_EQ(dynmq_prod_send_zc(prod, &m, 32), 32);
+  }
+  dynmq_disable_sending(dq);
+  dynmq_producer_destroy(prod);
+  REQUIRE_EQ(dynmq_msg_count(dq), 0);
+
+  msgpool_stats stats;
+  REQUIRE_EQ(msgpool_get_stats(pool, &stats), ctcom_success_threshold);
+  REQUIRE_EQ(stats.frees, 2);
+
+  dynamic_queue_destroy(dq);
+  msg_pool_destroy(pool);
+}
+
 // CHANNEL TESTS
 
 TEST(channels, create_fails) {
@@ -634,29 +2073,304 @@ void* thr_for_channels_basic_send_and_receive(void* args) {
 
   assert(chan_send_zc(ch, (void**)&msg, 1) == 1);
 
-  assert(msg == NULL);
+  assert(msg == NULL);
+
+  return NULL;
+}
+
+TEST(channels, basic_send_and_receive) {
+  channel* ch = channel_create(1, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, thr_for_channels_basic_send_and_receive, ch);
+
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  REQUIRE_EQ(chan_send_zc(ch, (void**)&m1, 1), 1);
+  REQUIRE_EQ(m1, NULL);
+
+  char* m2 = NULL;
+  REQUIRE_EQ(chan_recv_zc(ch, (void**)&m2), 1);
+  REQUIRE_NE(m2, NULL);
+  REQUIRE_EQ(*m2, 'B');
+
+  free(m2);
+  pthread_join(tid, NULL);
+  channel_destroy(ch);
+}
+
+void* thr_for_channels_buffer_recycling(void* args) {
+  channel* ch = (channel*)args;
+  void* bufs[8];
+
+  for (int i = 0; i < 8; ++i) {
+    assert(chan_recv_zc(ch, &bufs[i]) == 100);
+    assert(((char*)bufs[i])[99] == i);
+  }
+  assert(chan_return_bufs(ch, bufs, 8) == ctcom_success_threshold);
+  assert(bufs[0] == NULL);
+
+  char* reply = (char*)chan_alloc_buf(ch, 1);
+  *reply = 'R';
+  assert(chan_send_zc(ch, (void**)&reply, 1) == 1);
+
+  return NULL;
+}
+
+TEST(channels, buffer_recycling) {
+  channel* ch = channel_create(8, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, thr_for_channels_buffer_recycling, ch);
+
+  void* sent[8];
+  for (int i = 0; i < 8; ++i) {
+    char* m = (char*)chan_alloc_buf(ch, 100);
+    REQUIRE_NE((void*)m, NULL);
+    m[99] = i;
+    sent[i] = m;
+    REQUIRE_EQ(chan_send_zc(ch, (void**)&m, 100), 100);
+  }
+
+  void* reply = NULL;
+  REQUIRE_EQ(chan_recv_zc(ch, &reply), 1);
+  REQUIRE_EQ(*(char*)reply, 'R');
+  REQUIRE_EQ(chan_return_bufs(ch, &reply, 1), ctcom_success_threshold);
+  pthread_join(tid, NULL);
+
+  // The same buffers come back, a bigger one is allocated afresh.
+  for (int i = 0; i < 8; ++i) {
+    void* m = chan_alloc_buf(ch, 128);
+    bool found = false;
+    for (int j = 0; j < 8; ++j) {
+      found = found || m == sent[j];
+    }
+    REQUIRE(found);
+    chan_free_buf(ch, m);
+  }
+  void* m = chan_alloc_buf(ch, 1000);
+  REQUIRE_NE(m, NULL);
+  memset(m, 0, 1000);
+  chan_free_buf(ch, m);
+
+  // Whoever gives it back, a buffer goes to the side which allocated it.
+  m = chan_alloc_buf(ch, 64);
+  void* own = m;
+  REQUIRE_EQ(chan_return_bufs(ch, &m, 1), ctcom_success_threshold);
+  REQUIRE_EQ(chan_alloc_buf(ch, 64), own);
+  chan_free_buf(ch, own);
+
+  channel_destroy(ch);
+}
+
+void* thr_for_channels_calls(void* args) {
+  // Using direct assertions in helper threads
+  channel* ch = (channel*)args;
+
+  char* msg = (char*)malloc(1);
+  *msg = 'P';
+  assert(chan_send_zc(ch, (void**)&msg, 1) == 1);
+
+  for (int i = 0; i < 3; ++i) {
+    int* req = (int*)malloc(sizeof(int));
+    *req = i;
+    int* reply = NULL;
+    assert(chan_call(ch, (void**)&req, sizeof(int), (void**)&reply) ==
+           sizeof(int));
+    assert(req == NULL);
+    assert(*reply == i * 10);
+    free(reply);
+  }
+
+  // The owner calls back in.
+  chan_request* req = NULL;
+  assert(chan_recv_request(ch, (void**)&msg, &req) == 1);
+  assert(req != NULL);
+  assert(*msg == 'Q');
+  *msg = 'A';
+  assert(chan_reply(req, (void**)&msg, 1) == 1);
+  assert(msg == NULL);
+
+  return NULL;
+}
+
+TEST(channels, calls) {
+  channel* ch = channel_create(4, NULL);
+  pthread_t thread;
+  pthread_create(&thread, NULL, thr_for_channels_calls, (void*)ch);
+
+  // The plain message isn't a request and the zero copy calls don't
+  // take the requests.
+  chan_request* req = NULL;
+  char* msg = NULL;
+  REQUIRE_EQ(chan_recv_request(ch, (void**)&msg, &req), 1);
+  REQUIRE_EQ((void*)req, NULL);
+  REQUIRE_EQ(*msg, 'P');
+  free(msg);
+
+  for (int i = 0; i < 3; ++i) {
+    int* m = NULL;
+    while (chan_msg_count(ch, workers_to_owner) == 0) {
+      sched_yield();
+    }
+    REQUIRE_EQ(chan_recv_zc(ch, (void**)&m), ctcom_wrong_msg_kind);
+    REQUIRE_EQ(chan_recv_request(ch, (void**)&m, &req), sizeof(int));
+    REQUIRE_NE((void*)req, NULL);
+    REQUIRE_EQ(*m, i);
+    *m *= 10;
+    REQUIRE_EQ(chan_reply(req, (void**)&m, sizeof(int)), sizeof(int));
+  }
+
+  msg = (char*)malloc(1);
+  *msg = 'Q';
+  char* reply = NULL;
+  REQUIRE_EQ(chan_call(ch, (void**)&msg, 1, (void**)&reply), 1);
+  REQUIRE_EQ(*reply, 'A');
+  free(reply);
+
+  pthread_join(thread, NULL);
+  channel_destroy(ch);
+}
+
+bool channels_call_timed_out = false;
+int channels_released_replies = 0;
+
+void release_chan_buf_reply(void* reply, uint32_t reply_size, void* ctx) {
+  (void)reply_size;
+  chan_free_buf((channel*)ctx, reply);
+  __atomic_add_fetch(&channels_released_replies, 1, __ATOMIC_SEQ_CST);
+}
+
+// Replies with a recycled buffer carrying the request's first byte.
+void reply_with_chan_buf(channel* ch, chan_request* req, char* msg) {
+  char* reply = (char*)chan_alloc_buf(ch, 1);
+  assert(reply != NULL);
+  *reply = *msg;
+  free(msg);
+  assert(chan_reply_with_release(req, (void**)&reply, 1,
+                                 release_chan_buf_reply, ch) == 1);
+  assert(reply == NULL);
+}
+
+void* thr_for_channels_timed_and_async_calls(void* args) {
+  // Using direct assertions in helper threads
+  channel* ch = (channel*)args;
+  chan_request* req = NULL;
+  char* msg = NULL;
+
+  // Replies after the caller has given up.
+  assert(chan_recv_request(ch, (void**)&msg, &req) == 1);
+  while (!__atomic_load_n(&channels_call_timed_out, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+  reply_with_chan_buf(ch, req, msg);
+
+  // Both async calls, one of which is released before the reply.
+  for (int i = 0; i < 2; ++i) {
+    assert(chan_recv_request(ch, (void**)&msg, &req) == 1);
+    reply_with_chan_buf(ch, req, msg);
+  }
+
+  return NULL;
+}
+
+#define RACING_CALLS 200
+
+void* thr_for_channels_racing_timed_calls(void* args) {
+  // Using direct assertions in helper threads
+  channel* ch = (channel*)args;
+  chan_request* req = NULL;
+  char* msg = NULL;
+
+  for (int i = 0; i < RACING_CALLS; ++i) {
+    assert(chan_recv_request(ch, (void**)&msg, &req) == 1);
+    reply_with_chan_buf(ch, req, msg);
+  }
+
+  return NULL;
+}
+
+TEST(channels, racing_timed_calls) {
+  channel* ch = channel_create(4, NULL);
+  // Replies land around the deadline, before it, in between the timeout
+  // and giving up, or after that.
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 20000};
+  __atomic_store_n(&channels_released_replies, 0, __ATOMIC_SEQ_CST);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, thr_for_channels_racing_timed_calls,
+                 (void*)ch);
+
+  int delivered = 0;
+  for (int i = 0; i < RACING_CALLS; ++i) {
+    char* msg = (char*)malloc(1);
+    *msg = (char)i;
+    char* reply = NULL;
+    int retval = chan_timed_call(ch, (void**)&msg, 1, (void**)&reply,
+                                 &timeout);
+    if (retval == ctcom_timedout) {
+      REQUIRE_EQ((void*)reply, NULL);
+      continue;
+    }
+    REQUIRE_EQ(retval, 1);
+    REQUIRE_EQ(*reply, (char)i);
+    chan_free_buf(ch, reply);
+    ++delivered;
+  }
+
+  pthread_join(thread, NULL);
+  // Every reply is either delivered or released, never both.
+  REQUIRE_EQ(delivered + channels_released_replies, RACING_CALLS);
 
-  return NULL;
+  channel_destroy(ch);
 }
 
-TEST(channels, basic_send_and_receive) {
-  channel* ch = channel_create(1, NULL);
+TEST(channels, timed_and_async_calls) {
+  channel* ch = channel_create(4, NULL);
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 10000000};
+  char* msg = (char*)malloc(1);
+  char* reply = NULL;
+  __atomic_store_n(&channels_released_replies, 0, __ATOMIC_SEQ_CST);
 
-  pthread_t tid;
-  pthread_create(&tid, NULL, thr_for_channels_basic_send_and_receive, ch);
+  pthread_t thread;
+  pthread_create(&thread, NULL, thr_for_channels_timed_and_async_calls,
+                 (void*)ch);
 
-  char* m1 = (char*)malloc(sizeof(char));
-  *m1 = 'A';
-  REQUIRE_EQ(chan_send_zc(ch, (void**)&m1, 1), 1);
-  REQUIRE_EQ(m1, NULL);
+  REQUIRE_EQ(chan_timed_call(ch, (void**)&msg, 1, (void**)&reply, &timeout),
+             ctcom_timedout);
+  REQUIRE_EQ((void*)reply, NULL);
+  __atomic_store_n(&channels_call_timed_out, true, __ATOMIC_RELEASE);
+
+  chan_future* released = NULL;
+  msg = (char*)malloc(1);
+  REQUIRE_EQ(chan_call_async(ch, (void**)&msg, 1, &released), 1);
+  chan_future_release(released);
+
+  chan_future* f = NULL;
+  msg = (char*)malloc(1);
+  *msg = 'F';
+  REQUIRE_EQ(chan_call_async(ch, (void**)&msg, 1, &f), 1);
+  REQUIRE_EQ((void*)msg, NULL);
+  REQUIRE_EQ(chan_future_wait(f, (void**)&reply), 1);
+  REQUIRE_EQ(*reply, 'F');
+  // Taken already.
+  REQUIRE_EQ(chan_future_try_get(f, (void**)&reply), ctcom_invalid_arguments);
+  chan_future_release(f);
+  chan_free_buf(ch, reply);
+
+  pthread_join(thread, NULL);
+  // The abandoned replies went to the replier's callback, not free().
+  REQUIRE_EQ(channels_released_replies, 2);
 
-  char* m2 = NULL;
-  REQUIRE_EQ(chan_recv_zc(ch, (void**)&m2), 1);
-  REQUIRE_NE(m2, NULL);
-  REQUIRE_EQ(*m2, 'B');
+  channel_destroy(ch);
 
-  free(m2);
-  pthread_join(tid, NULL);
+  // Lossy channels can't carry calls.
+  circq_opts opts = {.overwrite_oldest = true};
+  ch = channel_create_with_opts(4, &opts, NULL);
+  msg = (char*)malloc(1);
+  REQUIRE_EQ(chan_call(ch, (void**)&msg, 1, (void**)&reply),
+             ctcom_invalid_arguments);
+  free(msg);
   channel_destroy(ch);
 }
 
@@ -913,3 +2627,916 @@ TEST(channels, enable_disable_sending) {
   pthread_join(tid, NULL);
   channel_destroy(ch);
 }
+
+// CONFLATING_QUEUE TESTS
+
+TEST(conflating_queues, create_and_destroy) {
+  char* err_str = "";
+
+  conflating_queue* cfq = conflating_queue_create(NULL, &err_str);
+  REQUIRE_NE((void*)cfq, NULL);
+  REQUIRE_EQ((void*)err_str, NULL);
+
+  char* m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(conflq_send_zc(cfq, 1, (void**)&m, 1), 1);
+  m = (char*)malloc(sizeof(char));
+  REQUIRE_EQ(conflq_send_zc(cfq, 1, (void**)&m, 1), 1);  // free()'d
+
+  REQUIRE_EQ(conflq_try_recv_zc(cfq, NULL, (void**)&m), 1);
+  free(m);
+
+  conflating_queue_destroy(cfq);
+  REQUIRE_EQ((void*)cfq, NULL);
+}
+
+TEST(conflating_queues, last_value_wins) {
+  int released = 0;
+  conflq_opts opts = {.release_cb = free_dropped_msg, .release_ctx = &released};
+  conflating_queue* cfq = conflating_queue_create(&opts, NULL);
+
+  // Three instruments, updated out of order.
+  const uint64_t keys[] = {7, 3, 7, 9, 3, 7};
+  for (int i = 0; i < 6; ++i) {
+    int* m = (int*)malloc(sizeof(int));
+    *m = i;
+    REQUIRE_EQ(conflq_send_zc(cfq, keys[i], (void**)&m, sizeof(int)),
+               (int)sizeof(int));
+    REQUIRE_EQ((void*)m, NULL);
+  }
+
+  REQUIRE_EQ(conflq_msg_count(cfq), 3);
+  REQUIRE_EQ(conflq_conflated_count(cfq), 3);
+  REQUIRE_EQ(released, 3);
+
+  // First arrival order of the keys, latest values.
+  const uint64_t expected_keys[] = {7, 3, 9};
+  const int expected_values[] = {5, 4, 3};
+  for (int i = 0; i < 3; ++i) {
+    uint64_t key = 0;
+    int* m = NULL;
+    REQUIRE_EQ(conflq_recv_zc(cfq, &key, (void**)&m), (int)sizeof(int));
+    REQUIRE_EQ(key, expected_keys[i]);
+    REQUIRE_EQ(*m, expected_values[i]);
+    free(m);
+  }
+
+  uint64_t key = 0;
+  void* m = NULL;
+  REQUIRE_EQ(conflq_timed_recv_zc(cfq, &key, &m,
+                                  &(struct timespec){.tv_sec = 0,
+                                                     .tv_nsec = 10000000}),
+             ctcom_timedout);
+
+  // A consumed key starts over at the tail.
+  REQUIRE_EQ(conflq_send_zc(cfq, 7, &m, 0), ctcom_success_threshold);
+  REQUIRE_EQ(conflq_conflated_count(cfq), 3);
+
+  conflq_disable_sending(cfq);
+  REQUIRE_EQ(conflq_send_zc(cfq, 8, &m, 0), ctcom_writing_disabled);
+
+  conflating_queue_destroy(cfq);
+}
+
+void ignore_released_msg(void* msg, uint32_t msg_size, void* release_ctx) {
+  (void)msg;
+  (void)msg_size;
+  (void)release_ctx;
+}
+
+TEST(conflating_queues, many_keys) {
+  conflq_opts opts = {.release_cb = ignore_released_msg};
+  conflating_queue* cfq = conflating_queue_create(&opts, NULL);
+
+  // Enough keys to make the index grow and shrink a few times.
+  for (int round = 0; round < 3; ++round) {
+    for (uintptr_t k = 0; k < 5000; ++k) {
+      void* m = (void*)(k * 3 + round);
+      REQUIRE_GE(conflq_send_zc(cfq, k * 7919, &m, 1), 0);
+    }
+    REQUIRE_EQ(conflq_msg_count(cfq), 5000);
+  }
+
+  for (uintptr_t k = 0; k < 5000; ++k) {
+    uint64_t key = 0;
+    void* m = NULL;
+    REQUIRE_EQ(conflq_try_recv_zc(cfq, &key, &m), 1);
+    REQUIRE_EQ(key, k * 7919);
+    REQUIRE_EQ((uintptr_t)m, k * 3 + 2);
+  }
+
+  conflating_queue_destroy(cfq);
+}
+
+// PRIORITY_QUEUE TESTS
+
+TEST(priority_queues, create_fails) {
+  char* err_str = NULL;
+
+  priority_queue* pq = priority_queue_create(0, NULL, &err_str);
+  REQUIRE_EQ((void*)pq, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  pq = priority_queue_create(prioq_max_levels + 1, NULL, &err_str);
+  REQUIRE_EQ((void*)pq, NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+}
+
+TEST(priority_queues, most_urgent_first) {
+  priority_queue* pq = priority_queue_create(prioq_max_levels, NULL, NULL);
+  REQUIRE_NE((void*)pq, NULL);
+
+  // Plenty of bulk messages to make the level grow, then a few urgent
+  // ones which should overtake all of them.
+  for (uintptr_t i = 1; i <= 100; ++i) {
+    void* m = (void*)i;
+    REQUIRE_EQ(prioq_send_zc(pq, 63, &m, 1), 1);
+  }
+  for (uintptr_t i = 101; i <= 103; ++i) {
+    void* m = (void*)i;
+    REQUIRE_EQ(prioq_send_zc(pq, 0, &m, 1), 1);
+  }
+  void* m = (void*)104;
+  REQUIRE_EQ(prioq_send_zc(pq, 5, &m, 1), 1);
+  REQUIRE_EQ(prioq_send_zc(pq, 64, &m, 0), ctcom_invalid_arguments);
+  REQUIRE_EQ(prioq_msg_count(pq), 104);
+
+  uint32_t prio = 0;
+  for (uintptr_t i = 101; i <= 103; ++i) {
+    REQUIRE_EQ(prioq_recv_zc(pq, &m, &prio), 1);
+    REQUIRE_EQ((uintptr_t)m, i);
+    REQUIRE_EQ(prio, 0);
+  }
+  REQUIRE_EQ(prioq_try_recv_zc(pq, &m, &prio), 1);
+  REQUIRE_EQ((uintptr_t)m, 104);
+  REQUIRE_EQ(prio, 5);
+  for (uintptr_t i = 1; i <= 100; ++i) {
+    REQUIRE_EQ(prioq_try_recv_zc(pq, &m, NULL), 1);
+    REQUIRE_EQ((uintptr_t)m, i);
+  }
+
+  REQUIRE_EQ(prioq_timed_recv_zc(pq, &m, &prio,
+                                 &(struct timespec){.tv_sec = 0,
+                                                    .tv_nsec = 10000000}),
+             ctcom_timedout);
+
+  priority_queue_destroy(pq);
+  REQUIRE_EQ((void*)pq, NULL);
+}
+
+TEST(priority_queues, aging) {
+  prioq_opts opts = {.aging_interval = 3};
+  priority_queue* pq = priority_queue_create(8, &opts, NULL);
+
+  void* m = NULL;
+  for (int i = 0; i < 10; ++i) {
+    REQUIRE_EQ(prioq_send_zc(pq, 0, &m, 0), ctcom_success_threshold);
+  }
+  REQUIRE_EQ(prioq_send_zc(pq, 7, &m, 0), ctcom_success_threshold);
+
+  uint32_t prio = 0;
+  REQUIRE_EQ(prioq_recv_zc(pq, &m, &prio), ctcom_success_threshold);
+  REQUIRE_EQ(prio, 0);
+  REQUIRE_EQ(prioq_recv_zc(pq, &m, &prio), ctcom_success_threshold);
+  REQUIRE_EQ(prio, 0);
+  // The third receive goes to the starving level.
+  REQUIRE_EQ(prioq_recv_zc(pq, &m, &prio), ctcom_success_threshold);
+  REQUIRE_EQ(prio, 7);
+
+  priority_queue_destroy(pq);
+}
+
+TEST(priority_queues, aging_takes_turns) {
+  prioq_opts opts = {.aging_interval = 2};
+  priority_queue* pq = priority_queue_create(3, &opts, NULL);
+
+  // Levels 0 and 2 are under constant load, level 1 must still be
+  // served.
+  void* m = NULL;
+  for (int i = 0; i < 10; ++i) {
+    REQUIRE_EQ(prioq_send_zc(pq, 0, &m, 0), ctcom_success_threshold);
+    REQUIRE_EQ(prioq_send_zc(pq, 2, &m, 0), ctcom_success_threshold);
+  }
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(prioq_send_zc(pq, 1, &m, 0), ctcom_success_threshold);
+  }
+
+  const uint32_t expected[] = {0, 1, 0, 2, 0, 1, 0, 2, 0, 1, 0, 2, 0, 2};
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    uint32_t prio = UINT32_MAX;
+    REQUIRE_EQ(prioq_recv_zc(pq, &m, &prio), ctcom_success_threshold);
+    REQUIRE_EQ(prio, expected[i]);
+  }
+
+  priority_queue_destroy(pq);
+}
+
+// DELAY_QUEUE TESTS
+
+#define monotonicTime(A) clock_gettime(CLOCK_MONOTONIC, &A);
+
+TEST(delay_queues, delivered_in_deadline_order) {
+  // A microsecond tick makes the test go through several wheel levels.
+  delayq_opts opts = {.tick_ns = 1000};
+  delay_queue* dlq = delay_queue_create(&opts, NULL);
+  REQUIRE_NE((void*)dlq, NULL);
+
+  const long delays_ms[] = {60, 20, 0, 5};
+  for (uintptr_t i = 0; i < 4; ++i) {
+    void* m = (void*)(i + 1);
+    struct timespec delay = {.tv_sec = 0,
+                             .tv_nsec = delays_ms[i] * 1000000};
+    REQUIRE_EQ(delayq_send_after(dlq, &m, 1, &delay, NULL), 1);
+  }
+  REQUIRE_EQ(delayq_msg_count(dlq), 4);
+
+  void* m = NULL;
+  REQUIRE_EQ(delayq_try_recv_zc(dlq, &m), 1);
+  REQUIRE_EQ((uintptr_t)m, 3);
+  REQUIRE_EQ(delayq_try_recv_zc(dlq, &m), ctcom_container_empty);
+
+  struct timespec before;
+  struct timespec after;
+  const uintptr_t expected[] = {4, 2, 1};
+  const long expected_ms[] = {5, 20, 60};
+  monotonicTime(before);
+  for (int i = 0; i < 3; ++i) {
+    REQUIRE_EQ(delayq_recv_zc(dlq, &m), 1);
+    monotonicTime(after);
+    REQUIRE_EQ((uintptr_t)m, expected[i]);
+    // Never early, and not too late either.
+    REQUIRE_GE(diffTimeUSec(before, after), expected_ms[i] * 1000 - 1000);
+    REQUIRE_LT(diffTimeUSec(before, after), expected_ms[i] * 1000 + 20000);
+  }
+
+  REQUIRE_EQ(delayq_msg_count(dlq), 0);
+  delay_queue_destroy(dlq);
+  REQUIRE_EQ((void*)dlq, NULL);
+}
+
+TEST(delay_queues, cancel_and_timed_recv) {
+  delay_queue* dlq = delay_queue_create(NULL, NULL);
+
+  char* m1 = (char*)malloc(sizeof(char));
+  *m1 = 'A';
+  delayq_handle handle;
+  struct timespec deadline;
+  monotonicTime(deadline);
+  deadline.tv_sec += 3600;
+  REQUIRE_EQ(delayq_send_at(dlq, (void**)&m1, 1, &deadline, &handle), 1);
+  REQUIRE_EQ(m1, NULL);
+
+  char* m2 = NULL;
+  struct timespec timeout = {.tv_sec = 0, .tv_nsec = 30000000};
+  struct timespec before;
+  struct timespec after;
+  monotonicTime(before);
+  REQUIRE_EQ(delayq_timed_recv_zc(dlq, (void**)&m2, &timeout),
+             ctcom_timedout);
+  monotonicTime(after);
+  REQUIRE_GE(diffTimeUSec(before, after), 30000);
+
+  REQUIRE_EQ(delayq_cancel(dlq, &handle, (void**)&m2), 1);
+  REQUIRE_EQ(*m2, 'A');
+  REQUIRE_EQ(delayq_msg_count(dlq), 0);
+  // The handle is stale now, even once its node gets recycled.
+  REQUIRE_EQ(delayq_cancel(dlq, &handle, (void**)&m1), ctcom_container_empty);
+  REQUIRE_EQ(delayq_send_after(dlq, (void**)&m1, 0, &timeout, NULL),
+             ctcom_success_threshold);
+  REQUIRE_EQ(delayq_cancel(dlq, &handle, (void**)&m1), ctcom_container_empty);
+
+  REQUIRE_EQ(delayq_timed_recv_zc(
+                 dlq, (void**)&m1,
+                 &(struct timespec){.tv_sec = 1, .tv_nsec = 0}),
+             ctcom_success_threshold);
+
+  delayq_disable_sending(dlq);
+  REQUIRE_EQ(delayq_send_after(dlq, (void**)&m2, 1, &timeout, NULL),
+             ctcom_writing_disabled);
+  REQUIRE_NE(m2, NULL);
+
+  free(m2);
+  delay_queue_destroy(dlq);
+}
+
+void* delayed_sender_thread(void* args) {
+  delay_queue* dlq = (delay_queue*)args;
+  usleep(20000);
+
+  void* m = NULL;
+  struct timespec delay = {.tv_sec = 0, .tv_nsec = 10000000};
+  assert(delayq_send_after(dlq, &m, 0, &delay, NULL) == 0);
+
+  return NULL;
+}
+
+TEST(delay_queues, blocked_receiver_notices_new_deadline) {
+  delay_queue* dlq = delay_queue_create(NULL, NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, delayed_sender_thread, dlq);
+
+  struct timespec before;
+  struct timespec after;
+  void* m = NULL;
+  monotonicTime(before);
+  REQUIRE_EQ(delayq_recv_zc(dlq, &m), ctcom_success_threshold);
+  monotonicTime(after);
+  REQUIRE_GE(diffTimeUSec(before, after), 30000);
+
+  pthread_join(tid, NULL);
+  delay_queue_destroy(dlq);
+}
+
+// JOURNAL QUEUE TESTS
+void remove_dir(const char* path) {
+  char file[512];
+  DIR* dir = opendir(path);
+  for (struct dirent* e = readdir(dir); e; e = readdir(dir)) {
+    if (e->d_name[0] != '.') {
+      snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+      unlink(file);
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+TEST(journal_queues, create_fails) {
+  char* err_str = NULL;
+  REQUIRE_EQ((void*)journal_queue_create(NULL, NULL, &err_str), NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+
+  err_str = NULL;
+  REQUIRE_EQ((void*)journal_queue_create("/nonexistent/journal", NULL,
+                                         &err_str),
+             NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+}
+
+TEST(journal_queues, resumes_from_commit) {
+  char dir[] = "/tmp/ctcomm-journal-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(dir), NULL);
+
+  jrnq_opts opts = {.sync_policy = jrnq_sync_per_batch};
+  journal_queue* jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+
+  const void* msg = NULL;
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), ctcom_container_empty);
+  struct timespec timeout = {0, 10000000};
+  REQUIRE_EQ(jrnq_timed_recv(jq, &msg, &timeout), ctcom_timedout);
+
+  const void* msgs[] = {"first", "second", "third"};
+  uint32_t sizes[] = {6, 7, 6};
+  REQUIRE_EQ(jrnq_send_batch(jq, msgs, sizes, 3), 3);
+
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 6);
+  REQUIRE_EQ(strcmp((const char*)msg, "first"), 0);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 7);
+  REQUIRE_EQ(strcmp((const char*)msg, "second"), 0);
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  journal_queue_destroy(jq);
+  REQUIRE_EQ((void*)jq, NULL);
+
+  // Only the uncommitted message is left, received or not.
+  jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 6);
+  REQUIRE_EQ(strcmp((const char*)msg, "third"), 0);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), ctcom_container_empty);
+  journal_queue_destroy(jq);
+
+  jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), 6);
+  REQUIRE_EQ(strcmp((const char*)msg, "third"), 0);
+
+  // New messages go after the existing ones.
+  REQUIRE_EQ(jrnq_send(jq, "fourth", 7), 7);
+  REQUIRE_EQ(jrnq_send(jq, NULL, 0), 0);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 7);
+  REQUIRE_EQ(strcmp((const char*)msg, "fourth"), 0);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 0);
+  REQUIRE_EQ((void*)msg, NULL);
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  journal_queue_destroy(jq);
+
+  jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), ctcom_container_empty);
+  journal_queue_destroy(jq);
+
+  remove_dir(dir);
+}
+
+// Leaves an empty segment behind, the way a crash right after creating
+// it would, and returns its sequence number.
+uint64_t add_empty_jrnl_segment(const char* dir) {
+  uint64_t seq = 0;
+  bool found = false;
+  DIR* d = opendir(dir);
+  for (struct dirent* e = readdir(d); e; e = readdir(d)) {
+    unsigned long long n = 0;
+    if (sscanf(e->d_name, "journal-%llu.log", &n) == 1 &&
+        (!found || n >= seq)) {
+      seq = n + 1;
+      found = true;
+    }
+  }
+  closedir(d);
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/journal-%020llu.log", dir,
+           (unsigned long long)seq);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    close(fd);
+  }
+  return seq;
+}
+
+TEST(journal_queues, survives_empty_segments) {
+  char dir[] = "/tmp/ctcomm-journal-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(dir), NULL);
+
+  // The very first segment was never sized.
+  REQUIRE_EQ(add_empty_jrnl_segment(dir), 0);
+  journal_queue* jq = journal_queue_create(dir, NULL, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  REQUIRE_EQ(jrnq_send(jq, "kept", 5), 5);
+  journal_queue_destroy(jq);
+
+  // Neither was the one after the last segment.
+  add_empty_jrnl_segment(dir);
+  jq = journal_queue_create(dir, NULL, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  const void* msg = NULL;
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 5);
+  REQUIRE_EQ(strcmp((const char*)msg, "kept"), 0);
+  REQUIRE_EQ(jrnq_send(jq, "after", 6), 6);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 6);
+  REQUIRE_EQ(strcmp((const char*)msg, "after"), 0);
+  journal_queue_destroy(jq);
+
+  remove_dir(dir);
+}
+
+TEST(journal_queues, rolls_segments) {
+  char dir[] = "/tmp/ctcomm-journal-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(dir), NULL);
+
+  jrnq_opts opts = {.segment_size = 256};
+  journal_queue* jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+
+  // Ten 24 byte records fit into a segment, the big one gets a
+  // segment of its own.
+  char buf[1000];
+  for (int i = 0; i < 40; ++i) {
+    uint32_t size = i == 20 ? 1000 : 16;
+    memset(buf, i, size);
+    REQUIRE_EQ(jrnq_send(jq, buf, size), (int)size);
+  }
+  REQUIRE_EQ(count_dir_entries(dir), 6);
+
+  const void* msg = NULL;
+  for (int i = 0; i < 30; ++i) {
+    uint32_t size = i == 20 ? 1000 : 16;
+    REQUIRE_EQ(jrnq_recv(jq, &msg), (int)size);
+    REQUIRE_EQ(((const char*)msg)[size - 1], i);
+  }
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  REQUIRE_EQ(count_dir_entries(dir), 3);
+  journal_queue_destroy(jq);
+
+  jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  for (int i = 30; i < 40; ++i) {
+    REQUIRE_EQ(jrnq_try_recv(jq, &msg), 16);
+    REQUIRE_EQ(((const char*)msg)[0], i);
+  }
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), ctcom_container_empty);
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  REQUIRE_EQ(count_dir_entries(dir), 2);
+  journal_queue_destroy(jq);
+
+  remove_dir(dir);
+}
+
+void corrupt_file_byte(const char* path, long offset) {
+  FILE* f = fopen(path, "r+b");
+  fseek(f, offset, SEEK_SET);
+  int c = fgetc(f);
+  fseek(f, offset, SEEK_SET);
+  fputc(c ^ 0xff, f);
+  fclose(f);
+}
+
+TEST(journal_queues, detects_torn_writes) {
+  char dir[] = "/tmp/ctcomm-journal-test-XXXXXX";
+  REQUIRE_NE((void*)mkdtemp(dir), NULL);
+
+  jrnq_opts opts = {.segment_size = 4096};
+  journal_queue* jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  const void* msgs[] = {"first", "second", "third"};
+  uint32_t sizes[] = {6, 7, 6};
+  REQUIRE_EQ(jrnq_send_batch(jq, msgs, sizes, 3), 3);
+  const void* msg = NULL;
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 6);
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  REQUIRE_EQ(jrnq_recv(jq, &msg), 7);
+  REQUIRE_EQ(jrnq_commit(jq), ctcom_success_threshold);
+  journal_queue_destroy(jq);
+
+  // A header over a payload which never made it to the disk: the third
+  // record (16 + 16 bytes in) is dropped along with anything after it.
+  char path[512];
+  snprintf(path, sizeof(path), "%s/journal-%020d.log", dir, 0);
+  corrupt_file_byte(path, 16 + 16 + 8);
+  // So is the latest commit, the previous one is used instead.
+  snprintf(path, sizeof(path), "%s/cursor", dir);
+  corrupt_file_byte(path, 0);
+
+  jq = journal_queue_create(dir, &opts, NULL);
+  REQUIRE_NE((void*)jq, NULL);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), 7);
+  REQUIRE_EQ(strcmp((const char*)msg, "second"), 0);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), ctcom_container_empty);
+
+  // The torn record's space is reused.
+  REQUIRE_EQ(jrnq_send(jq, "new", 4), 4);
+  REQUIRE_EQ(jrnq_try_recv(jq, &msg), 4);
+  REQUIRE_EQ(strcmp((const char*)msg, "new"), 0);
+  journal_queue_destroy(jq);
+
+  remove_dir(dir);
+}
+
+// MESSAGE POOL TESTS
+TEST(message_pools, create_fails) {
+  char* err_str = NULL;
+  msgpool_opts opts = {.max_buffer_size = UINT32_MAX};
+  REQUIRE_EQ((void*)msg_pool_create(&opts, &err_str), NULL);
+  REQUIRE_NE((void*)err_str, NULL);
+}
+
+TEST(message_pools, magazines) {
+  msgpool_opts opts = {.magazine_size = 4, .max_buffer_size = 1000};
+  msg_pool* pool = msg_pool_create(&opts, NULL);
+  REQUIRE_NE((void*)pool, NULL);
+
+  // The same class is reused for 600 and 1000 bytes.
+  char* a = (char*)msgpool_alloc(pool, 600);
+  REQUIRE_NE((void*)a, NULL);
+  memset(a, 1, 600);
+  msgpool_free(pool, a);
+  char* b = (char*)msgpool_alloc(pool, 1000);
+  REQUIRE_EQ(a, b);
+  memset(b, 2, 1000);
+  msgpool_free(pool, b);
+
+  char* big = (char*)msgpool_alloc(pool, 1025);
+  REQUIRE_NE((void*)big, NULL);
+  memset(big, 3, 1025);
+  msgpool_free(pool, big);
+
+  void* bufs[10];
+  for (int i = 0; i < 10; ++i) {
+    bufs[i] = msgpool_alloc(pool, 16);
+    REQUIRE_NE(bufs[i], NULL);
+  }
+  for (int i = 0; i < 10; ++i) {
+    msgpool_free(pool, bufs[i]);
+  }
+
+  // Two magazines of four were filled, the first one went to the depot.
+  msgpool_stats stats;
+  REQUIRE_EQ(msgpool_get_stats(pool, &stats), ctcom_success_threshold);
+  REQUIRE_EQ(stats.hits, (uint64_t)1);
+  REQUIRE_EQ(stats.misses, (uint64_t)11);
+  REQUIRE_EQ(stats.oversized, (uint64_t)1);
+  REQUIRE_EQ(stats.frees, (uint64_t)12);
+  REQUIRE_EQ(stats.returned_magazines, (uint64_t)1);
+
+  for (int i = 0; i < 10; ++i) {
+    bufs[i] = msgpool_alloc(pool, 16);
+  }
+  for (int i = 0; i < 10; ++i) {
+    msgpool_free(pool, bufs[i]);
+  }
+  REQUIRE_EQ(msgpool_get_stats(pool, &stats), ctcom_success_threshold);
+  REQUIRE_EQ(stats.hits, (uint64_t)11);
+  REQUIRE_EQ(stats.misses, (uint64_t)11);
+
+  msg_pool_destroy(pool);
+  REQUIRE_EQ((void*)pool, NULL);
+}
+
+typedef struct pool_test_ctx {
+  msg_pool* pool;
+  circular_queue* cq;
+} pool_test_ctx;
+
+void* pool_sender_thread(void* arg) {
+  pool_test_ctx* ctx = (pool_test_ctx*)arg;
+
+  for (int i = 0; i < 20000; ++i) {
+    uint32_t size = 32 + i % 200;
+    char* m = (char*)msgpool_alloc(ctx->pool, size);
+    assert(m);
+    memset(m, i, size);
+    assert(circq_send_zc(ctx->cq, (void**)&m, size) == (int)size);
+  }
+
+  return NULL;
+}
+
+TEST(message_pools, cross_thread) {
+  msg_pool* pool = msg_pool_create(NULL, NULL);
+  circular_queue* cq = circular_queue_create(64, NULL);
+  pool_test_ctx ctx = {pool, cq};
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, pool_sender_thread, &ctx);
+
+  for (int i = 0; i < 20000; ++i) {
+    char* m = NULL;
+    uint32_t size = 32 + i % 200;
+    REQUIRE_EQ(circq_recv_zc(cq, (void**)&m), (int)size);
+    REQUIRE_EQ(m[size - 1], (char)i);
+    msgpool_free(pool, m);
+  }
+  pthread_join(tid, NULL);
+
+  // The sender is gone, its counters stay.
+  msgpool_stats stats;
+  msgpool_get_stats(pool, &stats);
+  REQUIRE_EQ(stats.hits + stats.misses, (uint64_t)20000);
+  REQUIRE_EQ(stats.frees, (uint64_t)20000);
+  REQUIRE_GT(stats.returned_magazines, (uint64_t)0);
+  // Only the buffers in flight, plus what's held in the magazines,
+  // ever come from the allocator.
+  REQUIRE_LT(stats.misses, (uint64_t)1000);
+
+  circular_queue_destroy(cq);
+  msg_pool_destroy(pool);
+}
+
+// RENDEZVOUS TESTS
+void* rdv_echo_thread(void* arg) {
+  rendezvous** rs = (rendezvous**)arg;
+
+  for (int i = 0; i < 10000; ++i) {
+    void* m = NULL;
+    assert(rdv_recv_zc(rs[0], &m) == 4);
+    assert(rdv_send_zc(rs[1], &m, 4) == 4);
+  }
+
+  return NULL;
+}
+
+TEST(rendezvous, ping_pong) {
+  rendezvous* rs[2] = {rendezvous_create(NULL), rendezvous_create(NULL)};
+  REQUIRE_NE((void*)rs[0], NULL);
+  REQUIRE_NE((void*)rs[1], NULL);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, rdv_echo_thread, rs);
+
+  int* m = (int*)malloc(sizeof(int));
+  for (int i = 0; i < 10000; ++i) {
+    *m = i;
+    REQUIRE_EQ(rdv_send_zc(rs[0], (void**)&m, 4), 4);
+    REQUIRE_EQ((void*)m, NULL);
+    REQUIRE_EQ(rdv_recv_zc(rs[1], (void**)&m), 4);
+    REQUIRE_EQ(*m, i);
+  }
+  free(m);
+
+  pthread_join(tid, NULL);
+  rendezvous_destroy(rs[0]);
+  rendezvous_destroy(rs[1]);
+  REQUIRE_EQ((void*)rs[0], NULL);
+}
+
+void* rdv_late_receiver_thread(void* arg) {
+  rendezvous* r = (rendezvous*)arg;
+
+  usleep(20000);
+  void* m = NULL;
+  assert(rdv_try_recv_zc(r, &m) == 1);
+  assert(*(char*)m == 'A');
+  free(m);
+
+  // Nobody is going to send this time.
+  assert(rdv_recv_zc(r, &m) == ctcom_writing_disabled);
+
+  return NULL;
+}
+
+TEST(rendezvous, nothing_is_queued) {
+  rendezvous* r = rendezvous_create(NULL);
+
+  char* m = (char*)malloc(1);
+  *m = 'A';
+  REQUIRE_EQ(rdv_try_send_zc(r, (void**)&m, 1), ctcom_container_full);
+  REQUIRE_NE((void*)m, NULL);
+  void* buf = NULL;
+  REQUIRE_EQ(rdv_try_recv_zc(r, &buf), ctcom_container_empty);
+
+  struct timespec timeout = {0, 10000000};
+  REQUIRE_EQ(rdv_timed_send_zc(r, (void**)&m, 1, &timeout), ctcom_timedout);
+  REQUIRE_NE((void*)m, NULL);
+  REQUIRE_EQ(rdv_timed_recv_zc(r, &buf, &timeout), ctcom_timedout);
+
+  // The send only returns once the receiver has taken the message.
+  pthread_t tid;
+  pthread_create(&tid, NULL, rdv_late_receiver_thread, r);
+  REQUIRE_EQ(rdv_send_zc(r, (void**)&m, 1), 1);
+  REQUIRE_EQ((void*)m, NULL);
+
+  usleep(20000);
+  REQUIRE_EQ(rdv_disable_sending(r), ctcom_success_threshold);
+  pthread_join(tid, NULL);
+
+  m = (char*)malloc(1);
+  REQUIRE_EQ(rdv_send_zc(r, (void**)&m, 1), ctcom_writing_disabled);
+  REQUIRE_EQ(rdv_enable_sending(r), ctcom_success_threshold);
+  REQUIRE_EQ(rdv_try_send_zc(r, (void**)&m, 1), ctcom_container_full);
+  free(m);
+
+  rendezvous_destroy(r);
+}
+
+typedef struct oneshot_job {
+  int input;
+  ctcomm_oneshot done;
+} oneshot_job;
+
+void* oneshot_worker_thread(void* args) {
+  // Using direct assertions in helper threads
+  oneshot_job* jobs = (oneshot_job*)args;
+
+  for (int i = 0; i < 100; ++i) {
+    int* result = (int*)malloc(sizeof(int));
+    *result = jobs[i].input * 2;
+    assert(oneshot_set(&jobs[i].done, result, sizeof(int)) ==
+           ctcom_success_threshold);
+  }
+
+  return NULL;
+}
+
+TEST(oneshot, set_and_wait) {
+  oneshot_job jobs[100];
+  for (int i = 0; i < 100; ++i) {
+    jobs[i].input = i;
+    oneshot_init(&jobs[i].done);
+  }
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, oneshot_worker_thread, jobs);
+
+  for (int i = 0; i < 100; ++i) {
+    int* result = NULL;
+    REQUIRE_EQ(oneshot_wait(&jobs[i].done, (void**)&result), sizeof(int));
+    REQUIRE_EQ(*result, i * 2);
+    // The value stays there.
+    int* again = NULL;
+    REQUIRE_EQ(oneshot_try_get(&jobs[i].done, (void**)&again), sizeof(int));
+    REQUIRE_EQ((void*)again, (void*)result);
+    free(result);
+  }
+
+  pthread_join(tid, NULL);
+
+  REQUIRE_EQ(oneshot_set(&jobs[0].done, NULL, 0), ctcom_invalid_arguments);
+}
+
+int oneshot_callback_runs = 0;
+
+void oneshot_count_and_free(ctcomm_oneshot* cell, void* value,
+                            uint32_t size) {
+  ++oneshot_callback_runs;
+  REQUIRE_EQ(size, 1);
+  free(value);
+  free(cell);
+}
+
+TEST(oneshot, timeouts_and_callbacks) {
+  ctcomm_oneshot* cell = (ctcomm_oneshot*)malloc(sizeof(ctcomm_oneshot));
+  oneshot_init(cell);
+
+  void* value = NULL;
+  struct timespec timeout = {0, 10000000};
+  REQUIRE_EQ(oneshot_try_get(cell, &value), ctcom_container_empty);
+  REQUIRE_EQ(oneshot_timed_wait(cell, &value, &timeout), ctcom_timedout);
+  REQUIRE_EQ(value, NULL);
+
+  // The waiter has given up, the setter runs the callback instead.
+  REQUIRE_EQ(oneshot_on_set(cell, oneshot_count_and_free),
+             ctcom_success_threshold);
+  REQUIRE_EQ(oneshot_on_set(cell, oneshot_count_and_free),
+             ctcom_invalid_arguments);
+  REQUIRE_EQ(oneshot_set(cell, malloc(1), 1), ctcom_success_threshold);
+  REQUIRE_EQ(oneshot_callback_runs, 1);
+
+  // Already set, the callback runs right away.
+  cell = (ctcomm_oneshot*)malloc(sizeof(ctcomm_oneshot));
+  oneshot_init(cell);
+  REQUIRE_EQ(oneshot_set(cell, malloc(1), 1), ctcom_success_threshold);
+  REQUIRE_EQ(oneshot_on_set(cell, oneshot_count_and_free),
+             ctcom_success_threshold);
+  REQUIRE_EQ(oneshot_callback_runs, 2);
+}
+
+#define RACING_SETTERS 4
+#define RACED_CELLS 20000
+
+typedef struct oneshot_race {
+  pthread_barrier_t start;
+  ctcomm_oneshot cells[RACED_CELLS];
+  bool won[RACING_SETTERS][RACED_CELLS];
+} oneshot_race;
+
+typedef struct oneshot_setter {
+  oneshot_race* race;
+  int id;
+} oneshot_setter;
+
+int oneshot_race_callback_runs = 0;
+
+void oneshot_count_race_callback(ctcomm_oneshot* cell, void* value,
+                                 uint32_t size) {
+  (void)cell;
+  (void)value;
+  (void)size;
+  __atomic_add_fetch(&oneshot_race_callback_runs, 1, __ATOMIC_SEQ_CST);
+}
+
+// Each setter's value is made of its id and the cell index.
+void* oneshot_race_value(int setter, int cell) {
+  return (void*)(uintptr_t)(setter * RACED_CELLS + cell + 1);
+}
+
+void* oneshot_setter_thread(void* args) {
+  // Using direct assertions in helper threads
+  oneshot_setter* setter = (oneshot_setter*)args;
+  oneshot_race* race = setter->race;
+
+  pthread_barrier_wait(&race->start);
+  for (int i = 0; i < RACED_CELLS; ++i) {
+    int retval = oneshot_set(&race->cells[i],
+                             oneshot_race_value(setter->id, i), 1);
+    assert(retval == ctcom_success_threshold ||
+           retval == ctcom_invalid_arguments);
+    race->won[setter->id][i] = retval == ctcom_success_threshold;
+  }
+
+  return NULL;
+}
+
+TEST(oneshot, racing_setters) {
+  oneshot_race* race = (oneshot_race*)calloc(1, sizeof(oneshot_race));
+  REQUIRE_NE((void*)race, NULL);
+  pthread_barrier_init(&race->start, NULL, RACING_SETTERS);
+  for (int i = 0; i < RACED_CELLS; ++i) {
+    oneshot_init(&race->cells[i]);
+    // Half of them are waited for through a callback.
+    if (i % 2) {
+      REQUIRE_EQ(oneshot_on_set(&race->cells[i],
+                                oneshot_count_race_callback),
+                 ctcom_success_threshold);
+    }
+  }
+
+  pthread_t tids[RACING_SETTERS];
+  oneshot_setter setters[RACING_SETTERS];
+  for (int t = 0; t < RACING_SETTERS; ++t) {
+    setters[t].race = race;
+    setters[t].id = t;
+    pthread_create(&tids[t], NULL, oneshot_setter_thread, &setters[t]);
+  }
+  for (int t = 0; t < RACING_SETTERS; ++t) {
+    pthread_join(tids[t], NULL);
+  }
+
+  // Exactly one setter wins every cell, and its value is the one kept.
+  for (int i = 0; i < RACED_CELLS; ++i) {
+    int winners = 0;
+    void* expected = NULL;
+    for (int t = 0; t < RACING_SETTERS; ++t) {
+      if (race->won[t][i]) {
+        ++winners;
+        expected = oneshot_race_value(t, i);
+      }
+    }
+    REQUIRE_EQ(winners, 1);
+    void* value = NULL;
+    REQUIRE_EQ(oneshot_try_get(&race->cells[i], &value), 1);
+    REQUIRE_EQ(value, expected);
+  }
+  REQUIRE_EQ(oneshot_race_callback_runs, RACED_CELLS / 2);
+
+  pthread_barrier_destroy(&race->start);
+  free(race);
+}